@@ -2,7 +2,8 @@
 /*----------------------------------------------------------------------------
   File:   event.c
   Description: Rudp event handling: registering file descriptors and timeouts
-               and eventloop using the select() system call.
+               and eventloop using the select() system call, or optionally
+               io_uring on Linux.
   Author: Olof Hagsand and Peter Sjdin
   CVS Version: $Id: event.c,v 1.3 2007/05/03 10:46:06 psj Exp $
  
@@ -36,14 +37,22 @@
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <signal.h>
 #include <sys/types.h>
 #include <sys/time.h>
 #include <sys/errno.h>
+#include <sys/socket.h>
 #include <netinet/in.h>
 #include <poll.h>
 #include <assert.h>
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
 
 #include "event.h"
+#include "pool.h"
 
 /*
  * Internal types to handle eventloop
@@ -51,18 +60,383 @@
 struct event_data{
     struct event_data *e_next;          /* next in list */
     int (*e_fn)(int, void*);            /* callback function */
-    enum {EVENT_FD, EVENT_TIME} e_type; /* type of event */
+    int (*e_dfn)(int, void*, char*, int, struct sockaddr_in*); /* datagram callback */
+    enum {EVENT_FD, EVENT_TIME, EVENT_DGRAM} e_type; /* type of event */
     int e_fd;                           /* File descriptor */
     struct timeval e_time;              /* Timeout */
     void *e_arg;                        /* function argument */
     char e_string[32];                  /* string for identification/debugging */
+    int e_armed;                        /* io_uring: request in flight */
+    struct event_dgbuf *e_dg;           /* io_uring: receive buffer */
+    struct event_data *e_hnext;         /* next in fd hash bucket (EVENT_DGRAM) */
+};
+
+/*
+ * Receive state of an EVENT_DGRAM with the io_uring backend. It must
+ * stay put while the RECVMSG request is in flight.
+ */
+struct event_dgbuf{
+    struct msghdr d_msg;
+    struct iovec d_iov;
+    struct sockaddr_in d_from;
+    char d_buf[EVENT_MAXDGRAM];
+};
+
+/*
+ * An outgoing datagram queued with the io_uring backend.
+ */
+struct event_sendbuf{
+    struct msghdr s_msg;
+    struct iovec s_iov;
+    struct sockaddr_in s_to;
+    char s_buf[EVENT_MAXDGRAM];
 };
 
 /*
  * Internal variables
  */
-static struct event_data *ee = NULL;
-static struct event_data *ee_timers = NULL;
+#define URING_ENTRIES 256
+#define URING_SENDTAG 1UL
+
+/* Datagram events hashed by fd, for event_dgram_input() */
+#define EVENT_DGHASH 1024
+
+/*
+ * An event loop with everything registered with it. Each thread works on
+ * its current base, see event_base_use().
+ */
+struct event_base{
+    struct event_data *ee;
+    struct event_data *ee_timers;
+    struct event_data *ee_timers_last; /* latest timer, for appending */
+    struct event_data *ee_dead;   /* deleted, io_uring request pending */
+    int backend;
+    struct event_data *ee_dghash[EVENT_DGHASH];
+    void (*clockfn)(struct timeval *); /* virtual clock, see event_clock() */
+    /* Event records and io_uring buffers come from pools */
+    struct pool ev_pool;
+    struct pool ev_dgpool;
+    struct pool ev_sendpool;
+#ifdef __linux__
+    /*
+     * io_uring backend state. User data of a request is either an event_data
+     * (fd poll or datagram receive) or an event_sendbuf tagged with bit 0.
+     */
+    struct {
+	int fd;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq;		/* submission and completion ring mapping */
+	size_t sqlen;
+	unsigned sq_local_tail;
+	unsigned entries;
+    } ring;
+#endif
+};
+
+#ifdef __linux__
+#define EVENT_RING_INIT {-1}
+#else
+#define EVENT_RING_INIT
+#endif
+#define EVENT_BASE_INIT {NULL, NULL, NULL, NULL, EVENT_BACKEND_SELECT, {NULL}, NULL, \
+	POOL_INIT("event", sizeof(struct event_data)),			\
+	POOL_INIT("event_recvbuf", sizeof(struct event_dgbuf)),		\
+	POOL_INIT("event_sendbuf", sizeof(struct event_sendbuf)),	\
+	EVENT_RING_INIT}
+
+static struct event_base event_default = EVENT_BASE_INIT;
+static __thread struct event_base *eb = &event_default;
+
+static int event_periodic_cb(int fd, void *arg);
+static int event_dgram_drain(int fd, int n);
+
+#ifdef __linux__
+static int
+uring_enter(unsigned to_submit, unsigned min_complete, struct timespec *ts)
+{
+    struct io_uring_getevents_arg arg;
+
+    if (min_complete){
+	memset(&arg, 0, sizeof(arg));
+	arg.sigmask_sz = _NSIG / 8;
+	arg.ts = (unsigned long)ts;
+	return syscall(__NR_io_uring_enter, eb->ring.fd, to_submit, min_complete,
+		       IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, 
+		       &arg, sizeof(arg));
+    }
+    return syscall(__NR_io_uring_enter, eb->ring.fd, to_submit, 0, 0, NULL, 0);
+}
+
+/*
+ * Number of queued requests the kernel has not consumed yet.
+ */
+static unsigned
+uring_unsubmitted()
+{
+    return eb->ring.sq_local_tail - __atomic_load_n(eb->ring.sq_head, __ATOMIC_ACQUIRE);
+}
+
+static int
+uring_setup()
+{
+    struct io_uring_params p;
+    void *sq;
+    size_t sqlen, cqlen;
+
+    memset(&p, 0, sizeof(p));
+    eb->ring.fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+    if (eb->ring.fd < 0)
+	return -1;
+    if (!(p.features & IORING_FEAT_EXT_ARG) || 
+	!(p.features & IORING_FEAT_SINGLE_MMAP)){
+	close(eb->ring.fd);
+	eb->ring.fd = -1;
+	return -1;
+    }
+    sqlen = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cqlen = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (cqlen > sqlen)
+	sqlen = cqlen;
+    sq = mmap(NULL, sqlen, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+	      eb->ring.fd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED){
+	close(eb->ring.fd);
+	eb->ring.fd = -1;
+	return -1;
+    }
+    eb->ring.sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+		     PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+		     eb->ring.fd, IORING_OFF_SQES);
+    if (eb->ring.sqes == MAP_FAILED){
+	munmap(sq, sqlen);
+	close(eb->ring.fd);
+	eb->ring.fd = -1;
+	return -1;
+    }
+    /* Single mmap: completion ring shares the submission ring mapping */
+    eb->ring.sq_head = sq + p.sq_off.head;
+    eb->ring.sq_tail = sq + p.sq_off.tail;
+    eb->ring.sq_mask = sq + p.sq_off.ring_mask;
+    eb->ring.sq_array = sq + p.sq_off.array;
+    eb->ring.cq_head = sq + p.cq_off.head;
+    eb->ring.cq_tail = sq + p.cq_off.tail;
+    eb->ring.cq_mask = sq + p.cq_off.ring_mask;
+    eb->ring.cqes = sq + p.cq_off.cqes;
+    eb->ring.sq = sq;
+    eb->ring.sqlen = sqlen;
+    eb->ring.entries = p.sq_entries;
+    eb->ring.sq_local_tail = *eb->ring.sq_tail;
+    return 0;
+}
+
+/*
+ * Get a free submission queue entry. Flush to the kernel if the queue is full.
+ */
+static struct io_uring_sqe *
+uring_sqe()
+{
+    struct io_uring_sqe *sqe;
+    unsigned idx;
+
+    while (uring_unsubmitted() >= eb->ring.entries)
+	if (uring_enter(uring_unsubmitted(), 0, NULL) < 0 && errno != EAGAIN 
+	    && errno != EBUSY && errno != EINTR){
+	    perror("event: io_uring_enter");
+	    return NULL;
+	}
+    idx = eb->ring.sq_local_tail & *eb->ring.sq_mask;
+    sqe = &eb->ring.sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    eb->ring.sq_array[idx] = idx;
+    eb->ring.sq_local_tail++;
+    __atomic_store_n(eb->ring.sq_tail, eb->ring.sq_local_tail, __ATOMIC_RELEASE);
+    return sqe;
+}
+
+/*
+ * Arm a registered file descriptor: a one-shot poll for plain fds, a
+ * receive for datagram sockets.
+ */
+static int
+uring_arm(struct event_data *e)
+{
+    struct io_uring_sqe *sqe;
+    struct event_dgbuf *d;
+
+    if (e->e_type == EVENT_DGRAM && e->e_dg == NULL && 
+	(e->e_dg = pool_get(&eb->ev_dgpool)) == NULL){
+	perror("event: pool_get");
+	return -1;
+    }
+    if ((sqe = uring_sqe()) == NULL)
+	return -1;
+    sqe->fd = e->e_fd;
+    sqe->user_data = (unsigned long)e;
+    if (e->e_type == EVENT_DGRAM){
+	d = e->e_dg;
+	memset(&d->d_msg, 0, sizeof(d->d_msg));
+	d->d_iov.iov_base = d->d_buf;
+	d->d_iov.iov_len = sizeof(d->d_buf);
+	d->d_msg.msg_name = &d->d_from;
+	d->d_msg.msg_namelen = sizeof(d->d_from);
+	d->d_msg.msg_iov = &d->d_iov;
+	d->d_msg.msg_iovlen = 1;
+	sqe->opcode = IORING_OP_RECVMSG;
+	sqe->addr = (unsigned long)&d->d_msg;
+	sqe->len = 1;
+    }
+    else{
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->poll32_events = POLLIN;
+    }
+    e->e_armed = 1;
+    return 0;
+}
+
+/*
+ * Cancel an armed request. The event_data is freed when its completion arrives.
+ */
+static void
+uring_cancel(struct event_data *e)
+{
+    struct io_uring_sqe *sqe;
+
+    if ((sqe = uring_sqe()) == NULL)
+	return;
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = (unsigned long)e;
+    sqe->user_data = 0;
+}
+#endif /* __linux__ */
+
+/*
+ * Free an event record, or park it until its io_uring request completes.
+ */
+static void
+event_free(struct event_data *e)
+{
+#ifdef __linux__
+    if (e->e_armed){
+	uring_cancel(e);
+	e->e_next = eb->ee_dead;
+	eb->ee_dead = e;
+	return;
+    }
+#endif
+    pool_put(&eb->ev_dgpool, e->e_dg);
+    pool_put(&eb->ev_pool, e);
+}
+
+/*
+ * Create an event base. It is empty and uses the select backend until
+ * changed with event_backend() while it is current.
+ */
+struct event_base *
+event_base_new()
+{
+    struct event_base *b;
+    static const struct event_base init = EVENT_BASE_INIT;
+
+    if ((b = malloc(sizeof(*b))) == NULL){
+	perror("event_base_new: malloc");
+	return NULL;
+    }
+    memcpy(b, &init, sizeof(*b));
+    return b;
+}
+
+/*
+ * Make <b> the current base of the calling thread, NULL for the default
+ * base. All other functions, eventloop() included, work on the current
+ * base. Returns the previous one.
+ */
+struct event_base *
+event_base_use(struct event_base *b)
+{
+    struct event_base *old = eb;
+
+    eb = b ? b : &event_default;
+    return old == &event_default ? NULL : old;
+}
+
+/*
+ * Free an event base with everything registered with it. Registered file
+ * descriptors are not closed.
+ */
+void
+event_base_free(struct event_base *b)
+{
+    struct event_data *e;
+
+    if (b == NULL || b == &event_default)
+	return;
+    for (e = b->ee_timers; e; e = e->e_next)
+	if (e->e_fn == event_periodic_cb)
+	    free(e->e_arg);
+#ifdef __linux__
+    if (b->ring.fd >= 0){
+	munmap(b->ring.sqes, b->ring.entries * sizeof(struct io_uring_sqe));
+	munmap(b->ring.sq, b->ring.sqlen);
+	close(b->ring.fd);
+    }
+#endif
+    pool_destroy(&b->ev_pool);
+    pool_destroy(&b->ev_dgpool);
+    pool_destroy(&b->ev_sendpool);
+    if (eb == b)
+	eb = &event_default;
+    free(b);
+}
+
+/*
+ * Pools of the current base, for statistics. Returns NULL after the last.
+ */
+struct pool *
+event_pool(int i)
+{
+    switch (i){
+    case 0:
+	return &eb->ev_pool;
+    case 1:
+	return &eb->ev_dgpool;
+    case 2:
+	return &eb->ev_sendpool;
+    }
+    return NULL;
+}
+
+/*
+ * Make sure n more event records (timers) can be registered without
+ * allocating memory.
+ */
+int
+event_reserve(int n)
+{
+    return pool_reserve(&eb->ev_pool, n);
+}
+
+/*
+ * Select event backend. Must be called before eventloop() is entered.
+ * Returns the backend in effect, which is EVENT_BACKEND_SELECT if io_uring
+ * is not supported by the kernel.
+ */
+int
+event_backend(int b)
+{
+#ifdef __linux__
+    if (b == EVENT_BACKEND_URING && eb->ring.fd < 0 && uring_setup() < 0){
+	fprintf(stderr, "event_backend: io_uring unavailable, using select\n");
+	b = EVENT_BACKEND_SELECT;
+    }
+#else
+    b = EVENT_BACKEND_SELECT;
+#endif
+    eb->backend = b;
+    return eb->backend;
+}
 
 /*
  * Sort into internal event list
@@ -76,9 +450,9 @@ event_timeout(struct timeval t,
 {
     struct event_data *e, *e1, **e_prev;
 
-    e = (struct event_data *)malloc(sizeof(struct event_data));
+    e = (struct event_data *)pool_get(&eb->ev_pool);
     if (e == NULL){
-	perror("event_timeout: malloc");
+	perror("event_timeout: pool_get");
 	return -1;
     }
     memset(e, 0, sizeof(struct event_data));
@@ -88,18 +462,105 @@ event_timeout(struct timeval t,
     e->e_type = EVENT_TIME;
     e->e_time = t;
 
+    /* Timers are mostly registered in expiry order: append in O(1) */
+    if (eb->ee_timers_last && !timercmp(&e->e_time, &eb->ee_timers_last->e_time, <)){
+	eb->ee_timers_last->e_next = e;
+	eb->ee_timers_last = e;
+	return 0;
+    }
     /* Sort into right place */
-    e_prev = &ee_timers;
-    for (e1 = ee_timers; e1; e1 =e1->e_next){
+    e_prev = &eb->ee_timers;
+    for (e1 = eb->ee_timers; e1; e1 =e1->e_next){
 	if (timercmp(&e->e_time, &e1->e_time, <))
 	    break;
 	e_prev = &e1->e_next;
     }
     e->e_next = e1;
     *e_prev = e;
+    if (e1 == NULL)
+	eb->ee_timers_last = e;
     return 0;
 }
 
+/*
+ * Current time: gettimeofday(), or the clock installed with event_clock().
+ */
+void
+event_gettime(struct timeval *t)
+{
+    if (eb->clockfn)
+	(*eb->clockfn)(t);
+    else
+	gettimeofday(t, NULL);
+}
+
+/*
+ * Replace the time source of timers, e.g. with a simulated clock.
+ * NULL restores gettimeofday().
+ */
+void
+event_clock(void (*fn)(struct timeval *))
+{
+    eb->clockfn = fn;
+}
+
+/*
+ * State of a periodic timer, see event_periodic()
+ */
+struct event_periodic_data{
+    int p_secs;                         /* Period in seconds */
+    int (*p_fn)(int, void*);            /* callback function */
+    void *p_arg;                        /* function argument */
+    char p_string[32];                  /* string for identification/debugging */
+};
+
+static int
+event_periodic_cb(int fd, void *arg)
+{
+    struct event_periodic_data *p = (struct event_periodic_data *)arg;
+    struct timeval t;
+
+    if ((*p->p_fn)(fd, p->p_arg) < 0){
+	free(p);
+	return -1;
+    }
+    /* A periodic timer alone does not keep the event loop running */
+    if (eb->ee == NULL && eb->ee_timers == NULL){
+	free(p);
+	return 0;
+    }
+    event_gettime(&t);
+    t.tv_sec += p->p_secs;
+    return event_timeout(t, event_periodic_cb, p, p->p_string);
+}
+
+/*
+ * Register a function to be called every <secs> seconds, as long as
+ * there are other events registered.
+ */
+int
+event_periodic(int secs,  
+	       int (*fn)(int, void*), 
+	       void *arg, 
+	       char *str)
+{
+    struct event_periodic_data *p;
+    struct timeval t;
+
+    if ((p = malloc(sizeof(*p))) == NULL){
+	perror("event_periodic: malloc");
+	return -1;
+    }
+    p->p_secs = secs;
+    p->p_fn = fn;
+    p->p_arg = arg;
+    strncpy(p->p_string, str, sizeof(p->p_string) - 1);
+    p->p_string[sizeof(p->p_string) - 1] = '\0';
+    event_gettime(&t);
+    t.tv_sec += secs;
+    return event_timeout(t, event_periodic_cb, p, p->p_string);
+}
+
 /*
  * Deregister a rudp event.
  */
@@ -113,7 +574,10 @@ event_delete(struct event_data **firstp, int (*fn)(int, void*),
     for (e = *firstp; e; e = e->e_next){
 	if (fn == e->e_fn && arg == e->e_arg) {
 	    *e_prev = e->e_next;
-	    free(e);
+	    /* e_next is the first member, so e_prev is the previous entry */
+	    if (firstp == &eb->ee_timers && e == eb->ee_timers_last)
+		eb->ee_timers_last = e_prev == firstp ? NULL : (struct event_data *)e_prev;
+	    event_free(e);
 	    return 0;
 	}
 	e_prev = &e->e_next;
@@ -129,7 +593,7 @@ int
 event_timeout_delete(int (*fn)(int, void*), 
 		  void *arg)
 {
-    return event_delete(&ee_timers, fn, arg);
+    return event_delete(&eb->ee_timers, fn, arg);
 }
 
 /*
@@ -139,7 +603,7 @@ int
 event_fd_delete(int (*fn)(int, void*), 
 		  void *arg)
 {
-    return event_delete(&ee, fn, arg);
+    return event_delete(&eb->ee, fn, arg);
 }
 
 /*
@@ -153,9 +617,9 @@ event_fd(int fd, int (*fn)(int, void*), void *arg, char *str)
 {
     struct event_data *e;
 
-    e = (struct event_data *)malloc(sizeof(struct event_data));
+    e = (struct event_data *)pool_get(&eb->ev_pool);
     if (e==NULL){
-	perror("event_fd: malloc");
+	perror("event_fd: pool_get");
 	return -1;
     }
     memset(e, 0, sizeof(struct event_data));
@@ -164,11 +628,302 @@ event_fd(int fd, int (*fn)(int, void*), void *arg, char *str)
     e->e_fn = fn;
     e->e_arg = arg;
     e->e_type = EVENT_FD;
-    e->e_next = ee;
-    ee = e;
+    e->e_next = eb->ee;
+    eb->ee = e;
+    return 0;
+}
+
+
+/*
+ * Register a datagram socket. When a datagram arrives on <fd>, it is read
+ * by the event loop and <fn> is called with its contents and source address.
+ * The buffer is only valid during the call.
+ */
+int
+event_dgram(int fd, int (*fn)(int, void*, char*, int, struct sockaddr_in*), 
+	    void *arg, char *str)
+{
+    struct event_data *e;
+
+    if (event_fd(fd, NULL, arg, str) < 0)
+	return -1;
+    e = eb->ee;
+    e->e_dfn = fn;
+    e->e_type = EVENT_DGRAM;
+    e->e_hnext = eb->ee_dghash[fd % EVENT_DGHASH];
+    eb->ee_dghash[fd % EVENT_DGHASH] = e;
+    return 0;
+}
+
+/*
+ * Deregister a datagram socket.
+ */
+int
+event_dgram_delete(int (*fn)(int, void*, char*, int, struct sockaddr_in*), 
+		   void *arg)
+{
+    struct event_data *e, **e_prev;
+
+    e_prev = &eb->ee;
+    for (e = eb->ee; e; e = e->e_next){
+	if (e->e_type == EVENT_DGRAM && fn == e->e_dfn && arg == e->e_arg) {
+	    *e_prev = e->e_next;
+	    for (e_prev = &eb->ee_dghash[e->e_fd % EVENT_DGHASH]; *e_prev != e; 
+		 e_prev = &(*e_prev)->e_hnext)
+		;
+	    *e_prev = e->e_hnext;
+	    event_free(e);
+#ifdef __linux__
+	    /* Queued sends go to the kernel before the caller closes <fd> */
+	    if (eb->backend == EVENT_BACKEND_URING && uring_unsubmitted())
+		uring_enter(uring_unsubmitted(), 0, NULL);
+#endif
+	    return 0;
+	}
+	e_prev = &e->e_next;
+    }
+    return -1;
+}
+
+/*
+ * Send a datagram. With the io_uring backend the datagram is copied and
+ * queued, and goes out with the next batch the event loop submits.
+ */
+int
+event_sendto(int fd, void *buf, int len, struct sockaddr_in *to)
+{
+#ifdef __linux__
+    struct event_sendbuf *sb;
+    struct io_uring_sqe *sqe;
+
+    if (eb->backend == EVENT_BACKEND_URING && len <= EVENT_MAXDGRAM){
+	if ((sb = pool_get(&eb->ev_sendpool)) == NULL){
+	    perror("event_sendto: pool_get");
+	    return -1;
+	}
+	memcpy(sb->s_buf, buf, len);
+	sb->s_to = *to;
+	sb->s_iov.iov_base = sb->s_buf;
+	sb->s_iov.iov_len = len;
+	memset(&sb->s_msg, 0, sizeof(sb->s_msg));
+	sb->s_msg.msg_name = &sb->s_to;
+	sb->s_msg.msg_namelen = sizeof(sb->s_to);
+	sb->s_msg.msg_iov = &sb->s_iov;
+	sb->s_msg.msg_iovlen = 1;
+	if ((sqe = uring_sqe()) == NULL){
+	    pool_put(&eb->ev_sendpool, sb);
+	    return -1;
+	}
+	sqe->opcode = IORING_OP_SENDMSG;
+	sqe->fd = fd;
+	sqe->addr = (unsigned long)&sb->s_msg;
+	sqe->len = 1;
+	sqe->user_data = (unsigned long)sb | URING_SENDTAG;
+	return len;
+    }
+#endif
+    return sendto(fd, buf, len, 0, (struct sockaddr *)to, sizeof(struct sockaddr_in));
+}
+
+/*
+ * Invoke the callback of a ready fd event. Datagram sockets are read here.
+ */
+static int
+event_dispatch(struct event_data *e)
+{
+    if (e->e_type == EVENT_FD)
+	return (*e->e_fn)(e->e_fd, e->e_arg);
+    return event_dgram_drain(e->e_fd, 0);
+}
+
+/*
+ * The datagram event registered for <fd>, NULL if none.
+ */
+static struct event_data *
+event_dgram_find(int fd)
+{
+    struct event_data *e;
+
+    for (e = eb->ee_dghash[fd % EVENT_DGHASH]; e; e = e->e_hnext)
+	if (e->e_fd == fd)
+	    return e;
+    return NULL;
+}
+
+/*
+ * Read the datagrams queued on a ready socket, <n> of them already
+ * handled, up to EVENT_DGBATCH. A callback may deregister the socket, so
+ * the event is looked up again for every datagram.
+ */
+static int
+event_dgram_drain(int fd, int n)
+{
+    char buf[EVENT_MAXDGRAM];
+    struct event_data *e;
+    struct sockaddr_in from;
+    socklen_t fromlen;
+    int len;
+
+    for (; n < EVENT_DGBATCH && (e = event_dgram_find(fd)); n++){
+	fromlen = sizeof(from);
+	len = recvfrom(fd, buf, sizeof(buf), n ? MSG_DONTWAIT : 0, 
+		       (struct sockaddr *)&from, &fromlen);
+	if (len < 0){
+	    if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)
+		return 0;
+	    perror("eventloop: recvfrom");
+	    return -1;
+	}
+	if ((*e->e_dfn)(e->e_fd, e->e_arg, buf, len, &from) < 0)
+	    return -1;
+    }
+    return 0;
+}
+
+/*
+ * Hooks for driving events without eventloop(), as done by a simulator.
+ */
+
+/*
+ * Absolute time of the first pending timer. Returns -1 if there is none.
+ */
+int
+event_next_timeout(struct timeval *t)
+{
+    if (eb->ee_timers == NULL)
+	return -1;
+    *t = eb->ee_timers->e_time;
+    return 0;
+}
+
+/*
+ * Run all timers that have expired at the current time.
+ */
+int
+event_run_timers()
+{
+    struct event_data *e;
+    struct timeval t0;
+    int res;
+
+    event_gettime(&t0);
+    while (eb->ee_timers && !timercmp(&eb->ee_timers->e_time, &t0, >)){
+	e = eb->ee_timers;
+	eb->ee_timers = eb->ee_timers->e_next;
+	if (eb->ee_timers == NULL)
+	    eb->ee_timers_last = NULL;
+	res = (*e->e_fn)(0, e->e_arg);
+	pool_put(&eb->ev_pool, e);
+	if (res < 0)
+	    return -1;
+    }
     return 0;
 }
 
+/*
+ * Hand a datagram to the callback registered with event_dgram() for <fd>.
+ * Returns 0 if nobody is registered for <fd>.
+ */
+int
+event_dgram_input(int fd, char *buf, int len, struct sockaddr_in *from)
+{
+    struct event_data *e;
+
+    if ((e = event_dgram_find(fd)) != NULL)
+	return (*e->e_dfn)(e->e_fd, e->e_arg, buf, len, from);
+    return 0;
+}
+
+#ifdef __linux__
+/*
+ * io_uring event loop. Polls, receives and sends accumulated during one
+ * iteration are submitted together with the wait in a single system call.
+ */
+static int
+eventloop_uring()
+{
+    struct event_data *e, **e_prev;
+    struct io_uring_cqe *cqe;
+    struct timespec ts, *tsp;
+    struct timeval t, t0;
+    unsigned head;
+    int res, fd;
+
+    while (eb->ee || eb->ee_timers){
+	/* Expired timers first */
+	if (event_run_timers() < 0)
+	    return -1;
+	if (!eb->ee && !eb->ee_timers)
+	    break;
+	for (e = eb->ee; e; e = e->e_next)
+	    if (!e->e_armed && uring_arm(e) < 0)
+		return -1;
+	tsp = NULL;
+	if (eb->ee_timers){
+	    event_gettime(&t0);
+	    timersub(&eb->ee_timers->e_time, &t0, &t);
+	    if (t.tv_sec < 0)
+		timerclear(&t);
+	    ts.tv_sec = t.tv_sec;
+	    ts.tv_nsec = t.tv_usec * 1000;
+	    tsp = &ts;
+	}
+	if (uring_enter(uring_unsubmitted(), 1, tsp) < 0 && 
+	    errno != ETIME && errno != EINTR && errno != EBUSY){
+	    perror("eventloop: io_uring_enter");
+	    return -1;
+	}
+	head = *eb->ring.cq_head;
+	while (head != __atomic_load_n(eb->ring.cq_tail, __ATOMIC_ACQUIRE)){
+	    cqe = &eb->ring.cqes[head & *eb->ring.cq_mask];
+	    head++;
+	    if (cqe->user_data == 0)
+		continue; /* cancellation */
+	    if (cqe->user_data & URING_SENDTAG){
+		if (cqe->res < 0)
+		    fprintf(stderr, "eventloop: sendmsg: %s\n", strerror(-cqe->res));
+		pool_put(&eb->ev_sendpool, (void *)(unsigned long)(cqe->user_data & ~URING_SENDTAG));
+		continue;
+	    }
+	    e = (struct event_data *)(unsigned long)cqe->user_data;
+	    res = cqe->res;
+	    e->e_armed = 0;
+	    /* Reap deleted events */
+	    for (e_prev = &eb->ee_dead; *e_prev; e_prev = &(*e_prev)->e_next)
+		if (*e_prev == e){
+		    *e_prev = e->e_next;
+		    pool_put(&eb->ev_dgpool, e->e_dg);
+		    pool_put(&eb->ev_pool, e);
+		    e = NULL;
+		    break;
+		}
+	    if (e == NULL)
+		continue;
+	    /* The callback may queue requests; let the kernel reuse the CQE */
+	    __atomic_store_n(eb->ring.cq_head, head, __ATOMIC_RELEASE);
+	    if (e->e_type == EVENT_DGRAM){
+		if (res < 0){
+		    if (res != -EINTR && res != -EAGAIN)
+			fprintf(stderr, "eventloop: recvmsg: %s\n", strerror(-res));
+		    continue;
+		}
+		fd = e->e_fd;
+		res = (*e->e_dfn)(e->e_fd, e->e_arg, e->e_dg->d_buf, res, 
+				  &e->e_dg->d_from);
+		/* Then what else is queued, while no receive is armed */
+		if (res >= 0)
+		    res = event_dgram_drain(fd, 1);
+	    }
+	    else
+		res = (*e->e_fn)(e->e_fd, e->e_arg);
+	    if (res < 0)
+		return -1;
+	}
+	__atomic_store_n(eb->ring.cq_head, head, __ATOMIC_RELEASE);
+    }
+    return 0;
+}
+#endif /* __linux__ */
 
 /*
  * Rudp event loop.
@@ -182,15 +937,19 @@ eventloop()
     int n;
     struct timeval t, t0;
 
-    while (ee || ee_timers){
+#ifdef __linux__
+    if (eb->backend == EVENT_BACKEND_URING)
+	return eventloop_uring();
+#endif
+    while (eb->ee || eb->ee_timers){
 	FD_ZERO(&fdset);
-	for (e=ee; e; e=e->e_next)
-	    if (e->e_type == EVENT_FD)
+	for (e=eb->ee; e; e=e->e_next)
+	    if (e->e_type == EVENT_FD || e->e_type == EVENT_DGRAM)
 		FD_SET(e->e_fd, &fdset);
 
-	if (ee_timers){
-	    gettimeofday(&t0, NULL);
-	    timersub(&ee_timers->e_time, &t0, &t); 
+	if (eb->ee_timers){
+	    event_gettime(&t0);
+	    timersub(&eb->ee_timers->e_time, &t0, &t); 
 	    if (t.tv_sec < 0)
 		n = 0;
 	    else
@@ -203,8 +962,10 @@ eventloop()
 	    if (errno != EINTR)
 		perror("eventloop: select");
 	if (n == 0) {  /* Timeout */
-	    e = ee_timers;
-	    ee_timers = ee_timers->e_next;
+	    e = eb->ee_timers;
+	    eb->ee_timers = eb->ee_timers->e_next;
+	    if (eb->ee_timers == NULL)
+		eb->ee_timers_last = NULL;
 #ifdef DEBUG
 	    fprintf(stderr, "eventloop: timeout : %s[arg: %x]\n", 
 		    e->e_string, (int)e->e_arg);
@@ -215,22 +976,23 @@ eventloop()
 	    }
 	    switch(e->e_type) {
 	    case EVENT_TIME:
-		free(e);
+		pool_put(&eb->ev_pool, e);
 		break;
 	    default:
 		fprintf(stderr, "eventloop: illegal e_type:%d\n", e->e_type);
 	    }
 	    continue;
 	}
-	e = ee;
+	e = eb->ee;
 	while (e) {
 		e1 = e->e_next;
-	    if (e->e_type == EVENT_FD && FD_ISSET(e->e_fd, &fdset)){
+	    if ((e->e_type == EVENT_FD || e->e_type == EVENT_DGRAM) && 
+		FD_ISSET(e->e_fd, &fdset)){
 #ifdef DEBUG
 		fprintf(stderr, "eventloop: socket rcv: %s[fd: %d arg: %x]\n", 
 			e->e_string, e->e_fd, (int)e->e_arg);
 #endif /* DEBUG */
-		if ((*e->e_fn)(e->e_fd, e->e_arg) < 0) {
+		if (event_dispatch(e) < 0) {
 		    return  -1;
 		}
 	    }
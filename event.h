@@ -32,9 +32,33 @@
  */
 
 
+#define EVENT_MAXDGRAM 2048	/* Largest datagram handled by event_dgram() */
+#define EVENT_DGBATCH 64	/* Datagrams read from a socket when it is ready */
+
+/*
+ * Event backends, see event_backend()
+ */
+#define EVENT_BACKEND_SELECT	0
+#define EVENT_BACKEND_URING	1
+
+struct sockaddr_in;
+struct event_base;
+struct pool;
+
 /*
  * Prototypes
  */
+int event_backend(int backend);
+
+/* Independent event loops. Each thread works on its current base */
+struct event_base *event_base_new();
+struct event_base *event_base_use(struct event_base *b);
+void event_base_free(struct event_base *b);
+struct pool *event_pool(int i);
+
+void event_gettime(struct timeval *t);
+void event_clock(void (*fn)(struct timeval *));
+
 int event_timeout(struct timeval timer,  
 		       int (*callback)(int, void*), void *callback_arg, char *idstr);
 
@@ -47,6 +71,18 @@ event_periodic(int secs,
 int event_timeout_delete(int (*callback)(int, void*), void *callback_arg);
 int event_fd_delete(int (*callback)(int, void*), void *callback_arg);
 int event_fd(int fd, int (*callback)(int, void*), void *callback_arg, char *idstr);
+int event_dgram(int fd, 
+		int (*callback)(int, void*, char*, int, struct sockaddr_in*), 
+		void *callback_arg, char *idstr);
+int event_dgram_delete(int (*callback)(int, void*, char*, int, struct sockaddr_in*), 
+		       void *callback_arg);
+int event_sendto(int fd, void *buf, int len, struct sockaddr_in *to);
+int event_reserve(int n);
+
+/* Driving events without eventloop() */
+int event_next_timeout(struct timeval *t);
+int event_run_timers();
+int event_dgram_input(int fd, char *buf, int len, struct sockaddr_in *from);
 int eventloop();
 
 #endif /* EVENT_H */
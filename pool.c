@@ -0,0 +1,175 @@
+/*
+ * pool.c: fixed-size object pools for packet buffers, connection state
+ * and event records.
+ *
+ * Objects are carved from slabs and aligned to a cache line, so that a
+ * hot object never shares a line with its neighbour. With huge pages
+ * enabled (pool_hugepages() or the environment variable RUDP_HUGEPAGES)
+ * a slab is a 2 MB huge page when the system has any reserved, and
+ * otherwise an anonymous mapping advised for transparent huge pages.
+ * Pools are not locked: like the rest of a RUDP context they belong to
+ * the thread running its event loop.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+
+#include "pool.h"
+
+struct pool_slab {
+    struct pool_slab *next;
+    size_t bytes;
+    int mapped; //allocated with mmap() rather than posix_memalign()
+};
+
+#define SLAB_HDR	((sizeof (struct pool_slab) + POOL_ALIGN - 1) & ~(size_t) (POOL_ALIGN - 1))
+
+static int hugepages = -1; //-1 until set or read from the environment
+
+/*
+ * pool_hugepages: back slabs allocated from now on with huge pages.
+ * Returns the previous setting.
+ */
+int pool_hugepages(int on) {
+    int old = hugepages > 0;
+    hugepages = on != 0;
+    return old;
+}
+
+static size_t objsize(struct pool *p) {
+    size_t size = p->size < sizeof (void *) ? sizeof (void *) : p->size;
+    return (size + POOL_ALIGN - 1) & ~(size_t) (POOL_ALIGN - 1);
+}
+
+/*
+ * slab_alloc: get memory for one slab, huge pages first if enabled
+ */
+static struct pool_slab *slab_alloc(struct pool *p, size_t *bytes, int *mapped) {
+    void *m;
+    size_t need = SLAB_HDR + p->stats.objsize;
+
+    if (hugepages < 0) {
+        hugepages = getenv("RUDP_HUGEPAGES") != NULL && atoi(getenv("RUDP_HUGEPAGES")) > 0;
+    }
+    if (hugepages) {
+        *bytes = (need + POOL_HUGESIZE - 1) & ~(size_t) (POOL_HUGESIZE - 1);
+#ifdef MAP_HUGETLB
+        m = mmap(NULL, *bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (m != MAP_FAILED) {
+            p->stats.huge_slabs++;
+            *mapped = 1;
+            return m;
+        }
+#endif
+        m = mmap(NULL, *bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (m != MAP_FAILED) {
+#ifdef MADV_HUGEPAGE
+            madvise(m, *bytes, MADV_HUGEPAGE);
+#endif
+            *mapped = 1;
+            return m;
+        }
+    }
+    *bytes = need > POOL_SLABSIZE ? need : POOL_SLABSIZE;
+    if (posix_memalign(&m, POOL_ALIGN, *bytes) != 0) {
+        return NULL;
+    }
+    *mapped = 0;
+    return m;
+}
+
+/*
+ * pool_grow: add a slab and put its objects on the free list
+ */
+static int pool_grow(struct pool *p) {
+    struct pool_slab *s;
+    size_t bytes, off;
+    int mapped;
+    char *obj;
+
+    if (p->stats.objsize == 0) {
+        p->stats.objsize = objsize(p);
+    }
+    if ((s = slab_alloc(p, &bytes, &mapped)) == NULL) {
+        fprintf(stderr, "pool %s: out of memory\n", p->name);
+        return -1;
+    }
+    s->bytes = bytes;
+    s->mapped = mapped;
+    s->next = p->slabs;
+    p->slabs = s;
+    p->stats.slabs++;
+    //push in reverse so that objects are handed out in address order
+    for (off = SLAB_HDR + (bytes - SLAB_HDR) / p->stats.objsize * p->stats.objsize;
+            off > SLAB_HDR; ) {
+        off -= p->stats.objsize;
+        obj = (char *) s + off;
+        *(void **) obj = p->free;
+        p->free = obj;
+        p->stats.capacity++;
+    }
+    return 0;
+}
+
+/*
+ * pool_get: allocate an object. Its contents are undefined.
+ */
+void *pool_get(struct pool *p) {
+    void *obj;
+    if (p->free == NULL && pool_grow(p) < 0) {
+        return NULL;
+    }
+    obj = p->free;
+    p->free = *(void **) obj;
+    p->stats.gets++;
+    if (++p->stats.in_use > p->stats.high_water) {
+        p->stats.high_water = p->stats.in_use;
+    }
+    return obj;
+}
+
+/*
+ * pool_put: return an object to its pool
+ */
+void pool_put(struct pool *p, void *obj) {
+    if (obj == NULL) {
+        return;
+    }
+    *(void **) obj = p->free;
+    p->free = obj;
+    p->stats.in_use--;
+}
+
+/*
+ * pool_reserve: make sure n more objects can be allocated without
+ * going to the system
+ */
+int pool_reserve(struct pool *p, unsigned long n) {
+    while (p->stats.capacity - p->stats.in_use < n) {
+        if (pool_grow(p) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * pool_destroy: give all slabs back to the system. Objects still in use
+ * become invalid.
+ */
+void pool_destroy(struct pool *p) {
+    struct pool_slab *s;
+    while ((s = p->slabs) != NULL) {
+        p->slabs = s->next;
+        if (s->mapped) {
+            munmap(s, s->bytes);
+        } else {
+            free(s);
+        }
+    }
+    p->free = NULL;
+    memset(&p->stats, 0, sizeof (p->stats));
+}
@@ -0,0 +1,42 @@
+#ifndef POOL_H
+#define	POOL_H
+
+/*
+ * Fixed-size object pools, see pool.c. A pool is declared statically with
+ * POOL_INIT and grows by slabs on demand; freed objects go back to the
+ * pool's free list and are never returned to the system.
+ */
+
+#define POOL_ALIGN	64	/* Object alignment, one cache line */
+#define POOL_SLABSIZE	65536	/* Bytes per slab without huge pages */
+#define POOL_HUGESIZE	(2 * 1024 * 1024) /* Bytes per slab with huge pages */
+
+struct pool_stats {
+    unsigned long objsize; //bytes per object, rounded up to POOL_ALIGN
+    unsigned long capacity; //objects carved from slabs
+    unsigned long in_use;
+    unsigned long high_water; //largest in_use seen
+    unsigned long gets; //objects handed out
+    unsigned long slabs;
+    unsigned long huge_slabs; //slabs backed by explicit huge pages
+};
+
+struct pool_slab;
+
+struct pool {
+    const char *name;
+    size_t size; //requested object size
+    void *free; //free list, linked through the first word of each object
+    struct pool_slab *slabs;
+    struct pool_stats stats;
+};
+
+#define POOL_INIT(name, size)	{ (name), (size) }
+
+void *pool_get(struct pool *p);
+void pool_put(struct pool *p, void *obj);
+int pool_reserve(struct pool *p, unsigned long n);
+void pool_destroy(struct pool *p);
+int pool_hugepages(int on);
+
+#endif /* POOL_H */
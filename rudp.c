@@ -11,15 +11,22 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <stdint.h>
+#include <sys/uio.h>
+#include <pthread.h>
 
 
 #include "event.h"
 #include "rudp.h"
 #include "rudp_api.h"
+#include "rudp_trace.h"
+#include "rudp_impair.h"
+#include "pool.h"
 #define SENT 1
 #define NOTSENT 0
 #define ACKED 2
-#define udp_lost 0
+//count an event both for the peer and for the whole socket
+#define STAT_ADD(sock, peer, field, n) do { (sock)->stats.field += (n); (peer)->stats.field += (n); } while (0)
 //structs declaration
 
 struct rudppacket {
@@ -28,23 +35,114 @@ struct rudppacket {
 } __attribute__((packed));
 typedef struct rudppacket rudp_packet;
 
+//a received payload lent to a batch handler, see rudp_recvbatch_handler()
+struct rxbuf {
+    struct rudp_buf b;
+    struct rudp_ctx *ctx; //pool to return it to
+    rudp_socket_t sock; //socket whose receive window it uses up
+    char data[RUDP_MAXPKTSIZE];
+};
+
+//what the ACK walk touches, header included, fits in the first cache line
 struct packet_node {
-    struct sockaddr_in to;
-    int is_FIN_ACK;
+    struct packet_node *next;
+    struct receivernode *owner;
     int state;
     int retries;
     int data_len;
+    int is_FIN_ACK;
     int TimeoutDel;
+    struct timeval sent_time; //time of the latest transmission, for RTT samples
     rudp_packet packet;
-    struct packet_node *next;
+    struct sockaddr_in to;
 };
 typedef struct packet_node packet_queue_node;
 
+//parity of the block being sent on an outgoing connection, RUDP_OPT_FEC
+struct fec_tx {
+    u_int32_t first; //sequence number of the first packet of the block
+    int count; //packets in the block so far
+    int maxlen; //longest of them
+    u_int16_t lenx; //XOR of their lengths
+    u_int16_t typex; //XOR of their types
+    int k; //packets per parity packet, 0 for none
+    int sent; //packets sent since the last loss estimate, adaptive FEC
+    int lost; //packets lost since then, repaired or timed out
+    u_int16_t repaired; //repairs the peer reported last
+    long loss_ppm; //smoothed loss rate in parts per million
+    char parity[RUDP_MAXPKTSIZE] __attribute__((aligned(16)));
+};
+
+//a received data packet kept for repairs
+struct fec_slot {
+    u_int32_t seq;
+    int type;
+    int len; //-1 if empty
+    char data[RUDP_MAXPKTSIZE] __attribute__((aligned(16)));
+};
+
+//a parity packet waiting for more of its block
+struct fec_parity {
+    u_int32_t seq;
+    int len;
+    char data[RUDP_FECHDR + RUDP_MAXPKTSIZE];
+};
+
+/*
+ * The ID of a connection packs the slot it has in its socket's connection
+ * table and the generation of that slot, like a socket handle. Generations
+ * are drawn with socket_random(), so the ID of a connection does not tell
+ * those of the next ones, and are never 0, nor is an ID. IDs with the top
+ * bit set are SYN cookies, see syn_cookie().
+ */
+#define CONN_BITS 20
+#define MAXCONNS (1 << CONN_BITS)
+#define CONN_GEN_MASK (~(u_int32_t) 0 >> (CONN_BITS + 1))
+#define CONN_COOKIE 0x80000000u
+
+struct conn_slot {
+    void *conn; //sender_list_node or receiver_list_node, NULL if free
+    int incoming; //it is a sender_list_node
+    u_int32_t gen;
+    int next_free;
+};
+
+//an incoming connection that has ended, to recognize its duplicated SYNs
+struct ended_conn {
+    struct sockaddr_in from;
+    u_int32_t SYN_seq;
+    struct timeval when;
+};
+
+//what an incoming connection with parity needs for repairs
+struct fec_rx {
+    struct fec_slot slot[RUDP_FEC_SPAN]; //the latest packets, by sequence number
+    struct fec_parity parity[RUDP_FEC_PENDING];
+    int nparity;
+    u_int16_t repaired; //packets rebuilt, reported in ACKs
+};
+
 struct sendernode {
     u_int32_t last_seq;
+    u_int32_t SYN_seq; //identifies the connection, a new SYN starts over
     u_int32_t FIN_seq;
-    struct sockaddr_in to;
+    struct sockaddr_in to; //where the peer is now
+    struct sockaddr_in from; //where it started, which the application is told
+    u_int32_t conn; //ID of the connection here, 0 if none, see conn_add()
+    u_int32_t peer; //ID of the connection at the peer, from its SYN
     int SYN_ACK; //1 stands for ack of syn received
+    int FIN_rcvd; //in TIME_WAIT
+    struct timeval last_active; //last packet received, or FIN time
+    struct rudp_counters stats;
+    char *msg; //message being reassembled, RUDP_OPT_MESSAGE
+    int msglen;
+    int msgcap;
+    int msgdrop; //rest of the current message is discarded
+    struct packet_node *held; //arrived after a gap, in sequence order; data_len -1 if delivered already
+    int nheld;
+    int adv; //receive window advertised last, -1 before the first ACK
+    int halfopen; //SYN received, no data yet
+    struct fec_rx *fec; //NULL unless the peer sends parity
     struct sendernode *next;
 };
 typedef struct sendernode sender_list_node;
@@ -54,12 +152,31 @@ struct receivernode {
     u_int32_t SYN_seq;
     u_int32_t FIN_seq;
     struct sockaddr_in to;
+    u_int32_t conn; //ID of the connection here, 0 if none
+    u_int32_t peer; //ID of the connection at the peer, 0 until an ACK tells it
     int data_seq;
     int SYN_ACK;
-    int FIN_ACK;
+    int inflight; //number of sent but unacked packets
+    int queued; //number of packets waiting for the window
+    struct rudp_socket_node *sock; //socket this receiver belongs to
+    long srtt; //smoothed RTT in microseconds, 0 before the first sample
+    long rttvar;
+    struct timeval last_active; //last ACK received or data queued
+    struct rudp_counters stats;
     packet_queue_node *bufferd_packet;
-    packet_queue_node *SYN_packet;
+    packet_queue_node *tail;
     packet_queue_node *last_sent_packet;
+    packet_queue_node *unacked; //oldest sent packet not yet acknowledged
+    packet_queue_node *open; //RUDP_DATA_PACKED packet still taking messages
+    int weight; //share of the socket's sending, see schedule()
+    int deficit; //bytes it may still send in its turn
+    int turn; //deficit granted for the current turn
+    int scheduled; //in the socket's round
+    struct receivernode *sched_next;
+    int rwnd; //receive window advertised by the peer, -1 before the first
+    int probes; //zero-window probes not answered
+    int persist_ms; //interval of the armed probe_cb(), 0 if none
+    struct fec_tx *fec; //NULL until a packet is sent with RUDP_OPT_FEC
     struct receivernode *next;
 };
 typedef struct receivernode receiver_list_node;
@@ -69,70 +186,467 @@ struct rudp_socket_node {
     int port;
     int (*socket_recvfrom_handler)(rudp_socket_t, struct sockaddr_in *, char *, int);
     int (*socket_event_handler)(rudp_socket_t, rudp_event_t, struct sockaddr_in *);
+    int (*socket_recvbatch_handler)(rudp_socket_t, struct rudp_buf *, int);
     struct sockaddr_in socket_addr;
     sender_list_node *senders;
     receiver_list_node *receivers;
-    struct rudp_socket_node *next;
+    struct rudp_counters stats; //socket-wide totals
+    int window; //send window in packets, RUDP_OPT_WINDOW
+    int idle_ms; //idle timeout, RUDP_OPT_IDLE
+    int peers; //expected connections, RUDP_OPT_PEERS
+    int maxmsg; //largest message, RUDP_OPT_MESSAGE, 0 for packets only
+    int maxrecv; //largest message the handler takes, RUDP_OPT_MAXRECV, 0 for any
+    int coalesce_us; //coalescing delay, RUDP_OPT_COALESCE, 0 for none
+    int txlimit; //packets in flight over all connections, RUDP_OPT_TXLIMIT
+    int inflight; //sent and unacknowledged, all connections
+    int rcvwindow; //receive window in packets, RUDP_OPT_RCVWINDOW
+    int unordered; //RUDP_OPT_UNORDERED
+    int fec; //RUDP_OPT_FEC
+    int fastopen; //RUDP_OPT_FASTOPEN
+    struct ended_conn ended[RUDP_ENDED]; //incoming connections ended lately, a ring
+    int nended; //next place in it
+    struct conn_slot *conns; //connections by ID
+    int nconns;
+    int free_conn; //first free slot, -1 if none
+    int halfopen_max; //RUDP_OPT_HALFOPEN
+    int halfopen; //incoming connections waiting for their first data
+    int syncookies; //RUDP_OPT_SYNCOOKIES
+    u_int64_t key[2]; //secret of the SYN cookies, connection IDs and ISNs
+    u_int64_t nonce; //draws of socket_random()
+    int lent; //buffers with the batch handler or waiting for it
+    int win_closed; //a peer was last told the window is zero
+    int update_armed; //update_cb() pending
+    receiver_list_node *sched_head; //round of connections with packets to send
+    receiver_list_node *sched_tail;
+    int closing; //rudp_close() called
+    int closed; //RUDP_EVENT_CLOSED delivered
+    int sweep_armed;
+    struct rudp_buf *batch; //received, not yet handed to the batch handler
+    struct rudp_buf *batch_last;
+    int nbatch;
+    int batch_armed; //batch_cb() pending
+    struct rudp_ctx *ctx; //context the socket belongs to
+    int slot; //index in the context's socket table
+    rudp_socket_t handle; //what the application knows the socket by
 };
 typedef struct rudp_socket_node socket_list_node;
 
-//linked list of rudp sockets
-socket_list_node *sock_list = NULL;
+/*
+ * A socket handle is not a pointer but packs the context id, the slot of
+ * the socket in the context's table and the generation of that slot, which
+ * changes when the socket is released. Looking a handle up is two array
+ * accesses, and a stale handle does not match.
+ */
+#define CTX_BITS 6
+#define SLOT_BITS 20
+#define MAXCTX (1 << CTX_BITS)
+#define MAXSLOTS (1 << SLOT_BITS)
+#define GEN_MASK (~(uintptr_t) 0 >> (CTX_BITS + SLOT_BITS))
+
+struct sock_slot {
+    socket_list_node *sock; //NULL if free
+    uintptr_t gen;
+    int next_free;
+};
+
+//an independent RUDP engine: sockets, event loop and memory pools
+struct rudp_ctx {
+    int id;
+    struct event_base *evbase; //NULL for the default event base
+    struct rudp_netops *net; //datagram layer, replaceable with rudp_netops()
+    struct sock_slot *slots;
+    int nslots;
+    int free_slot; //first free slot, -1 if none
+    struct pool socket_pool;
+    struct pool packet_pool;
+    struct pool sender_pool;
+    struct pool receiver_pool;
+    struct pool rxbuf_pool;
+    struct rudp_impair_state *impair; //impairment shim state, made on first use
+};
+
+static int udp_open(int port, struct sockaddr_in *bound);
+static int udp_close(int fd);
+static int udp_random(void *buf, int len);
+
+static struct rudp_netops udp_netops = {udp_open, udp_close, event_sendto, udp_random};
+
+#define CTX_INIT(id, evbase) {(id), (evbase), &udp_netops, NULL, 0, -1, \
+    POOL_INIT("socket", sizeof (socket_list_node)), \
+    POOL_INIT("packet", sizeof (packet_queue_node)), \
+    POOL_INIT("sender", sizeof (sender_list_node)), \
+    POOL_INIT("receiver", sizeof (receiver_list_node)), \
+    POOL_INIT("rxbuf", sizeof (struct rxbuf)), NULL}
+
+static struct rudp_ctx default_ctx = CTX_INIT(0, NULL);
+static struct rudp_ctx *ctxs[MAXCTX] = {&default_ctx};
+static pthread_mutex_t ctx_lock = PTHREAD_MUTEX_INITIALIZER; //for ctxs[]
+static __thread struct rudp_ctx *cur = &default_ctx;
 
 //Functions Declaration
-socket_list_node * add_to_socket_list(socket_list_node *node);
-socket_list_node *search_socket(socket_list_node *r_socket);
+socket_list_node *search_socket(rudp_socket_t rsocket);
+static struct event_base *ctx_enter(struct rudp_ctx *ctx);
+static void ctx_leave(struct event_base *prev);
+static void release_socket(socket_list_node *r_socket);
+int release_cb(int fd, void *arg);
 sender_list_node *add_sender(socket_list_node *r_socket, struct sockaddr_in addr);
 sender_list_node *search_sender(socket_list_node *r_socket, struct sockaddr_in addr);
 receiver_list_node *add_receiver(socket_list_node *r_socket, struct sockaddr_in addr);
 receiver_list_node *search_receiver(socket_list_node *r_socket, struct sockaddr_in addr);
-packet_queue_node *add_packet_to_queue(receiver_list_node * receiver, int data_len, rudp_packet rudppacket, struct sockaddr_in to);
-packet_queue_node *search_packet(receiver_list_node * receiver, u_int32_t seq);
+int conn_grow(socket_list_node *r_socket, int n);
+u_int32_t conn_add(socket_list_node *r_socket, void *conn, int incoming);
+void conn_del(socket_list_node *r_socket, u_int32_t id);
+void *conn_get(socket_list_node *r_socket, u_int32_t id, int incoming);
+sender_list_node *find_sender(socket_list_node *r_socket, struct rudp_hdr *hdr, struct sockaddr_in *from);
+receiver_list_node *find_receiver(socket_list_node *r_socket, struct rudp_hdr *hdr, struct sockaddr_in *from);
+void halfopen_done(socket_list_node *r_socket, sender_list_node *sender);
+int syn_flood(socket_list_node *r_socket);
+void socket_key(socket_list_node *r_socket);
+u_int64_t siphash(socket_list_node *r_socket, u_int64_t m0, u_int64_t m1);
+u_int32_t socket_random(socket_list_node *r_socket);
+u_int32_t syn_cookie(socket_list_node *r_socket, struct sockaddr_in *from, u_int32_t isn, u_int32_t period);
+int cookie_ack(socket_list_node *r_socket, struct rudp_hdr *hdr, struct sockaddr_in *from, char *data, int len);
+sender_list_node *cookie_accept(socket_list_node *r_socket, struct rudp_hdr *hdr, struct sockaddr_in *from);
+packet_queue_node *add_packet_to_queue(receiver_list_node * receiver, int type, u_int32_t seqno, int data_len, struct sockaddr_in to);
 
+void socket_close(socket_list_node *socket);
+int socket_setopt(socket_list_node *socket, int opt, int value);
+int socket_sendv(socket_list_node *socket, const struct iovec *iov, int iovcnt, struct sockaddr_in* to);
+int coalesce(socket_list_node *socket, receiver_list_node *receiver, const struct iovec *iov, int iovcnt, int len);
+void close_open(receiver_list_node *receiver);
+int coalesce_cb(int fd, void *arg);
+int packed_count(char *data, int len);
+void deliver_packed(socket_list_node *socket, sender_list_node *sender, struct sockaddr_in *addr, char *data, int len);
+void deliver(socket_list_node *socket, sender_list_node *sender, struct sockaddr_in *addr, char *data, int len, int more);
+int accept_data(socket_list_node *socket, sender_list_node *sender, struct sockaddr_in *addr, int type, u_int32_t seqno, char *data, int len);
+void pass_up(socket_list_node *socket, sender_list_node *sender, struct sockaddr_in *addr, int type, char *data, int len);
+void hold(socket_list_node *socket, sender_list_node *sender, struct sockaddr_in *addr, struct rudp_hdr *hdr, char *data, int len);
+void accept_held(socket_list_node *socket, sender_list_node *sender, struct sockaddr_in *addr);
+void drop_held(socket_list_node *socket, sender_list_node *sender);
+int take_data(socket_list_node *socket, sender_list_node *sender, struct sockaddr_in *addr, struct rudp_hdr *hdr, char *data, int len);
+void fec_xor(char *dst, const char *src, int len);
+void fec_sent(socket_list_node *r_socket, receiver_list_node *receiver, packet_queue_node *pk);
+int fec_flush(socket_list_node *r_socket, receiver_list_node *receiver);
+void fec_adapt(socket_list_node *r_socket, receiver_list_node *receiver);
+struct fec_rx *fec_rx_new(sender_list_node *sender);
+void fec_store(sender_list_node *sender, struct rudp_hdr *hdr, char *data, int len);
+void fec_park(sender_list_node *sender, struct rudp_hdr *hdr, char *data, int len);
+int fec_repair(socket_list_node *socket, sender_list_node *sender, struct sockaddr_in *addr);
+int send_ack(socket_list_node *socket, sender_list_node *sender, int acked);
+int update_cb(int fd, void *arg);
+void persist(receiver_list_node *receiver);
+int probe_cb(int fd, void *arg);
+int batch_add(socket_list_node *socket, struct sockaddr_in *addr, char *data, int len, int more);
+void batch_flush(socket_list_node *socket);
+int batch_cb(int fd, void *arg);
+int rudp_output(socket_list_node *r_socket, void *buf, int len, struct sockaddr_in *to);
 int send_packet(socket_list_node * r_socket, packet_queue_node *pk, struct sockaddr_in to);
+int fill_window(socket_list_node * r_socket, receiver_list_node * receiver);
+int schedule(socket_list_node *r_socket);
+void rtt_sample(receiver_list_node * receiver, struct timeval *sent);
 int retransmit_packet(int fd, void *arg);
-int rudp_receive_packet(int fd, void *arg);
+int rudp_receive_packet(int fd, void *arg, char *buf, int bytes, struct sockaddr_in *from);
+int rudp_process_packet(int fd, void *arg, char *buf, int bytes, struct sockaddr_in *from);
+void free_sender(socket_list_node *r_socket, sender_list_node *sender, int why);
+void conn_ended(socket_list_node *r_socket, sender_list_node *sender);
+int syn_ended(socket_list_node *r_socket, struct sockaddr_in *from, u_int32_t seq);
+void free_receiver(socket_list_node *r_socket, receiver_list_node *receiver, int why);
+void close_check(socket_list_node *r_socket);
+void arm_sweep(socket_list_node *r_socket);
+int rudp_sweep(int fd, void *arg);
+int prealloc(socket_list_node *r_socket);
+
+/*
+ * rudp_ctx_new: Create a context. Make it current with rudp_ctx_use()
+ * to create sockets in it and to run its event loop.
+ */
+rudp_ctx_t rudp_ctx_new(void) {
+    struct rudp_ctx *ctx;
+    int id;
+    if ((ctx = malloc(sizeof (struct rudp_ctx))) == NULL) {
+        return NULL;
+    }
+    pthread_mutex_lock(&ctx_lock);
+    for (id = 1; id < MAXCTX && ctxs[id] != NULL; id++)
+        ;
+    if (id == MAXCTX) {
+        pthread_mutex_unlock(&ctx_lock);
+        fprintf(stderr, "rudp_ctx_new: too many contexts\n");
+        free(ctx);
+        return NULL;
+    }
+    *ctx = (struct rudp_ctx) CTX_INIT(id, event_base_new());
+    if (ctx->evbase == NULL) {
+        pthread_mutex_unlock(&ctx_lock);
+        free(ctx);
+        return NULL;
+    }
+    ctxs[id] = ctx;
+    pthread_mutex_unlock(&ctx_lock);
+    return ctx;
+}
+
+/*
+ * rudp_ctx_free: Free a context and everything in it. Its sockets are
+ * dropped without FIN and without events. The default context stays.
+ */
+int rudp_ctx_free(rudp_ctx_t ctx) {
+    socket_list_node *socket;
+    struct event_base *prev;
+    int i;
+    if (ctx == NULL || ctx == &default_ctx) {
+        return -1;
+    }
+    prev = ctx_enter(ctx);
+    for (i = 0; i < ctx->nslots; i++) {
+        if ((socket = ctx->slots[i].sock) != NULL) {
+            while (socket->receivers != NULL) {
+                free_receiver(socket, socket->receivers, RUDP_FREE_CLOSE);
+            }
+            while (socket->senders != NULL) {
+                free_sender(socket, socket->senders, RUDP_FREE_CLOSE);
+            }
+            if (!socket->closed) {
+                ctx->net->close(socket->sockfd);
+            }
+        }
+    }
+    ctx_leave(prev == ctx->evbase ? NULL : prev);
+    event_base_free(ctx->evbase);
+    rudp_impair_state_free(ctx->impair);
+    pool_destroy(&ctx->socket_pool);
+    pool_destroy(&ctx->packet_pool);
+    pool_destroy(&ctx->sender_pool);
+    pool_destroy(&ctx->receiver_pool);
+    pool_destroy(&ctx->rxbuf_pool);
+    free(ctx->slots);
+    pthread_mutex_lock(&ctx_lock);
+    ctxs[ctx->id] = NULL;
+    pthread_mutex_unlock(&ctx_lock);
+    if (cur == ctx) {
+        cur = &default_ctx;
+    }
+    free(ctx);
+    return 0;
+}
+
+/*
+ * rudp_ctx_use: Make a context current for the calling thread, NULL for
+ * the default context. Returns the previous one.
+ */
+rudp_ctx_t rudp_ctx_use(rudp_ctx_t ctx) {
+    struct rudp_ctx *old = cur;
+    cur = ctx != NULL ? ctx : &default_ctx;
+    event_base_use(cur->evbase);
+    return old;
+}
+
+/*
+ * rudp_ctx_current: Current context of the calling thread
+ */
+rudp_ctx_t rudp_ctx_current(void) {
+    return cur;
+}
+
+/*
+ * ctx_enter: Work on the event base of a context, which need not be the
+ * current one. Returns the event base to restore with ctx_leave().
+ */
+static struct event_base *ctx_enter(struct rudp_ctx *ctx) {
+    return event_base_use(ctx->evbase);
+}
+
+static void ctx_leave(struct event_base *prev) {
+    event_base_use(prev);
+}
+
+/*
+ * ctx_impair: impairment shim state of a context, NULL if out of memory
+ */
+static struct rudp_impair_state *ctx_impair(struct rudp_ctx *ctx) {
+    if (ctx->impair == NULL) {
+        ctx->impair = rudp_impair_state_new(ctx->id);
+    }
+    return ctx->impair;
+}
+
+/*
+ * rudp_impair_current: impairment shim state of the current context
+ */
+struct rudp_impair_state *rudp_impair_current(void) {
+    return cur->impair;
+}
+
+/*
+ * search_socket: Socket of a handle, NULL if the handle is not valid
+ */
+socket_list_node *search_socket(rudp_socket_t rsocket) {
+    uintptr_t h = (uintptr_t) rsocket;
+    struct rudp_ctx *ctx = ctxs[h & (MAXCTX - 1)];
+    struct sock_slot *slot;
+    unsigned int i = (h >> CTX_BITS) & (MAXSLOTS - 1);
+    if (h == 0 || ctx == NULL || i >= (unsigned int) ctx->nslots) {
+        return NULL;
+    }
+    slot = &ctx->slots[i];
+    if (slot->sock == NULL || slot->gen != h >> (CTX_BITS + SLOT_BITS)) {
+        return NULL;
+    }
+    return slot->sock;
+}
+
+/*
+ * new_socket: Allocate a socket node and a slot for it in a context
+ */
+static socket_list_node *new_socket(struct rudp_ctx *ctx) {
+    socket_list_node *socket;
+    struct sock_slot *slots;
+    int i, n;
+    if (ctx->free_slot < 0) {
+        n = ctx->nslots ? 2 * ctx->nslots : 16;
+        if (n > MAXSLOTS) {
+            n = MAXSLOTS;
+        }
+        if (n == ctx->nslots || (slots = realloc(ctx->slots, n * sizeof (struct sock_slot))) == NULL) {
+            return NULL;
+        }
+        for (i = n - 1; i >= ctx->nslots; i--) {
+            slots[i].sock = NULL;
+            slots[i].gen = 1;
+            slots[i].next_free = ctx->free_slot;
+            ctx->free_slot = i;
+        }
+        ctx->slots = slots;
+        ctx->nslots = n;
+    }
+    if ((socket = pool_get(&ctx->socket_pool)) == NULL) {
+        return NULL;
+    }
+    memset(socket, 0, sizeof (socket_list_node));
+    i = ctx->free_slot;
+    ctx->free_slot = ctx->slots[i].next_free;
+    ctx->slots[i].sock = socket;
+    socket->ctx = ctx;
+    socket->slot = i;
+    socket->handle = (rudp_socket_t) ((ctx->slots[i].gen << (CTX_BITS + SLOT_BITS)) |
+            ((uintptr_t) i << CTX_BITS) | (uintptr_t) ctx->id);
+    socket->window = RUDP_WINDOW;
+    socket->idle_ms = RUDP_IDLE;
+    socket->rcvwindow = RUDP_RCVWINDOW;
+    socket->free_conn = -1;
+    return socket;
+}
+
+/*
+ * release_socket: Free a socket node and invalidate its handle
+ */
+static void release_socket(socket_list_node * r_socket) {
+    struct rudp_ctx *ctx = r_socket->ctx;
+    struct sock_slot *slot = &ctx->slots[r_socket->slot];
+    slot->sock = NULL;
+    if ((slot->gen = (slot->gen + 1) & GEN_MASK) == 0) {
+        slot->gen = 1;
+    }
+    slot->next_free = ctx->free_slot;
+    ctx->free_slot = r_socket->slot;
+    free(r_socket->conns);
+    pool_put(&ctx->socket_pool, r_socket);
+}
+
+/*
+ * release_cb: Release a closed socket once the callbacks that may still
+ * refer to it have returned
+ */
+int release_cb(int fd, void *arg) {
+    release_socket((socket_list_node *) arg);
+    return 0;
+}
 
 /* 
- * rudp_socket: Create a RUDP socket. 
+ * rudp_socket: Create a RUDP socket in the current context. 
  * May use a random port by setting port to zero. 
  */
 
 rudp_socket_t rudp_socket(int port) {
-    struct rudp_socket_node *rudp_socket = malloc(sizeof (struct rudp_socket_node));
+    struct rudp_socket_node *rudp_socket;
+    struct event_base *prev;
     int socket_fd;
     struct sockaddr_in addr;
-    socklen_t sin_len;
-    int err = 0;
-    socket_fd = socket(AF_INET, SOCK_DGRAM, 0);
+    rudp_trace_env();
+    rudp_impair_env();
+    if ((rudp_socket = new_socket(cur)) == NULL) {
+        fprintf(stderr, "rudp_socket: out of memory\n");
+        return NULL;
+    }
+    socket_fd = cur->net->open(port, &addr);
     if (socket_fd < 0) {
-        fprintf(stderr, "Failed to new an UDP socket in rudp_socket\n");
+        release_socket(rudp_socket);
+        return NULL;
+    }
+    rudp_socket->port = ntohs(addr.sin_port);
+    rudp_socket->sockfd = socket_fd;
+    rudp_socket->socket_addr = addr;
+    socket_key(rudp_socket);
+    RUDP_TRACE(RUDP_TR_SOCKET, NULL, rudp_socket->sockfd, rudp_socket->port);
+    prev = ctx_enter(cur);
+    if (event_dgram((int) socket_fd, &rudp_receive_packet, (void*) rudp_socket, "rudp_receive_packet") < 0) {
+        ctx_leave(prev);
+        fprintf(stderr, "failed to register rudp_receive_data()!\n");
+        cur->net->close(socket_fd);
+        release_socket(rudp_socket);
         return NULL;
     }
+    ctx_leave(prev);
+    return rudp_socket->handle;
+}
+
+/*
+ * udp_open: Open and bind the UDP socket of a RUDP socket.
+ */
+static int udp_open(int port, struct sockaddr_in *bound) {
+    struct sockaddr_in addr;
+    socklen_t sin_len = sizeof (struct sockaddr_in);
+    int socket_fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (socket_fd < 0) {
+        fprintf(stderr, "Failed to new an UDP socket in rudp_socket\n");
+        return -1;
+    }
     bzero(&addr, sizeof (addr));
     addr.sin_family = AF_INET;
     addr.sin_addr.s_addr = htonl(INADDR_ANY);
     addr.sin_port = htons(port);
-    sin_len = sizeof (struct sockaddr_in);
     if (bind(socket_fd, (struct sockaddr *) &addr, sizeof (addr)) == -1) {
         fprintf(stderr, "Failed to bind address in rudp_socket\n");
-        return NULL;
+        close(socket_fd);
+        return -1;
     }
-    err = getsockname(socket_fd, (struct sockaddr *) &addr, &sin_len);
-    if (err == -1) {
+    if (getsockname(socket_fd, (struct sockaddr *) bound, &sin_len) == -1) {
         fprintf(stderr, "getsockname() failed");
-        return NULL;
+        close(socket_fd);
+        return -1;
     }
-    rudp_socket->port = ntohs(addr.sin_port);
-    rudp_socket->sockfd = socket_fd;
-    rudp_socket->socket_addr = addr;
-    rudp_socket = add_to_socket_list(rudp_socket); ////////////////////////
-    printf("Create socket: sockfd: %d, port: %d\n", rudp_socket->sockfd, rudp_socket->port);
-    if (event_fd((int) socket_fd, &rudp_receive_packet, (void*) rudp_socket, "rudp_receive_packet") < 0) {
-        printf("failed to register rudp_receive_data()!\n");
-        return NULL;
+    return socket_fd;
+}
+
+static int udp_close(int fd) {
+    return close(fd);
+}
+
+static int udp_random(void *buf, int len) {
+    int fd = open("/dev/urandom", O_RDONLY);
+    int n = fd < 0 ? -1 : read(fd, buf, len);
+    if (fd >= 0) {
+        close(fd);
     }
-    return rudp_socket;
+    return n == len ? 0 : -1;
+}
+
+/*
+ * rudp_netops: Install a datagram layer below RUDP in the current context.
+ * NULL restores UDP. Must be called before any socket is created.
+ */
+void rudp_netops(struct rudp_netops *ops) {
+    cur->net = ops != NULL ? ops : &udp_netops;
 }
 
 /* 
@@ -140,28 +654,46 @@ rudp_socket_t rudp_socket(int port) {
  */
 
 int rudp_close(rudp_socket_t rsocket) {
-
     socket_list_node *socket = search_socket(rsocket);
-    rudp_packet pk;
-    memset(&pk, 0x0, sizeof (rudp_packet));
+    struct event_base *prev;
     if (socket == NULL) {
         return -1;
     }
-    pk.header.version = RUDP_VERSION;
-    pk.header.type = RUDP_FIN;
-    pk.header.seqno = 0;
+    prev = ctx_enter(socket->ctx);
+    socket_close(socket);
+    ctx_leave(prev);
+    return 0;
+}
 
+/*
+ * socket_close: Send FIN on all outgoing connections of a socket
+ */
+void socket_close(socket_list_node * socket) {
+    if (socket->closing) {
+        return;
+    }
+    socket->closing = 1;
 
-    receiver_list_node *receiver = socket->receivers;
+    receiver_list_node *receiver = socket->receivers, *next;
+    struct sockaddr_in to;
     while (receiver != NULL) {
+        next = receiver->next;
         //Add FIN packet to PacketQueue
-        pk.header.seqno = receiver->data_seq + 1;
-        receiver->FIN_seq = pk.header.seqno;
-        add_packet_to_queue(receiver, 0, pk, receiver->to);
-        receiver = receiver->next;
+        receiver->FIN_seq = receiver->data_seq + 1;
+        if (add_packet_to_queue(receiver, RUDP_FIN, receiver->FIN_seq, 0, receiver->to) == NULL) {
+            //out of memory: give the connection up rather than never close
+            to = receiver->to;
+            free_receiver(socket, receiver, RUDP_FREE_ABORT);
+            if (socket->socket_event_handler != NULL) {
+                socket->socket_event_handler(socket->handle, RUDP_EVENT_TIMEOUT, &to);
+            }
+        } else {
+            fill_window(socket, receiver);
+        }
+        receiver = next;
     }
-
-    return 0;
+    //nothing to wait for if there are no outgoing connections
+    close_check(socket);
 }
 
 /* 
@@ -169,141 +701,454 @@ int rudp_close(rudp_socket_t rsocket) {
  */
 
 int rudp_recvfrom_handler(rudp_socket_t rsocket, int (*handler)(rudp_socket_t, struct sockaddr_in *, char *, int)) {
-    socket_list_node *socket;
-    socket = (socket_list_node *) rsocket;
+    socket_list_node *socket = search_socket(rsocket);
+    if (socket == NULL) {
+        return -1;
+    }
     socket->socket_recvfrom_handler = handler;
     return 0;
 }
 
+/*
+ *rudp_recvbatch_handler: Register batched receive callback function, which
+ *takes the place of the receive callback
+ */
+int rudp_recvbatch_handler(rudp_socket_t rsocket, int (*handler)(rudp_socket_t, struct rudp_buf *, int)) {
+    socket_list_node *socket = search_socket(rsocket);
+    if (socket == NULL) {
+        return -1;
+    }
+    socket->socket_recvbatch_handler = handler;
+    return 0;
+}
+
+/*
+ * rudp_buf_free: Give buffers from a batch handler back to their pool
+ */
+void rudp_buf_free(struct rudp_buf *list) {
+    struct rudp_buf *next;
+    struct rxbuf *rb;
+    socket_list_node *socket;
+    struct event_base *prev;
+    struct timeval now;
+    for (; list != NULL; list = next) {
+        next = list->next;
+        rb = (struct rxbuf *) list;
+        if ((socket = search_socket(rb->sock)) != NULL) {
+            socket->lent--;
+            //room again: tell the peers that were told there is none
+            if (socket->win_closed && !socket->update_armed && !socket->closed) {
+                prev = ctx_enter(socket->ctx);
+                event_gettime(&now);
+                if (event_timeout(now, update_cb, socket, "rudp_window") == 0) {
+                    socket->update_armed = 1;
+                }
+                ctx_leave(prev);
+            }
+        }
+        pool_put(&rb->ctx->rxbuf_pool, list);
+    }
+}
+
 /* 
  *rudp_event_handler: Register event handler callback function 
  */
 int rudp_event_handler(rudp_socket_t rsocket, int (*handler)(rudp_socket_t, rudp_event_t, struct sockaddr_in *)) {
-    socket_list_node *socket;
-    socket = (socket_list_node *) rsocket;
+    socket_list_node *socket = search_socket(rsocket);
+    if (socket == NULL) {
+        return -1;
+    }
     socket->socket_event_handler = handler;
     return 0;
 }
 
-/* 
- * rudp_sendto: Send a block of data to the receiver. 
+/*
+ *rudp_setweight: Scheduling weight of the connection to a peer
  */
+int rudp_setweight(rudp_socket_t rsocket, struct sockaddr_in *to, int weight) {
+    socket_list_node *socket = search_socket(rsocket);
+    receiver_list_node *receiver;
+    struct event_base *prev;
+    if (socket == NULL || weight < 1 || socket->closing) {
+        return -1;
+    }
+    prev = ctx_enter(socket->ctx);
+    if ((receiver = search_receiver(socket, *to)) == NULL) {
+        receiver = add_receiver(socket, *to);
+    }
+    if (receiver != NULL) {
+        receiver->weight = weight;
+    }
+    ctx_leave(prev);
+    return receiver != NULL ? 0 : -1;
+}
 
-int rudp_sendto(rudp_socket_t rsocket, void* data, int len, struct sockaddr_in* to) {
-    if (len > RUDP_MAXPKTSIZE) {
-        printf("Data length is more than RUDP_MAXPKTSIZE!\n");
+/* 
+ *rudp_port: Local port of a socket 
+ */
+int rudp_port(rudp_socket_t rsocket) {
+    socket_list_node *socket = search_socket(rsocket);
+    if (socket == NULL) {
         return -1;
     }
-    struct sockaddr_in addr = *to;
+    return socket->port;
+}
+
+/* 
+ *rudp_setsockopt: Set a socket option 
+ */
+int rudp_setsockopt(rudp_socket_t rsocket, int opt, int value) {
     socket_list_node *socket = search_socket(rsocket);
-    receiver_list_node *receiver = search_receiver(socket, addr);
-    if (receiver == NULL) {
-        receiver = add_receiver(socket, addr);
+    struct event_base *prev;
+    int res;
+    if (socket == NULL) {
+        return -1;
     }
-    rudp_packet packet;
-    memset(&packet, 0x0, sizeof (rudp_packet));
-    if (receiver->SYN_seq == 0) {
-        packet.header.type = RUDP_SYN;
-        packet.header.version = RUDP_VERSION;
-        packet.header.seqno = rand() % 0xFFFFFFFF + 1;
-        if (packet.header.seqno == 0) {
-            packet.header.seqno++;
-        }
-        memcpy(&(receiver->to), &addr, sizeof (struct sockaddr_in));
+    prev = ctx_enter(socket->ctx);
+    res = socket_setopt(socket, opt, value);
+    ctx_leave(prev);
+    return res;
+}
 
-        //update SYN_seqno 
-        receiver->SYN_seq = packet.header.seqno;
-        receiver->data_seq = packet.header.seqno;
-        packet_queue_node *synpacket = add_packet_to_queue(receiver, 0, packet, addr);
-        receiver->last_sent_packet = receiver->bufferd_packet;
-        if (send_packet(socket, synpacket, addr) < 0) {
-            fprintf(stderr, "Failed to send SYN packet!\n");
+int socket_setopt(socket_list_node * socket, int opt, int value) {
+    switch (opt) {
+        case RUDP_OPT_WINDOW:
+            if (value < 1) {
+                return -1;
+            }
+            socket->window = value;
+            return prealloc(socket);
+        case RUDP_OPT_IDLE:
+            if (value < 0) {
+                return -1;
+            }
+            socket->idle_ms = value;
+            break;
+        case RUDP_OPT_PEERS:
+            if (value < 0) {
+                return -1;
+            }
+            socket->peers = value;
+            return prealloc(socket);
+        case RUDP_OPT_MESSAGE:
+            if (value < 0 || (socket->maxrecv != 0 && value > socket->maxrecv)) {
+                return -1; //a larger message would be acknowledged, then dropped
+            }
+            socket->maxmsg = value;
+            break;
+        case RUDP_OPT_COALESCE:
+            if (value < 0) {
+                return -1;
+            }
+            socket->coalesce_us = value;
+            break;
+        case RUDP_OPT_TXLIMIT:
+            if (value < 0) {
+                return -1;
+            }
+            socket->txlimit = value;
+            return schedule(socket);
+        case RUDP_OPT_RCVWINDOW:
+            if (value < 1 || value > 0x7FFF) {
+                return -1; //held packets are compared with SEQ_LT()
+            }
+            socket->rcvwindow = value;
+            break;
+        case RUDP_OPT_UNORDERED:
+            if (value != 0 && value != 1) {
+                return -1;
+            }
+            socket->unordered = value;
+            break;
+        case RUDP_OPT_FEC:
+            if (value < 0 || value > RUDP_FEC_MAXK) {
+                return -1;
+            }
+            socket->fec = value;
+            break;
+        case RUDP_OPT_FASTOPEN:
+            if (value < 0) {
+                return -1;
+            }
+            socket->fastopen = value;
+            break;
+        case RUDP_OPT_HALFOPEN:
+            if (value < 0) {
+                return -1;
+            }
+            socket->halfopen_max = value;
+            break;
+        case RUDP_OPT_SYNCOOKIES:
+            if (value < 0 || value > 2) {
+                return -1;
+            }
+            socket->syncookies = value;
+            break;
+        case RUDP_OPT_MAXRECV:
+            if (value < 0 || (value != 0 && value < socket->maxmsg)) {
+                return -1;
+            }
+            socket->maxrecv = value;
+            break;
+        default:
             return -1;
-        }
     }
-    packet.header.type = RUDP_DATA;
-    packet.header.version = RUDP_VERSION;
-    packet.header.seqno = receiver->data_seq + 1;
-    receiver->data_seq++;
-    memcpy(&(packet.data), data, len);
-    add_packet_to_queue(receiver, len, packet, addr);
-
-
-
-
-
-
     return 0;
 }
 
-socket_list_node * add_to_socket_list(socket_list_node *node) {
-    socket_list_node *temp = NULL;
-    if (sock_list == NULL) {
-        sock_list = malloc(sizeof (socket_list_node));
-        temp = sock_list;
-    } else {
-        temp = sock_list;
-        while (temp->next != NULL) {
-            temp = temp->next;
-        }
-        temp->next = malloc(sizeof (socket_list_node));
-        temp = temp->next;
-    }
-    temp->sockfd = node->sockfd;
-    temp->port = node->port;
-    temp->socket_addr = node->socket_addr;
-    temp->receivers = NULL;
-    temp->senders = NULL;
-    temp->socket_recvfrom_handler = node->socket_recvfrom_handler;
-    temp->socket_event_handler = node->socket_event_handler;
-    temp->next = NULL;
-    return temp;
-}
+/* 
+ * rudp_sendto: Send a block of data to the receiver. 
+ */
 
-socket_list_node *search_socket(socket_list_node *r_socket) {
-    socket_list_node *temp = sock_list;
-    while (temp != NULL) {
-        if (temp->sockfd == r_socket->sockfd && temp->port == r_socket->port) {
-            return temp;
-        }
-        temp = temp->next;
+int rudp_sendto(rudp_socket_t rsocket, void* data, int len, struct sockaddr_in* to) {
+    struct iovec iov;
+    if (len < 0) {
+        return -1;
     }
-    return NULL;
+    iov.iov_base = data;
+    iov.iov_len = len;
+    return rudp_sendv(rsocket, &iov, 1, to);
 }
 
-sender_list_node *add_sender(socket_list_node *r_socket, struct sockaddr_in addr) {
-    socket_list_node *temp_socket_list = search_socket(r_socket);
-    if (temp_socket_list == NULL) {
-        return NULL;
-    }
-    sender_list_node *temp_sender;
-    if (temp_socket_list->senders == NULL) {
-        temp_socket_list->senders = malloc(sizeof (sender_list_node));
-        temp_socket_list->senders->next = NULL;
-        temp_sender = temp_socket_list->senders;
-    } else {
-        temp_sender = temp_socket_list->senders;
-        while (temp_sender != NULL) {
-            if (temp_sender->next == NULL) {
-                break;
+/* 
+ * rudp_sendv: Send a block of data gathered from several buffers. 
+ */
+
+int rudp_sendv(rudp_socket_t rsocket, const struct iovec *iov, int iovcnt, struct sockaddr_in* to) {
+    socket_list_node *socket = search_socket(rsocket);
+    struct event_base *prev;
+    int res;
+    if (socket == NULL) {
+        return -1;
+    }
+    prev = ctx_enter(socket->ctx);
+    res = socket_sendv(socket, iov, iovcnt, to);
+    ctx_leave(prev);
+    return res;
+}
+
+/*
+ * rudp_flush: Send the messages held for coalescing on all outgoing
+ * connections of a socket, as far as their windows allow
+ */
+
+int rudp_flush(rudp_socket_t rsocket) {
+    socket_list_node *socket = search_socket(rsocket);
+    receiver_list_node *receiver;
+    struct event_base *prev;
+    int res = 0;
+    if (socket == NULL) {
+        return -1;
+    }
+    prev = ctx_enter(socket->ctx);
+    for (receiver = socket->receivers; receiver != NULL; receiver = receiver->next) {
+        close_open(receiver);
+        if (fill_window(socket, receiver) < 0) {
+            res = -1;
+        }
+    }
+    ctx_leave(prev);
+    return res;
+}
+
+/*
+ * socket_sendv: Queue a message as one packet or, in message mode, as
+ * consecutive segments of up to RUDP_MAXPKTSIZE bytes. All but the last
+ * are RUDP_DATA_MORE. The data is gathered straight into the packets.
+ */
+int socket_sendv(socket_list_node * socket, const struct iovec *iov, int iovcnt, struct sockaddr_in* to) {
+    packet_queue_node *pk;
+    size_t total = 0, off = 0, n;
+    int i, seg, done;
+    for (i = 0; i < iovcnt; i++) {
+        total += iov[i].iov_len;
+    }
+    if (total > RUDP_MAXPKTSIZE && (total > (size_t) socket->maxmsg || socket->unordered)) {
+        fprintf(stderr, "Data length is more than RUDP_MAXPKTSIZE and RUDP_OPT_MESSAGE!\n");
+        return -1;
+    }
+    struct sockaddr_in addr = *to;
+    if (socket->closing) {
+        return -1;
+    }
+    receiver_list_node *receiver = search_receiver(socket, addr);
+    if (receiver == NULL) {
+        receiver = add_receiver(socket, addr);
+        if (receiver == NULL) {
+            return -1;
+        }
+    }
+    //all packets of the message and the SYN, or the send fails before queueing any
+    if (pool_reserve(&socket->ctx->packet_pool, total / RUDP_MAXPKTSIZE + 2) < 0) {
+        return -1;
+    }
+    event_gettime(&receiver->last_active);
+    if (receiver->SYN_seq == 0) {
+        u_int32_t isn = socket_random(socket);
+        if (isn == 0) {
+            isn++;
+        }
+        memcpy(&(receiver->to), &addr, sizeof (struct sockaddr_in));
+
+        //update SYN_seqno 
+        receiver->SYN_seq = isn;
+        receiver->data_seq = isn;
+        packet_queue_node *synpacket = add_packet_to_queue(receiver, RUDP_SYN, isn, RUDP_SYNCONN + 1, addr);
+        if (synpacket == NULL) {
+            receiver->SYN_seq = 0;
+            return -1;
+        }
+        u_int32_t conn = htonl(receiver->conn);
+        memcpy(synpacket->packet.data, &conn, RUDP_SYNCONN);
+        //with parity the peer keeps packets for repairs from the start
+        synpacket->packet.data[RUDP_SYNCONN] = socket->fec ? RUDP_SYN_FEC : 0;
+        receiver->last_sent_packet = receiver->bufferd_packet;
+        receiver->unacked = synpacket;
+        synpacket->state = SENT;
+        receiver->inflight = 1;
+        socket->inflight++;
+        receiver->queued--;
+        if (send_packet(socket, synpacket, addr) < 0) {
+            fprintf(stderr, "Failed to send SYN packet!\n");
+            return -1;
+        }
+    }
+    if (socket->coalesce_us > 0 && !socket->unordered && total <= RUDP_MAXPKTSIZE - RUDP_FRAMEHDR) {
+        return coalesce(socket, receiver, iov, iovcnt, total);
+    }
+    i = 0;
+    do {
+        seg = total > RUDP_MAXPKTSIZE ? RUDP_MAXPKTSIZE : total;
+        total -= seg;
+        receiver->data_seq++;
+        pk = add_packet_to_queue(receiver, total > 0 ? RUDP_DATA_MORE :
+                socket->unordered ? RUDP_DATA_UNORDERED : RUDP_DATA,
+                receiver->data_seq, seg, addr);
+        if (pk == NULL) {
+            receiver->data_seq--;
+            return -1;
+        }
+        for (done = 0; done < seg; done += n) {
+            while (off == iov[i].iov_len) {
+                i++;
+                off = 0;
+            }
+            n = iov[i].iov_len - off;
+            if (n > (size_t) (seg - done)) {
+                n = seg - done;
             }
-            temp_sender = temp_sender->next;
+            memcpy(pk->packet.data + done, (char *) iov[i].iov_base + off, n);
+            off += n;
         }
-        temp_sender->next = malloc(sizeof (sender_list_node));
-        temp_sender = temp_sender->next;
+    } while (total > 0);
+    if (fill_window(socket, receiver) < 0) {
+        return -1;
     }
+    return 0;
+}
+
+/*
+ * coalesce: append a small message to the open RUDP_DATA_PACKED packet of
+ * a receiver, or open a new one. fill_window() keeps an open packet back
+ * while earlier packets are in flight, and coalesce_cb() closes it when
+ * the coalescing delay is over.
+ */
+int coalesce(socket_list_node * socket, receiver_list_node * receiver, const struct iovec *iov, int iovcnt, int len) {
+    packet_queue_node *pk = receiver->open;
+    struct timeval t;
+    u_int16_t flen = htons(len);
+    char *p;
+    int i;
+    if (pk != NULL && pk->data_len + RUDP_FRAMEHDR + len > RUDP_MAXPKTSIZE) {
+        close_open(receiver);
+        pk = NULL;
+    }
+    if (pk == NULL) {
+        receiver->data_seq++;
+        pk = add_packet_to_queue(receiver, RUDP_DATA_PACKED, receiver->data_seq, 0, receiver->to);
+        if (pk == NULL) {
+            receiver->data_seq--;
+            return -1;
+        }
+        receiver->open = pk;
+        event_gettime(&t);
+        t.tv_sec += socket->coalesce_us / 1000000;
+        t.tv_usec += socket->coalesce_us % 1000000;
+        if (t.tv_usec >= 1000000) {
+            t.tv_sec++;
+            t.tv_usec -= 1000000;
+        }
+        if (event_timeout(t, coalesce_cb, receiver, "rudp_coalesce") < 0) {
+            receiver->open = NULL;
+        }
+    }
+    p = pk->packet.data + pk->data_len;
+    memcpy(p, &flen, RUDP_FRAMEHDR);
+    p += RUDP_FRAMEHDR;
+    for (i = 0; i < iovcnt; i++) {
+        memcpy(p, iov[i].iov_base, iov[i].iov_len);
+        p += iov[i].iov_len;
+    }
+    pk->data_len += RUDP_FRAMEHDR + len;
+    return fill_window(socket, receiver);
+}
+
+/*
+ * close_open: take no more messages into the open packet of a receiver
+ */
+void close_open(receiver_list_node * receiver) {
+    if (receiver->open != NULL) {
+        receiver->open = NULL;
+        event_timeout_delete(coalesce_cb, receiver);
+    }
+}
+
+int coalesce_cb(int fd, void *arg) {
+    receiver_list_node *receiver = (receiver_list_node *) arg;
+    receiver->open = NULL;
+    return fill_window(receiver->sock, receiver);
+}
+
+/*
+ * add_sender: New incoming connection from addr, NULL if out of memory.
+ * It goes to the head of the list: packets find it by connection ID.
+ */
+sender_list_node *add_sender(socket_list_node *r_socket, struct sockaddr_in addr) {
+    socket_list_node *temp_socket_list = r_socket;
+    sender_list_node *temp_sender;
+    if ((temp_sender = pool_get(&r_socket->ctx->sender_pool)) == NULL) {
+        return NULL;
+    }
+    temp_sender->next = temp_socket_list->senders;
+    temp_socket_list->senders = temp_sender;
     temp_sender->to = addr;
-    temp_sender->next = NULL;
+    temp_sender->from = addr;
     temp_sender->SYN_ACK = 0;
+    temp_sender->SYN_seq = 0;
     temp_sender->FIN_seq = 0;
+    temp_sender->FIN_rcvd = 0;
     temp_sender->last_seq = 0;
+    temp_sender->msg = NULL;
+    temp_sender->msglen = 0;
+    temp_sender->msgcap = 0;
+    temp_sender->msgdrop = 0;
+    temp_sender->held = NULL;
+    temp_sender->nheld = 0;
+    temp_sender->adv = -1;
+    temp_sender->halfopen = 0;
+    temp_sender->fec = NULL;
+    temp_sender->peer = 0;
+    temp_sender->conn = conn_add(temp_socket_list, temp_sender, 1);
+    event_gettime(&temp_sender->last_active);
+    memset(&temp_sender->stats, 0, sizeof (temp_sender->stats));
+    arm_sweep(temp_socket_list);
     return temp_sender;
 }
 
 sender_list_node *search_sender(socket_list_node *r_socket, struct sockaddr_in addr) {
     sender_list_node *temp_sender = r_socket->senders;
     while (temp_sender != NULL) {
-        if (ntohs(temp_sender->to.sin_port) == ntohs(addr.sin_port) && !strcmp(inet_ntoa(temp_sender->to.sin_addr), inet_ntoa(addr.sin_addr))) {
+        if (temp_sender->to.sin_port == addr.sin_port && temp_sender->to.sin_addr.s_addr == addr.sin_addr.s_addr) {
             return temp_sender;
         }
         temp_sender = temp_sender->next;
@@ -311,105 +1156,1010 @@ sender_list_node *search_sender(socket_list_node *r_socket, struct sockaddr_in a
     return NULL;
 }
 
+/*
+ * add_receiver: New outgoing connection to addr, NULL if out of memory.
+ * It goes to the head of the list: ACKs find it by connection ID.
+ */
 receiver_list_node *add_receiver(socket_list_node *r_socket, struct sockaddr_in addr) {
-    socket_list_node *temp_socket_list = search_socket(r_socket);
-    if (temp_socket_list == NULL) {
-        return NULL;
-    }
+    socket_list_node *temp_socket_list = r_socket;
     receiver_list_node *temp_receiver;
-    if (temp_socket_list->receivers == NULL) {
-        temp_socket_list->receivers = malloc(sizeof (receiver_list_node));
-        temp_socket_list->receivers->next = NULL;
-        temp_receiver = temp_socket_list->receivers;
-    } else {
-        temp_receiver = temp_socket_list->receivers;
-        while (temp_receiver != NULL) {
-            if (temp_receiver->next == NULL) {
-                break;
-            }
-            temp_receiver = temp_receiver->next;
-        }
-        temp_receiver->next = malloc(sizeof (receiver_list_node));
-        temp_receiver = temp_receiver->next;
+    if ((temp_receiver = pool_get(&r_socket->ctx->receiver_pool)) == NULL) {
+        return NULL;
     }
+    temp_receiver->next = temp_socket_list->receivers;
+    temp_socket_list->receivers = temp_receiver;
     temp_receiver->to = addr;
-    temp_receiver->next = NULL;
     temp_receiver->SYN_seq = 0;
     temp_receiver->SYN_ACK = 0;
     temp_receiver->data_seq = 0;
     temp_receiver->FIN_seq = 0;
-    temp_receiver->FIN_ACK = 0;
+    temp_receiver->inflight = 0;
+    temp_receiver->queued = 0;
+    temp_receiver->sock = temp_socket_list;
+    temp_receiver->srtt = 0;
+    temp_receiver->rttvar = 0;
+    memset(&temp_receiver->stats, 0, sizeof (temp_receiver->stats));
     temp_receiver->last_seq = 0;
-    temp_receiver->SYN_packet = NULL;
+    temp_receiver->tail = NULL;
     temp_receiver->last_sent_packet = NULL;
+    temp_receiver->unacked = NULL;
+    temp_receiver->open = NULL;
+    temp_receiver->weight = 1;
+    temp_receiver->deficit = 0;
+    temp_receiver->turn = 0;
+    temp_receiver->scheduled = 0;
+    temp_receiver->sched_next = NULL;
+    temp_receiver->rwnd = -1;
+    temp_receiver->probes = 0;
+    temp_receiver->fec = NULL;
+    temp_receiver->persist_ms = 0;
     temp_receiver->bufferd_packet = NULL;
+    temp_receiver->peer = 0;
+    temp_receiver->conn = conn_add(temp_socket_list, temp_receiver, 0);
+    event_gettime(&temp_receiver->last_active);
+    arm_sweep(temp_socket_list);
     return temp_receiver;
 }
 
 receiver_list_node *search_receiver(socket_list_node *r_socket, struct sockaddr_in addr) {
     receiver_list_node *temp_receiver = r_socket->receivers;
     while (temp_receiver != NULL) {
-        if (ntohs(temp_receiver->to.sin_port) == ntohs(addr.sin_port) && !strcmp(inet_ntoa(temp_receiver->to.sin_addr), inet_ntoa(addr.sin_addr))) {
+        if (temp_receiver->to.sin_port == addr.sin_port && temp_receiver->to.sin_addr.s_addr == addr.sin_addr.s_addr) {
             return temp_receiver;
         }
-        temp_receiver = temp_receiver->next;
+        temp_receiver = temp_receiver->next;
+    }
+    return NULL;
+}
+
+/*
+ * conn_gen: a generation for a slot other than gen
+ */
+static u_int32_t conn_gen(socket_list_node *r_socket, u_int32_t gen) {
+    u_int32_t g = socket_random(r_socket) & CONN_GEN_MASK;
+    if (g == gen) {
+        g++;
+    }
+    return (g & CONN_GEN_MASK) != 0 ? g & CONN_GEN_MASK : 1;
+}
+
+/*
+ * conn_grow: Make room for n connections in the connection table of a socket
+ */
+int conn_grow(socket_list_node *r_socket, int n) {
+    struct conn_slot *conns;
+    int i;
+    if (n > MAXCONNS) {
+        n = MAXCONNS;
+    }
+    if (n <= r_socket->nconns) {
+        return 0;
+    }
+    if ((conns = realloc(r_socket->conns, n * sizeof (struct conn_slot))) == NULL) {
+        return -1;
+    }
+    for (i = n - 1; i >= r_socket->nconns; i--) {
+        conns[i].conn = NULL;
+        conns[i].gen = conn_gen(r_socket, 0);
+        conns[i].next_free = r_socket->free_conn;
+        r_socket->free_conn = i;
+    }
+    r_socket->conns = conns;
+    r_socket->nconns = n;
+    return 0;
+}
+
+/*
+ * conn_add: Give a connection an ID, 0 if the table is full; the
+ * connection then goes by the address of its peer only
+ */
+u_int32_t conn_add(socket_list_node *r_socket, void *conn, int incoming) {
+    struct conn_slot *slot;
+    int i;
+    if (r_socket->free_conn < 0) {
+        conn_grow(r_socket, r_socket->nconns ? 2 * r_socket->nconns : 16);
+        if (r_socket->free_conn < 0) {
+            return 0;
+        }
+    }
+    i = r_socket->free_conn;
+    slot = &r_socket->conns[i];
+    r_socket->free_conn = slot->next_free;
+    slot->conn = conn;
+    slot->incoming = incoming;
+    return slot->gen << CONN_BITS | i;
+}
+
+/*
+ * conn_del: Free the ID of a connection; packets still carrying it no
+ * longer match
+ */
+void conn_del(socket_list_node *r_socket, u_int32_t id) {
+    struct conn_slot *slot;
+    if (id == 0) {
+        return;
+    }
+    slot = &r_socket->conns[id & (MAXCONNS - 1)];
+    slot->conn = NULL;
+    slot->gen = conn_gen(r_socket, slot->gen);
+    slot->next_free = r_socket->free_conn;
+    r_socket->free_conn = id & (MAXCONNS - 1);
+}
+
+/*
+ * conn_get: Connection of an ID, NULL if the ID is not valid or is
+ * not of that direction
+ */
+void *conn_get(socket_list_node *r_socket, u_int32_t id, int incoming) {
+    unsigned int i = id & (MAXCONNS - 1);
+    struct conn_slot *slot;
+    if (i >= (unsigned int) r_socket->nconns) {
+        return NULL;
+    }
+    slot = &r_socket->conns[i];
+    if (slot->conn == NULL || slot->gen != id >> CONN_BITS || slot->incoming != incoming) {
+        return NULL;
+    }
+    return slot->conn;
+}
+
+/*
+ * find_sender: Incoming connection a packet is for, by the connection ID
+ * in its header or else by its source address. A packet with the ID from
+ * another address means the peer has moved, a NAT rebinding say: the
+ * connection follows it if the sequence number is within the receive
+ * window. A stray packet does not divert it. Nor does one forged off the
+ * path, unless it guesses the random generation in the ID and a sequence
+ * number near the random ISN. The new path is not challenged, so anyone
+ * who sees the packets can divert it.
+ */
+sender_list_node *find_sender(socket_list_node *r_socket, struct rudp_hdr *hdr, struct sockaddr_in *from) {
+    sender_list_node *sender;
+    int32_t d;
+    if (hdr->conn == 0 || (hdr->conn & CONN_COOKIE)) {
+        return search_sender(r_socket, *from);
+    }
+    if ((sender = conn_get(r_socket, hdr->conn, 1)) == NULL) {
+        RUDP_TRACE(RUDP_TR_DROP, from, hdr->seqno, hdr->type);
+        return NULL; //stale or forged
+    }
+    if (sender->to.sin_port != from->sin_port || sender->to.sin_addr.s_addr != from->sin_addr.s_addr) {
+        d = (int32_t) (hdr->seqno - sender->last_seq);
+        if (d <= -r_socket->rcvwindow || d > r_socket->rcvwindow) {
+            RUDP_TRACE(RUDP_TR_DROP, from, hdr->seqno, hdr->type);
+            return NULL;
+        }
+        RUDP_TRACE(RUDP_TR_MIGRATE, from, hdr->seqno, ntohs(from->sin_port));
+        sender->to = *from;
+    }
+    return sender;
+}
+
+/*
+ * find_receiver: Outgoing connection an ACK is for, NULL if its ID is
+ * stale or forged; the caller drops it. Packets keep going to the address
+ * the application sends to, wherever the ACKs come from.
+ */
+receiver_list_node *find_receiver(socket_list_node *r_socket, struct rudp_hdr *hdr, struct sockaddr_in *from) {
+    if (hdr->conn == 0) {
+        return search_receiver(r_socket, *from);
+    }
+    return conn_get(r_socket, hdr->conn, 0);
+}
+
+/*
+ * halfopen_done: an incoming connection has sent more than its SYN
+ */
+void halfopen_done(socket_list_node *r_socket, sender_list_node *sender) {
+    if (sender->halfopen) {
+        sender->halfopen = 0;
+        r_socket->halfopen--;
+    }
+}
+
+/*
+ * syn_flood: whether a SYN from a new peer should get no state
+ */
+int syn_flood(socket_list_node *r_socket) {
+    return r_socket->syncookies == 2 ||
+            (r_socket->halfopen_max > 0 && r_socket->halfopen >= r_socket->halfopen_max);
+}
+
+/*
+ * socket_key: pick the secret of a socket, from the random source of the
+ * datagram layer
+ */
+void socket_key(socket_list_node *r_socket) {
+    struct timeval t;
+    struct rudp_netops *net = r_socket->ctx->net;
+    if (net->random == NULL || net->random(r_socket->key, sizeof (r_socket->key)) < 0) {
+        event_gettime(&t);
+        r_socket->key[0] = (u_int64_t) rand() << 32 ^ rand() ^ (uintptr_t) r_socket;
+        r_socket->key[1] = (u_int64_t) rand() << 32 ^ rand() ^ t.tv_sec << 20 ^ t.tv_usec;
+    }
+}
+
+#define ROTL(x, b) (((x) << (b)) | ((x) >> (64 - (b))))
+#define SIPROUND do { \
+        v0 += v1; v1 = ROTL(v1, 13); v1 ^= v0; v0 = ROTL(v0, 32); \
+        v2 += v3; v3 = ROTL(v3, 16); v3 ^= v2; \
+        v0 += v3; v3 = ROTL(v3, 21); v3 ^= v0; \
+        v2 += v1; v1 = ROTL(v1, 17); v1 ^= v2; v2 = ROTL(v2, 32); \
+    } while (0)
+
+/*
+ * siphash: SipHash-2-4 of two words with the key of a socket
+ */
+u_int64_t siphash(socket_list_node *r_socket, u_int64_t m0, u_int64_t m1) {
+    u_int64_t m[2] = {m0, m1}, v0, v1, v2, v3;
+    int i, r;
+    v0 = r_socket->key[0] ^ 0x736f6d6570736575ULL;
+    v1 = r_socket->key[1] ^ 0x646f72616e646f6dULL;
+    v2 = r_socket->key[0] ^ 0x6c7967656e657261ULL;
+    v3 = r_socket->key[1] ^ 0x7465646279746573ULL;
+    for (i = 0; i < 3; i++) {
+        u_int64_t w = i < 2 ? m[i] : (u_int64_t) sizeof (m) << 56;
+        v3 ^= w;
+        for (r = 0; r < 2; r++) {
+            SIPROUND;
+        }
+        v0 ^= w;
+    }
+    v2 ^= 0xff;
+    for (r = 0; r < 4; r++) {
+        SIPROUND;
+    }
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
+/*
+ * socket_random: an unpredictable number, for initial sequence numbers
+ * and connection ID generations
+ */
+u_int32_t socket_random(socket_list_node *r_socket) {
+    return (u_int32_t) siphash(r_socket, ++r_socket->nonce, 0);
+}
+
+/*
+ * syn_cookie: the ID the ACK of a SYN carries when no state is kept, a
+ * SipHash of the peer's address, its initial sequence number and the
+ * cookie period, which its bit 30 tells from the one before. A period is
+ * never 0 in the second word, which keeps cookies apart from
+ * socket_random().
+ */
+u_int32_t syn_cookie(socket_list_node *r_socket, struct sockaddr_in *from, u_int32_t isn, u_int32_t period) {
+    u_int64_t m0 = (u_int64_t) from->sin_addr.s_addr << 32 | from->sin_port;
+    u_int64_t m1 = (u_int64_t) isn << 32 | period;
+    return CONN_COOKIE | (period & 1) << 30 | (siphash(r_socket, m0, m1) & 0x3FFFFFFF);
+}
+
+/*
+ * cookie_ack: acknowledge a SYN without keeping state
+ */
+int cookie_ack(socket_list_node *r_socket, struct rudp_hdr *hdr, struct sockaddr_in *from, char *data, int len) {
+    char buf[sizeof (struct rudp_hdr) + RUDP_ACKWIN + RUDP_ACKCONN];
+    struct rudp_hdr ack;
+    struct timeval now;
+    u_int32_t peer = 0, cookie;
+    int w = r_socket->rcvwindow - r_socket->lent;
+    u_int16_t win = htons(w > 0 ? w : 0);
+    if (len >= RUDP_SYNCONN) {
+        memcpy(&peer, data, RUDP_SYNCONN);
+    }
+    event_gettime(&now);
+    cookie = htonl(syn_cookie(r_socket, from, hdr->seqno,
+            (now.tv_sec * 1000 + now.tv_usec / 1000) / RUDP_COOKIE_MS));
+    ack.version = RUDP_VERSION;
+    ack.type = RUDP_ACK;
+    ack.seqno = hdr->seqno + 1;
+    ack.conn = ntohl(peer);
+    memcpy(buf, &ack, sizeof (struct rudp_hdr));
+    memcpy(buf + sizeof (struct rudp_hdr), &win, RUDP_ACKWIN);
+    memcpy(buf + sizeof (struct rudp_hdr) + RUDP_ACKWIN, &cookie, RUDP_ACKCONN);
+    r_socket->stats.syn_cookies++;
+    r_socket->stats.pkts_sent++;
+    r_socket->stats.bytes_sent += sizeof (buf);
+    RUDP_TRACE(RUDP_TR_SEND_ACK, from, ack.seqno, RUDP_SYN);
+    return rudp_output(r_socket, buf, sizeof (buf), from);
+}
+
+/*
+ * cookie_accept: set up the incoming connection of a packet from a peer
+ * without state, if it carries the cookie its SYN got; it must be the
+ * first after the SYN, or the peer's retransmission of it
+ */
+sender_list_node *cookie_accept(socket_list_node *r_socket, struct rudp_hdr *hdr, struct sockaddr_in *from) {
+    sender_list_node *sender;
+    struct timeval now;
+    u_int32_t period, isn = hdr->seqno - 1;
+    if (r_socket->syncookies == 0) {
+        return NULL;
+    }
+    event_gettime(&now);
+    period = (now.tv_sec * 1000 + now.tv_usec / 1000) / RUDP_COOKIE_MS;
+    if (((hdr->conn >> 30) & 1) != (period & 1)) {
+        period--;
+    }
+    if (hdr->conn != syn_cookie(r_socket, from, isn, period) || syn_ended(r_socket, from, isn)) {
+        RUDP_TRACE(RUDP_TR_DROP, from, hdr->seqno, hdr->type);
+        return NULL;
+    }
+    if ((sender = add_sender(r_socket, *from)) == NULL) {
+        return NULL;
+    }
+    sender->SYN_seq = isn;
+    sender->last_seq = isn;
+    return sender;
+}
+//static int ii=0;
+
+packet_queue_node *add_packet_to_queue(receiver_list_node * receiver, int type, u_int32_t seqno, int data_len, struct sockaddr_in to) {
+    receiver_list_node *temp_receiver = receiver;
+    if (temp_receiver == NULL) {
+        return NULL;
+    }
+    packet_queue_node *temp_packet_node;
+    if ((temp_packet_node = pool_get(&temp_receiver->sock->ctx->packet_pool)) == NULL) {
+        return NULL;
+    }
+    close_open(temp_receiver); //only the last packet takes more messages
+    if (temp_receiver->bufferd_packet == NULL) {
+        temp_receiver->bufferd_packet = temp_packet_node;
+        temp_receiver->last_sent_packet = temp_packet_node;
+    } else {
+        temp_receiver->tail->next = temp_packet_node;
+    }
+    temp_receiver->tail = temp_packet_node;
+    temp_packet_node->to = to;
+    temp_packet_node->retries = 0;
+    temp_packet_node->state = 0;
+    temp_packet_node->data_len = data_len;
+    temp_packet_node->packet.header.version = RUDP_VERSION;
+    temp_packet_node->packet.header.type = type;
+    temp_packet_node->packet.header.seqno = seqno;
+    temp_packet_node->packet.header.conn = 0; //set by send_packet(), the peer may tell it meanwhile
+    temp_packet_node->TimeoutDel = 0;
+    temp_packet_node->next = NULL;
+    temp_packet_node->is_FIN_ACK = 0;
+    temp_packet_node->owner = temp_receiver;
+    temp_receiver->queued++;
+    //printf("packet type: %d    packet seq %d\n",temp_packet_node->packet.header.type,temp_packet_node->packet.header.seqno);
+    // for ( ii=0;ii<temp_packet_node->data_len+1;ii++){
+    // printf("%d",temp_packet_node->packet.data[ii]);}
+    //  printf("\n");
+    return temp_packet_node;
+}
+
+/*
+ * deliver: hand in-order data to the application. In message mode the
+ * segments of a message are collected until its last one arrives.
+ */
+void deliver(socket_list_node * socket, sender_list_node * sender, struct sockaddr_in *addr, char *data, int len, int more) {
+    char *buf;
+    int cap;
+    if (socket->maxmsg == 0 || (!more && sender->msglen == 0 && !sender->msgdrop)) {
+        socket->socket_recvfrom_handler(socket->handle, addr, data, len);
+        return;
+    }
+    if (!sender->msgdrop && sender->msglen + len > socket->maxmsg) {
+        fprintf(stderr, "rudp: message larger than RUDP_OPT_MESSAGE dropped\n");
+        sender->msgdrop = 1;
+    }
+    if (!sender->msgdrop) {
+        if (sender->msglen + len > sender->msgcap) {
+            cap = sender->msgcap ? sender->msgcap : 4 * RUDP_MAXPKTSIZE;
+            while (cap < sender->msglen + len) {
+                cap *= 2;
+            }
+            if ((buf = realloc(sender->msg, cap)) == NULL) {
+                fprintf(stderr, "rudp: out of memory, message dropped\n");
+                sender->msgdrop = 1;
+            } else {
+                sender->msg = buf;
+                sender->msgcap = cap;
+            }
+        }
+        if (!sender->msgdrop) {
+            memcpy(sender->msg + sender->msglen, data, len);
+            sender->msglen += len;
+        }
+    }
+    if (more) {
+        return;
+    }
+    if (sender->msgdrop) {
+        sender->msgdrop = 0;
+        sender->msglen = 0;
+        return;
+    }
+    //the handler may close the socket and free the sender: lend it the buffer
+    buf = sender->msg;
+    cap = sender->msgcap;
+    len = sender->msglen;
+    sender->msg = NULL;
+    sender->msgcap = 0;
+    sender->msglen = 0;
+    socket->socket_recvfrom_handler(socket->handle, addr, buf, len);
+    if (socket->closed) {
+        free(buf);
+    } else {
+        sender->msg = buf;
+        sender->msgcap = cap;
+    }
+}
+
+/*
+ * accept_data: take the next in-order packet of an incoming connection.
+ * Returns -1 if there are no batch buffers for it.
+ */
+int accept_data(socket_list_node * socket, sender_list_node * sender, struct sockaddr_in *addr, int type, u_int32_t seqno, char *data, int len) {
+    if (socket->socket_recvbatch_handler != NULL &&
+            pool_reserve(&socket->ctx->rxbuf_pool, type == RUDP_DATA_PACKED ?
+            packed_count(data, len) : 1) < 0) {
+        return -1;
+    }
+    RUDP_TRACE(RUDP_TR_DELIVER, addr, seqno, len);
+    sender->last_seq = seqno;
+    pass_up(socket, sender, addr, type, data, len);
+    return 0;
+}
+
+/*
+ * pass_up: hand the data of a packet to the application
+ */
+void pass_up(socket_list_node * socket, sender_list_node * sender, struct sockaddr_in *addr, int type, char *data, int len) {
+    if (type == RUDP_DATA_PACKED) {
+        deliver_packed(socket, sender, addr, data, len);
+    } else if (socket->socket_recvbatch_handler != NULL) {
+        batch_add(socket, addr, data, len, type == RUDP_DATA_MORE);
+    } else {
+        deliver(socket, sender, addr, data, len, type == RUDP_DATA_MORE);
+    }
+}
+
+/*
+ * rcv_window: packets an incoming connection may still send beyond the
+ * next in-order one's place, what the receive window has left
+ */
+static int rcv_window(socket_list_node * socket, sender_list_node * sender) {
+    int w = socket->rcvwindow - sender->nheld - socket->lent;
+    return w > 0 ? w : 0;
+}
+
+/*
+ * hold: keep a packet that arrived after a gap, if it falls within the
+ * receive window, until the gap is filled. An unordered one, if the
+ * socket takes those, is delivered now and only its place kept.
+ */
+void hold(socket_list_node * socket, sender_list_node * sender, struct sockaddr_in *addr, struct rudp_hdr *hdr, char *data, int len) {
+    packet_queue_node **pp, *pk;
+    //in message mode it could land between the segments of a message
+    int early = hdr->type == RUDP_DATA_UNORDERED && socket->unordered && socket->maxmsg == 0;
+    if (rcv_window(socket, sender) == 0 ||
+            SEQ_GEQ(hdr->seqno, sender->last_seq + 1 + socket->rcvwindow)) {
+        return;
+    }
+    for (pp = &sender->held; *pp != NULL && SEQ_LT((*pp)->packet.header.seqno, hdr->seqno); pp = &(*pp)->next)
+        ;
+    if (*pp != NULL && (*pp)->packet.header.seqno == hdr->seqno) {
+        return; //already held
+    }
+    if (early && socket->socket_recvbatch_handler != NULL &&
+            pool_reserve(&socket->ctx->rxbuf_pool, 1) < 0) {
+        return;
+    }
+    if ((pk = pool_get(&socket->ctx->packet_pool)) == NULL) {
+        return;
+    }
+    pk->packet.header = *hdr;
+    pk->data_len = early ? -1 : len;
+    if (!early) {
+        memcpy(pk->packet.data, data, len);
+    }
+    pk->next = *pp;
+    *pp = pk;
+    sender->nheld++;
+    RUDP_TRACE(RUDP_TR_HOLD, &sender->to, hdr->seqno, sender->nheld);
+    if (early) {
+        //held first: the handler may close the socket, which frees the sender
+        RUDP_TRACE(RUDP_TR_EARLY, addr, hdr->seqno, len);
+        pass_up(socket, sender, addr, hdr->type, data, len);
+    }
+}
+
+/*
+ * accept_held: take the held packets that have become in-order
+ */
+void accept_held(socket_list_node * socket, sender_list_node * sender, struct sockaddr_in *addr) {
+    packet_queue_node *pk;
+    while (!socket->closed && (pk = sender->held) != NULL &&
+            SEQ_LEQ(pk->packet.header.seqno, sender->last_seq + 1)) {
+        //unlinked first: the handler may close the socket, which frees the sender
+        sender->held = pk->next;
+        sender->nheld--;
+        if (pk->data_len < 0) {
+            sender->last_seq = pk->packet.header.seqno; //delivered when it arrived
+        } else if (pk->packet.header.seqno == sender->last_seq + 1 &&
+                accept_data(socket, sender, addr, pk->packet.header.type, pk->packet.header.seqno,
+                pk->packet.data, pk->data_len) < 0) {
+            pk->next = sender->held;
+            sender->held = pk;
+            sender->nheld++;
+            return;
+        }
+        pool_put(&socket->ctx->packet_pool, pk);
+    }
+}
+
+/*
+ * drop_held: forget the held packets of an incoming connection
+ */
+void drop_held(socket_list_node * socket, sender_list_node * sender) {
+    packet_queue_node *pk;
+    while ((pk = sender->held) != NULL) {
+        sender->held = pk->next;
+        pool_put(&socket->ctx->packet_pool, pk);
+    }
+    sender->nheld = 0;
+}
+
+/*
+ * take_data: deliver a data packet of an incoming connection if it is
+ * the next in order, with the held ones it lets through, or hold it.
+ * Returns -1 if there was no buffer for it.
+ */
+int take_data(socket_list_node * socket, sender_list_node * sender, struct sockaddr_in *addr, struct rudp_hdr *hdr, char *data, int len) {
+    if (hdr->seqno == sender->last_seq + 1) {
+        if (accept_data(socket, sender, addr, hdr->type, hdr->seqno, data, len) < 0) {
+            return -1;
+        }
+        accept_held(socket, sender, addr);
+    } else if (SEQ_GT(hdr->seqno, sender->last_seq + 1)) {
+        hold(socket, sender, addr, hdr, data, len);
+    }
+    return 0;
+}
+
+static int is_data(int type) {
+    return type == RUDP_DATA || type == RUDP_DATA_MORE || type == RUDP_DATA_PACKED ||
+            type == RUDP_DATA_UNORDERED;
+}
+
+//XOR in 16 bytes at a time, which the compiler maps to SSE2 or NEON
+typedef unsigned char fec_vec __attribute__((vector_size(16)));
+
+/*
+ * fec_xor: dst ^= src over len bytes
+ */
+void fec_xor(char *dst, const char *src, int len) {
+    fec_vec a, b;
+    int i;
+    for (i = 0; i + (int) sizeof (fec_vec) <= len; i += sizeof (fec_vec)) {
+        memcpy(&a, dst + i, sizeof (fec_vec));
+        memcpy(&b, src + i, sizeof (fec_vec));
+        a ^= b;
+        memcpy(dst + i, &a, sizeof (fec_vec));
+    }
+    for (; i < len; i++) {
+        dst[i] ^= src[i];
+    }
+}
+
+/*
+ * fec_sent: add the first transmission of a packet to the parity of its
+ * connection's block, and send the parity when the block is full. Sequence
+ * numbers in a block are consecutive, so other packets end it.
+ */
+void fec_sent(socket_list_node * r_socket, receiver_list_node * receiver, packet_queue_node *pk) {
+    struct fec_tx *f = receiver->fec;
+    int len = pk->data_len;
+    if (f == NULL) {
+        if ((f = receiver->fec = calloc(1, sizeof (struct fec_tx))) == NULL) {
+            return;
+        }
+        f->k = RUDP_FEC_MAXK; //adaptive: until the first estimate
+    }
+    if (!is_data(pk->packet.header.type)) {
+        fec_flush(r_socket, receiver);
+        return;
+    }
+    if (r_socket->fec > 1) {
+        f->k = r_socket->fec;
+    } else if (++f->sent == RUDP_FEC_ADAPT) {
+        fec_adapt(r_socket, receiver);
+    }
+    if (f->k == 0) {
+        return;
+    }
+    if (f->count == 0) {
+        f->first = pk->packet.header.seqno;
+        f->maxlen = 0;
+        f->lenx = 0;
+        f->typex = 0;
+    }
+    if (len > f->maxlen) {
+        memset(f->parity + f->maxlen, 0, len - f->maxlen);
+        f->maxlen = len;
+    }
+    fec_xor(f->parity, pk->packet.data, len);
+    f->lenx ^= len;
+    f->typex ^= pk->packet.header.type;
+    if (++f->count >= f->k) {
+        fec_flush(r_socket, receiver);
+    }
+}
+
+/*
+ * fec_flush: end the block of an outgoing connection, sending its parity
+ * unless it has a single packet
+ */
+int fec_flush(socket_list_node * r_socket, receiver_list_node * receiver) {
+    struct fec_tx *f = receiver->fec;
+    char buf[sizeof (struct rudp_hdr) + RUDP_FECHDR + RUDP_MAXPKTSIZE];
+    struct rudp_hdr hdr;
+    u_int16_t v[3];
+    int len;
+    if (f == NULL || f->count == 0) {
+        return 0;
+    }
+    if (f->count == 1) {
+        f->count = 0;
+        return 0; //the packet itself again, let the retransmission handle it
+    }
+    hdr.version = RUDP_VERSION;
+    hdr.type = RUDP_FEC;
+    hdr.seqno = f->first;
+    hdr.conn = receiver->peer;
+    v[0] = htons(f->count);
+    v[1] = htons(f->lenx);
+    v[2] = htons(f->typex);
+    memcpy(buf, &hdr, sizeof (struct rudp_hdr));
+    memcpy(buf + sizeof (struct rudp_hdr), v, RUDP_FECHDR);
+    memcpy(buf + sizeof (struct rudp_hdr) + RUDP_FECHDR, f->parity, f->maxlen);
+    len = sizeof (struct rudp_hdr) + RUDP_FECHDR + f->maxlen;
+    f->count = 0;
+    STAT_ADD(r_socket, receiver, pkts_sent, 1);
+    STAT_ADD(r_socket, receiver, bytes_sent, len);
+    STAT_ADD(r_socket, receiver, pkts_parity, 1);
+    RUDP_TRACE(RUDP_TR_SEND, &receiver->to, hdr.seqno, RUDP_FEC);
+    return rudp_output(r_socket, buf, len, &receiver->to);
+}
+
+/*
+ * fec_adapt: estimate the loss rate of an outgoing connection from its
+ * timeouts and the repairs its peer reported, and size the blocks
+ * so that about one in ten has a packet lost: more than one is rarely
+ * lost then. Below a loss of one in 640 there is no parity.
+ */
+void fec_adapt(socket_list_node * r_socket, receiver_list_node * receiver) {
+    struct fec_tx *f = receiver->fec;
+    long sample = f->lost >= f->sent ? 1000000 : f->lost * 1000000L / f->sent;
+    f->loss_ppm = (3 * f->loss_ppm + sample) / 4;
+    f->k = f->loss_ppm > 0 ? 100000 / f->loss_ppm : 0;
+    if (f->k > 2 * RUDP_FEC_MAXK) {
+        f->k = 0;
+    } else if (f->k > RUDP_FEC_MAXK) {
+        f->k = RUDP_FEC_MAXK;
+    } else if (f->k < 2) {
+        f->k = 2;
+    }
+    if (f->k == 0) {
+        fec_flush(r_socket, receiver);
+    }
+    f->sent = 0;
+    f->lost = 0;
+}
+
+/*
+ * fec_rx_new: start keeping the packets of an incoming connection for
+ * repairs
+ */
+struct fec_rx *fec_rx_new(sender_list_node * sender) {
+    int i;
+    if ((sender->fec = malloc(sizeof (struct fec_rx))) == NULL) {
+        return NULL;
+    }
+    for (i = 0; i < RUDP_FEC_SPAN; i++) {
+        sender->fec->slot[i].len = -1;
+    }
+    sender->fec->nparity = 0;
+    sender->fec->repaired = 0;
+    return sender->fec;
+}
+
+/*
+ * fec_store: keep a received data packet for repairs, unless its place
+ * in the ring holds a later one
+ */
+void fec_store(sender_list_node * sender, struct rudp_hdr *hdr, char *data, int len) {
+    struct fec_slot *s = &sender->fec->slot[hdr->seqno % RUDP_FEC_SPAN];
+    if (s->len >= 0 && SEQ_GEQ(s->seq, hdr->seqno)) {
+        return;
+    }
+    s->seq = hdr->seqno;
+    s->type = hdr->type;
+    s->len = len;
+    memcpy(s->data, data, len);
+}
+
+/*
+ * fec_park: keep a parity packet until its block can be repaired or is
+ * complete, in place of the oldest one if there are too many
+ */
+void fec_park(sender_list_node * sender, struct rudp_hdr *hdr, char *data, int len) {
+    struct fec_rx *f = sender->fec;
+    struct fec_parity *p;
+    u_int16_t count;
+    int i;
+    memcpy(&count, data, sizeof (count));
+    if (SEQ_LEQ(hdr->seqno + ntohs(count) - 1, sender->last_seq)) {
+        return; //all delivered
+    }
+    for (i = 0; i < f->nparity; i++) {
+        if (f->parity[i].seq == hdr->seqno) {
+            return;
+        }
+    }
+    if (f->nparity < RUDP_FEC_PENDING) {
+        p = &f->parity[f->nparity++];
+    } else {
+        p = &f->parity[0];
+        for (i = 1; i < f->nparity; i++) {
+            if (SEQ_LT(f->parity[i].seq, p->seq)) {
+                p = &f->parity[i];
+            }
+        }
+    }
+    p->seq = hdr->seqno;
+    p->len = len;
+    memcpy(p->data, data, len);
+}
+
+/*
+ * fec_repair: rebuild the packets of an incoming connection that waiting
+ * parity can restore, each the one missing in its block, and take them
+ * like received ones. Parity of a complete block, or of one with packets
+ * delivered and no longer kept, is dropped. Returns the packets rebuilt.
+ */
+int fec_repair(socket_list_node * socket, sender_list_node * sender, struct sockaddr_in *addr) {
+    struct fec_rx *f = sender->fec;
+    struct fec_parity *p;
+    struct fec_slot *s;
+    struct rudp_hdr hdr;
+    char buf[RUDP_MAXPKTSIZE];
+    u_int16_t v[3];
+    u_int32_t seq, miss = 0;
+    int i, j, nmiss, len = 0, lenx = 0, type = 0, repaired = 0;
+    for (i = 0; i < f->nparity; i++) {
+        p = &f->parity[i];
+        memcpy(v, p->data, RUDP_FECHDR);
+        nmiss = 0;
+        for (j = 0; j < ntohs(v[0]) && nmiss >= 0; j++) {
+            seq = p->seq + j;
+            s = &f->slot[seq % RUDP_FEC_SPAN];
+            if (s->len < 0 || s->seq != seq) {
+                nmiss = SEQ_LEQ(seq, sender->last_seq) ? -1 : nmiss + 1;
+                miss = seq;
+            }
+        }
+        if (nmiss > 1) {
+            continue; //may come down to one with a retransmission
+        }
+        if (nmiss == 1) {
+            len = p->len - RUDP_FECHDR;
+            lenx = ntohs(v[1]);
+            type = ntohs(v[2]);
+            memcpy(buf, p->data + RUDP_FECHDR, len);
+            for (j = 0; j < ntohs(v[0]); j++) {
+                s = &f->slot[(p->seq + j) % RUDP_FEC_SPAN];
+                if (p->seq + j == miss) {
+                    continue;
+                }
+                if (s->len > len) {
+                    type = 0; //not the block of this parity
+                    break;
+                }
+                fec_xor(buf, s->data, s->len);
+                lenx ^= s->len;
+                type ^= s->type;
+            }
+        }
+        f->nparity--;
+        f->parity[i--] = f->parity[f->nparity];
+        if (nmiss <= 0 || lenx > len || !is_data(type)) {
+            continue;
+        }
+        hdr.version = RUDP_VERSION;
+        hdr.type = type;
+        hdr.seqno = miss;
+        hdr.conn = sender->conn;
+        fec_store(sender, &hdr, buf, lenx);
+        f->repaired++;
+        STAT_ADD(socket, sender, pkts_repaired, 1);
+        RUDP_TRACE(RUDP_TR_REPAIR, addr, miss, lenx);
+        repaired++;
+        take_data(socket, sender, addr, &hdr, buf, lenx);
+        //the handler may have closed the socket, which frees the sender
+        if (socket->closed) {
+            return repaired;
+        }
+        i = -1; //the packets it let through may complete other blocks
+    }
+    return repaired;
+}
+
+/*
+ * send_ack: acknowledge what an incoming connection has delivered in
+ * order, advertising the receive window left
+ */
+int send_ack(socket_list_node * socket, sender_list_node * sender, int acked) {
+    char buf[sizeof (struct rudp_hdr) + RUDP_ACKWIN + RUDP_ACKCONN + RUDP_ACKFEC];
+    struct rudp_hdr hdr;
+    u_int16_t win, repaired;
+    u_int32_t conn = htonl(sender->conn);
+    int len = sizeof (struct rudp_hdr) + RUDP_ACKWIN + RUDP_ACKCONN;
+    hdr.version = RUDP_VERSION;
+    hdr.type = RUDP_ACK;
+    hdr.seqno = sender->last_seq + 1;
+    hdr.conn = sender->peer;
+    sender->adv = rcv_window(socket, sender);
+    if (sender->adv == 0) {
+        socket->win_closed = 1;
+    }
+    win = htons(sender->adv > 0xFFFF ? 0xFFFF : sender->adv);
+    memcpy(buf, &hdr, sizeof (struct rudp_hdr));
+    memcpy(buf + sizeof (struct rudp_hdr), &win, RUDP_ACKWIN);
+    memcpy(buf + sizeof (struct rudp_hdr) + RUDP_ACKWIN, &conn, RUDP_ACKCONN);
+    if (sender->fec != NULL) {
+        repaired = htons(sender->fec->repaired);
+        memcpy(buf + len, &repaired, RUDP_ACKFEC);
+        len += RUDP_ACKFEC;
+    }
+    STAT_ADD(socket, sender, pkts_sent, 1);
+    STAT_ADD(socket, sender, bytes_sent, len);
+    RUDP_TRACE(RUDP_TR_SEND_ACK, &sender->to, hdr.seqno, acked);
+    return rudp_output(socket, buf, len, &sender->to);
+}
+
+/*
+ * update_cb: batch buffers have come back: send a window update to the
+ * peers that were told the window is closed
+ */
+int update_cb(int fd, void *arg) {
+    socket_list_node *socket = (socket_list_node *) arg;
+    sender_list_node *sender;
+    socket->update_armed = 0;
+    socket->win_closed = 0;
+    for (sender = socket->senders; sender != NULL; sender = sender->next) {
+        if (sender->adv != 0) {
+            continue;
+        }
+        if (rcv_window(socket, sender) == 0) {
+            socket->win_closed = 1;
+        } else if (send_ack(socket, sender, RUDP_ACK) < 0) {
+            fprintf(stderr, "Failed to send window update in update_cb function\n");
+        }
+    }
+    return 0;
+}
+
+/*
+ * packed_count: number of messages in a RUDP_DATA_PACKED packet
+ */
+int packed_count(char *data, int len) {
+    u_int16_t flen;
+    int n = 0;
+    while (len >= RUDP_FRAMEHDR) {
+        memcpy(&flen, data, RUDP_FRAMEHDR);
+        flen = ntohs(flen);
+        if (flen > len - RUDP_FRAMEHDR) {
+            break;
+        }
+        data += RUDP_FRAMEHDR + flen;
+        len -= RUDP_FRAMEHDR + flen;
+        n++;
+    }
+    return n;
+}
+
+/*
+ * deliver_packed: split a RUDP_DATA_PACKED packet into its messages and
+ * hand them to the application one by one
+ */
+void deliver_packed(socket_list_node * socket, sender_list_node * sender, struct sockaddr_in *addr, char *data, int len) {
+    u_int16_t flen;
+    while (len >= RUDP_FRAMEHDR && !socket->closed) {
+        memcpy(&flen, data, RUDP_FRAMEHDR);
+        flen = ntohs(flen);
+        if (flen > len - RUDP_FRAMEHDR) {
+            fprintf(stderr, "rudp: bad message length in packed packet\n");
+            return;
+        }
+        if (socket->socket_recvbatch_handler != NULL) {
+            batch_add(socket, addr, data + RUDP_FRAMEHDR, flen, 0);
+        } else {
+            deliver(socket, sender, addr, data + RUDP_FRAMEHDR, flen, 0);
+        }
+        data += RUDP_FRAMEHDR + flen;
+        len -= RUDP_FRAMEHDR + flen;
+    }
+}
+
+/*
+ * batch_add: keep in-order data for the batch handler, which gets it when
+ * the event loop has no more input ready, or when RUDP_BATCH buffers have
+ * been collected. Returns -1 if there is no buffer for it.
+ */
+int batch_add(socket_list_node * socket, struct sockaddr_in *addr, char *data, int len, int more) {
+    struct rxbuf *rb;
+    struct timeval now;
+    if ((rb = pool_get(&socket->ctx->rxbuf_pool)) == NULL) {
+        return -1;
+    }
+    rb->ctx = socket->ctx;
+    rb->sock = socket->handle;
+    socket->lent++;
+    rb->b.next = NULL;
+    rb->b.from = *addr;
+    rb->b.more = more;
+    rb->b.len = len;
+    rb->b.data = rb->data;
+    memcpy(rb->data, data, len);
+    if (socket->batch == NULL) {
+        socket->batch = &rb->b;
+    } else {
+        socket->batch_last->next = &rb->b;
+    }
+    socket->batch_last = &rb->b;
+    if (++socket->nbatch >= RUDP_BATCH) {
+        batch_flush(socket);
+    } else if (!socket->batch_armed) {
+        //a zero timer runs once the pending input has been handled
+        event_gettime(&now);
+        if (event_timeout(now, batch_cb, socket, "rudp_batch") < 0) {
+            batch_flush(socket);
+        } else {
+            socket->batch_armed = 1;
+        }
     }
-    return NULL;
+    return 0;
 }
-//static int ii=0;
 
-packet_queue_node *add_packet_to_queue(receiver_list_node * receiver, int data_len, rudp_packet rudppacket, struct sockaddr_in to) {
-    receiver_list_node *temp_receiver = receiver;
-    if (temp_receiver == NULL) {
-        return NULL;
+/*
+ * batch_flush: hand the collected buffers to the batch handler
+ */
+void batch_flush(socket_list_node * socket) {
+    struct rudp_buf *list = socket->batch;
+    int n = socket->nbatch;
+    if (socket->batch_armed) {
+        event_timeout_delete(batch_cb, socket);
+        socket->batch_armed = 0;
     }
-    packet_queue_node *temp_packet_node;
-    if (temp_receiver->bufferd_packet == NULL) {
-        temp_receiver->bufferd_packet = malloc(sizeof (packet_queue_node));
-        temp_receiver->bufferd_packet->next = NULL;
-        temp_receiver->last_sent_packet = temp_receiver->bufferd_packet;
-        temp_packet_node = temp_receiver->bufferd_packet;
-    } else {
-        temp_packet_node = temp_receiver->bufferd_packet;
-        while (temp_packet_node != NULL) {
-            if (temp_packet_node->next == NULL) {
-                break;
-            }
-            temp_packet_node = temp_packet_node->next;
-        }
-        temp_packet_node->next = malloc(sizeof (packet_queue_node));
-        temp_packet_node = temp_packet_node->next;
+    if (list == NULL) {
+        return;
     }
-    temp_packet_node->to = to;
-    temp_packet_node->retries = 0;
-    temp_packet_node->state = 0;
-    temp_packet_node->data_len = data_len;
-    temp_packet_node->packet = rudppacket;
-    temp_packet_node->TimeoutDel = 0;
-    temp_packet_node->next = NULL;
-    temp_packet_node->is_FIN_ACK = 0;
-    //printf("packet type: %d    packet seq %d\n",temp_packet_node->packet.header.type,temp_packet_node->packet.header.seqno);
-    // for ( ii=0;ii<temp_packet_node->data_len+1;ii++){
-    // printf("%d",temp_packet_node->packet.data[ii]);}
-    //  printf("\n");
-    return temp_packet_node;
+    socket->batch = socket->batch_last = NULL;
+    socket->nbatch = 0;
+    socket->socket_recvbatch_handler(socket->handle, list, n);
 }
 
-packet_queue_node *search_packet(receiver_list_node * receiver, u_int32_t seq) {
-    packet_queue_node *temp_packet = receiver->bufferd_packet;
-    while (temp_packet != NULL) {
-        if (receiver->SYN_seq == seq) {
-            return temp_packet;
-        }
-        if (temp_packet->packet.header.seqno == seq) {
-            return temp_packet;
-        }
-        if (temp_packet->next == NULL) {
-            return NULL;
-        }
-        temp_packet = temp_packet->next;
+int batch_cb(int fd, void *arg) {
+    socket_list_node *socket = (socket_list_node *) arg;
+    socket->batch_armed = 0;
+    batch_flush(socket);
+    return 0;
+}
+
+/*
+ * rudp_output: hand a datagram to the datagram layer, through the
+ * impairment shim when it is enabled for sending.
+ */
+int rudp_output(socket_list_node * r_socket, void *buf, int len, struct sockaddr_in *to) {
+    struct rudp_impair_state *st;
+    if ((rudp_impair_on & RUDP_IMPAIR_BIT(RUDP_IMPAIR_SEND)) && (st = ctx_impair(r_socket->ctx)) != NULL) {
+        return rudp_impair_output(st, r_socket->sockfd, buf, len, to, r_socket->ctx->net->sendto);
     }
-    return NULL;
+    return r_socket->ctx->net->sendto(r_socket->sockfd, buf, len, to);
 }
 
 int send_packet(socket_list_node * r_socket, packet_queue_node *pk, struct sockaddr_in to) {
@@ -421,19 +2171,16 @@ int send_packet(socket_list_node * r_socket, packet_queue_node *pk, struct socka
     t1.tv_sec = 0;
     t1.tv_usec = 0;
     int len = pk->data_len;
-    rudp_packet * packet = (rudp_packet *) malloc(sizeof (rudp_packet));
-    packet->header = pk->packet.header;
-    memcpy(packet->data, pk->packet.data, len);
-    char * buffer = malloc(len * sizeof (char) + sizeof (struct rudp_hdr));
-    memcpy(buffer, &packet->header, sizeof (struct rudp_hdr));
-    memcpy(buffer + sizeof (struct rudp_hdr), pk->packet.data, len);
 
 
     // Start the timeout callback with event_timeout
     timer.tv_sec = RUDP_TIMEOUT / 1000; // convert to second
     timer.tv_usec = (RUDP_TIMEOUT % 1000) * 1000; // convert to micro
-    gettimeofday(&t0, NULL); // current time of the day
+    event_gettime(&t0); // current time of the day
     timeradd(&t0, &timer, &t1); //add the timeout time with the current time of the day
+    pk->sent_time = t0;
+    STAT_ADD(r_socket, pk->owner, pkts_sent, 1);
+    STAT_ADD(r_socket, pk->owner, bytes_sent, len + sizeof (struct rudp_hdr));
 
     // register timeout
 
@@ -443,246 +2190,869 @@ int send_packet(socket_list_node * r_socket, packet_queue_node *pk, struct socka
     }
 
 
-    //printf("RUDP:Sending packet with seqno=%0x - ", packet->header.seqno);
-    /*
-    if (DROP != 0 && rand() % DROP == 1) {
-        printf("packet dropped!\n");
-        return 1;
-    }*/
-    printf("Sending packet! %0x\n", pk->packet.header.seqno);
-    if (sendto((int) r_socket->sockfd, buffer, len + sizeof (struct rudp_hdr), 0, (struct sockaddr *) &to, sizeof (struct sockaddr)) <= 0) {
+    RUDP_TRACE(RUDP_TR_SEND, &to, pk->packet.header.seqno, pk->packet.header.type);
+    pk->packet.header.conn = pk->owner->peer;
+    if (rudp_output(r_socket, &pk->packet, len + sizeof (struct rudp_hdr), &to) <= 0) {
         fprintf(stderr, "Failed to send packet in send_packet function\n");
         return -1;
     }
     return 1;
 }
 
+/*
+ * rtt_sample: update the smoothed RTT of a receiver (RFC 6298).
+ * Only called for packets that were not retransmitted (Karn's algorithm).
+ */
+void rtt_sample(receiver_list_node * receiver, struct timeval *sent) {
+    struct timeval now, d;
+    long r;
+    event_gettime(&now);
+    timersub(&now, sent, &d);
+    r = d.tv_sec * 1000000L + d.tv_usec;
+    if (receiver->srtt == 0) {
+        receiver->srtt = r > 0 ? r : 1;
+        receiver->rttvar = r / 2;
+    } else {
+        receiver->rttvar = (3 * receiver->rttvar + labs(receiver->srtt - r)) / 4;
+        receiver->srtt = (7 * receiver->srtt + r) / 8;
+        if (receiver->srtt == 0) {
+            receiver->srtt = 1;
+        }
+    }
+}
+
+/*
+ * rudp_getstats: Fill in socket-wide totals and, for up to maxpeers peers,
+ * per-peer counters. Returns the number of peers of the socket.
+ */
+int rudp_getstats(rudp_socket_t rsocket, struct rudp_stats *total, struct rudp_peer_stats *peers, int maxpeers) {
+    socket_list_node *socket = search_socket(rsocket);
+    receiver_list_node *receiver;
+    sender_list_node *sender;
+    int n = 0;
+    if (socket == NULL) {
+        return -1;
+    }
+    if (total != NULL) {
+        total->c = socket->stats;
+    }
+    for (receiver = socket->receivers; receiver != NULL; receiver = receiver->next, n++) {
+        if (peers == NULL || n >= maxpeers) {
+            continue;
+        }
+        memset(&peers[n], 0, sizeof (peers[n]));
+        peers[n].peer = receiver->to;
+        peers[n].outgoing = 1;
+        peers[n].c = receiver->stats;
+        peers[n].window = socket->window;
+        peers[n].inflight = receiver->inflight;
+        peers[n].queued = receiver->queued;
+        peers[n].weight = receiver->weight;
+        peers[n].rwnd = receiver->rwnd;
+        peers[n].srtt_us = receiver->srtt;
+        peers[n].rttvar_us = receiver->rttvar;
+        peers[n].rto_us = RUDP_TIMEOUT * 1000L;
+    }
+    for (sender = socket->senders; sender != NULL; sender = sender->next, n++) {
+        if (peers == NULL || n >= maxpeers) {
+            continue;
+        }
+        memset(&peers[n], 0, sizeof (peers[n]));
+        peers[n].peer = sender->from;
+        peers[n].outgoing = 0;
+        peers[n].c = sender->stats;
+        peers[n].rwnd = sender->adv;
+    }
+    if (total != NULL) {
+        total->npeers = n;
+    }
+    return n;
+}
+
+/*
+ * prealloc: reserve packet buffers, retransmission timers and connection
+ * records for the expected number of connections of a socket, each with
+ * a full window and its FIN
+ */
+int prealloc(socket_list_node * r_socket) {
+    unsigned long n = r_socket->peers;
+    if (n == 0) {
+        return 0;
+    }
+    if (pool_reserve(&r_socket->ctx->receiver_pool, n) < 0 ||
+            pool_reserve(&r_socket->ctx->sender_pool, n) < 0 ||
+            conn_grow(r_socket, 2 * n) < 0 ||
+            pool_reserve(&r_socket->ctx->packet_pool, n * (r_socket->window + 1)) < 0 ||
+            event_reserve(n * r_socket->window) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * rudp_poolstats: usage of the socket, packet, connection and event pools
+ * of the current context. Returns the number of pools, which may exceed max.
+ */
+int rudp_poolstats(struct rudp_pool_stats *st, int max) {
+    struct pool *pools[] = {&cur->socket_pool, &cur->packet_pool, &cur->sender_pool, &cur->receiver_pool,
+        &cur->rxbuf_pool};
+    struct pool *p;
+    int i, n = 0;
+    for (i = 0; ; i++, n++) {
+        p = i < 5 ? pools[i] : event_pool(i - 5);
+        if (p == NULL) {
+            break;
+        }
+        if (st == NULL || n >= max) {
+            continue;
+        }
+        st[n].name = p->name;
+        st[n].objsize = p->stats.objsize;
+        st[n].capacity = p->stats.capacity;
+        st[n].in_use = p->stats.in_use;
+        st[n].high_water = p->stats.high_water;
+        st[n].gets = p->stats.gets;
+        st[n].slabs = p->stats.slabs;
+        st[n].huge_slabs = p->stats.huge_slabs;
+    }
+    return n;
+}
+
+/*
+ * rudp_hugepages: back pool slabs allocated from now on with huge pages
+ */
+int rudp_hugepages(int on) {
+    return pool_hugepages(on);
+}
+
+/*
+ * fill_window: a receiver may have something to send: put it in the
+ * socket's round and send what the windows allow.
+ */
+int fill_window(socket_list_node * r_socket, receiver_list_node * receiver) {
+    if (!receiver->scheduled) {
+        receiver->scheduled = 1;
+        receiver->sched_next = NULL;
+        if (r_socket->sched_tail == NULL) {
+            r_socket->sched_head = receiver;
+        } else {
+            r_socket->sched_tail->sched_next = receiver;
+        }
+        r_socket->sched_tail = receiver;
+    }
+    if (schedule(r_socket) < 0) {
+        return -1;
+    }
+    persist(receiver);
+    return 0;
+}
+
+/*
+ * persist: keep a probe armed while the peer's receive window is closed
+ * and there is data for it but nothing in flight, which would bring the
+ * ACK that opens it again. The probe interval starts at RUDP_PERSIST and
+ * doubles up to RUDP_TIMEOUT.
+ */
+void persist(receiver_list_node * receiver) {
+    struct timeval t;
+    if (receiver->rwnd != 0 || receiver->inflight > 0 || receiver->queued == 0) {
+        if (receiver->persist_ms > 0) {
+            event_timeout_delete(probe_cb, receiver);
+            receiver->persist_ms = 0;
+        }
+        return;
+    }
+    if (receiver->persist_ms > 0) {
+        return;
+    }
+    receiver->persist_ms = RUDP_PERSIST;
+    event_gettime(&t);
+    t.tv_sec += RUDP_PERSIST / 1000;
+    t.tv_usec += (RUDP_PERSIST % 1000) * 1000;
+    if (t.tv_usec >= 1000000) {
+        t.tv_sec++;
+        t.tv_usec -= 1000000;
+    }
+    if (event_timeout(t, probe_cb, receiver, "rudp_probe") < 0) {
+        receiver->persist_ms = 0;
+    }
+}
+
+/*
+ * probe_cb: ask a peer with a closed receive window for its window. A peer
+ * that answers none of RUDP_MAXRETRANS probes is given up.
+ */
+int probe_cb(int fd, void *arg) {
+    receiver_list_node *receiver = (receiver_list_node *) arg;
+    socket_list_node *socket = receiver->sock;
+    struct sockaddr_in to = receiver->to;
+    struct rudp_hdr hdr;
+    struct timeval t;
+    int ms = receiver->persist_ms;
+    receiver->persist_ms = 0;
+    if (receiver->rwnd != 0 || receiver->inflight > 0 || receiver->queued == 0) {
+        return 0;
+    }
+    if (receiver->probes >= RUDP_MAXRETRANS) {
+        free_receiver(socket, receiver, RUDP_FREE_ABORT);
+        if (socket->socket_event_handler != NULL) {
+            socket->socket_event_handler(socket->handle, RUDP_EVENT_TIMEOUT, &to);
+        }
+        close_check(socket);
+        return 0;
+    }
+    receiver->probes++;
+    hdr.version = RUDP_VERSION;
+    hdr.type = RUDP_PROBE;
+    hdr.seqno = receiver->last_sent_packet->packet.header.seqno + 1;
+    hdr.conn = receiver->peer;
+    STAT_ADD(socket, receiver, pkts_sent, 1);
+    STAT_ADD(socket, receiver, bytes_sent, sizeof (struct rudp_hdr));
+    RUDP_TRACE(RUDP_TR_PROBE, &to, hdr.seqno, receiver->probes);
+    if (rudp_output(socket, &hdr, sizeof (struct rudp_hdr), &to) < 0) {
+        fprintf(stderr, "Failed to send window probe in probe_cb function\n");
+    }
+    ms = ms * 2 < RUDP_TIMEOUT ? ms * 2 : RUDP_TIMEOUT;
+    event_gettime(&t);
+    t.tv_sec += ms / 1000;
+    t.tv_usec += (ms % 1000) * 1000;
+    if (t.tv_usec >= 1000000) {
+        t.tv_sec++;
+        t.tv_usec -= 1000000;
+    }
+    if (event_timeout(t, probe_cb, receiver, "rudp_probe") == 0) {
+        receiver->persist_ms = ms;
+    }
+    return 0;
+}
+
+/*
+ * next_packet: the packet a receiver may send now, NULL if none.
+ * Before the SYN has been acknowledged, no more than RUDP_OPT_FASTOPEN
+ * packets follow it, and no more than the peer's receive window is ever
+ * in flight.
+ */
+static packet_queue_node *next_packet(socket_list_node * r_socket, receiver_list_node * receiver) {
+    packet_queue_node *pk;
+    if ((!receiver->SYN_ACK && receiver->inflight > r_socket->fastopen) || receiver->last_sent_packet == NULL ||
+            receiver->inflight >= r_socket->window ||
+            (receiver->rwnd >= 0 && receiver->inflight >= receiver->rwnd)) {
+        return NULL;
+    }
+    pk = receiver->last_sent_packet->next;
+    if (pk != NULL && pk == receiver->open && receiver->inflight > 0) {
+        return NULL; //more messages may join it while earlier data is in flight
+    }
+    return pk;
+}
+
+/*
+ * schedule: send queued packets of a socket's connections by deficit
+ * round robin. A connection in the round gets weight * RUDP_MAXPKTSIZE
+ * bytes more at the start of its turn, and sends while that covers its
+ * next packet, its window has room and the socket is below
+ * RUDP_OPT_TXLIMIT. It leaves the round, with its deficit cleared, when
+ * it has nothing it may send; ACKs and new data bring it back.
+ */
+int schedule(socket_list_node * r_socket) {
+    receiver_list_node *receiver;
+    packet_queue_node *pk;
+    while ((receiver = r_socket->sched_head) != NULL) {
+        if (r_socket->txlimit > 0 && r_socket->inflight >= r_socket->txlimit) {
+            return 0; //the turn goes on when packets are acknowledged
+        }
+        if (!receiver->turn) {
+            receiver->deficit += receiver->weight * RUDP_MAXPKTSIZE;
+            receiver->turn = 1;
+        }
+        while ((pk = next_packet(r_socket, receiver)) != NULL && pk->data_len <= receiver->deficit) {
+            if (r_socket->txlimit > 0 && r_socket->inflight >= r_socket->txlimit) {
+                return 0;
+            }
+            if (pk == receiver->open) {
+                close_open(receiver);
+            }
+            if (send_packet(r_socket, pk, receiver->to) < 0) {
+                return -1;
+            }
+            pk->state = SENT;
+            if (receiver->unacked == NULL) {
+                receiver->unacked = pk; //everything before was acknowledged
+            }
+            receiver->inflight++;
+            r_socket->inflight++;
+            receiver->queued--;
+            receiver->last_sent_packet = pk;
+            receiver->deficit -= pk->data_len;
+            if (r_socket->fec) {
+                fec_sent(r_socket, receiver, pk);
+            }
+        }
+        if (receiver->fec != NULL && receiver->queued == 0 && fec_flush(r_socket, receiver) < 0) {
+            return -1; //nothing more to send for now: cover the tail too
+        }
+        //end of its turn
+        r_socket->sched_head = receiver->sched_next;
+        if (r_socket->sched_head == NULL) {
+            r_socket->sched_tail = NULL;
+        }
+        receiver->sched_next = NULL;
+        receiver->turn = 0;
+        if (pk == NULL) {
+            receiver->scheduled = 0;
+            receiver->deficit = 0;
+        } else if (r_socket->sched_tail == NULL) {
+            r_socket->sched_head = r_socket->sched_tail = receiver;
+        } else {
+            r_socket->sched_tail->sched_next = receiver;
+            r_socket->sched_tail = receiver;
+        }
+    }
+    return 0;
+}
+
+static long ms_since(struct timeval *t) {
+    struct timeval now, d;
+    event_gettime(&now);
+    timersub(&now, t, &d);
+    return d.tv_sec * 1000L + d.tv_usec / 1000;
+}
+
+/*
+ * free_sender: forget an incoming connection
+ */
+void free_sender(socket_list_node * r_socket, sender_list_node * sender, int why) {
+    sender_list_node **sp;
+    for (sp = &r_socket->senders; *sp != NULL && *sp != sender; sp = &(*sp)->next)
+        ;
+    if (*sp == NULL) {
+        return;
+    }
+    *sp = sender->next;
+    RUDP_TRACE(RUDP_TR_FREE, &sender->to, sender->last_seq, why);
+    conn_ended(r_socket, sender);
+    conn_del(r_socket, sender->conn);
+    halfopen_done(r_socket, sender);
+    free(sender->msg);
+    free(sender->fec);
+    drop_held(r_socket, sender);
+    pool_put(&r_socket->ctx->sender_pool, sender);
+}
+
+/*
+ * conn_ended: remember an incoming connection that is over, so that a
+ * late duplicate of its SYN does not start it again. With fast open its
+ * data could follow and be delivered twice.
+ */
+void conn_ended(socket_list_node * r_socket, sender_list_node * sender) {
+    struct ended_conn *e = &r_socket->ended[r_socket->nended];
+    if (sender->SYN_seq == 0) {
+        return;
+    }
+    r_socket->nended = (r_socket->nended + 1) % RUDP_ENDED;
+    e->from = sender->from;
+    e->SYN_seq = sender->SYN_seq;
+    event_gettime(&e->when);
+}
+
+/*
+ * syn_ended: whether a SYN belongs to a connection from the same address
+ * that ended less than RUDP_ENDED_MS ago
+ */
+int syn_ended(socket_list_node * r_socket, struct sockaddr_in *from, u_int32_t seq) {
+    struct ended_conn *e;
+    for (e = r_socket->ended; e < r_socket->ended + RUDP_ENDED; e++) {
+        if (e->SYN_seq == seq && e->from.sin_port == from->sin_port &&
+                e->from.sin_addr.s_addr == from->sin_addr.s_addr &&
+                ms_since(&e->when) < RUDP_ENDED_MS) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * free_receiver: forget an outgoing connection, with its packet queue
+ * and retransmission timers
+ */
+void free_receiver(socket_list_node * r_socket, receiver_list_node * receiver, int why) {
+    receiver_list_node **rp;
+    packet_queue_node *pk, *next;
+    for (rp = &r_socket->receivers; *rp != NULL && *rp != receiver; rp = &(*rp)->next)
+        ;
+    if (*rp == NULL) {
+        return;
+    }
+    *rp = receiver->next;
+    RUDP_TRACE(RUDP_TR_FREE, &receiver->to, receiver->data_seq, why);
+    conn_del(r_socket, receiver->conn);
+    close_open(receiver);
+    free(receiver->fec);
+    if (receiver->persist_ms > 0) {
+        event_timeout_delete(probe_cb, receiver);
+    }
+    r_socket->inflight -= receiver->inflight;
+    if (receiver->scheduled) {
+        for (rp = &r_socket->sched_head; *rp != receiver; rp = &(*rp)->sched_next)
+            ;
+        *rp = receiver->sched_next;
+        if (r_socket->sched_tail == receiver) {
+            r_socket->sched_tail = NULL;
+            for (rp = &r_socket->sched_head; *rp != NULL; rp = &(*rp)->sched_next) {
+                r_socket->sched_tail = *rp;
+            }
+        }
+    }
+    for (pk = receiver->bufferd_packet; pk != NULL; pk = next) {
+        next = pk->next;
+        if (pk->state == SENT) {
+            event_timeout_delete(retransmit_packet, pk);
+        }
+        pool_put(&r_socket->ctx->packet_pool, pk);
+    }
+    pool_put(&r_socket->ctx->receiver_pool, receiver);
+}
+
+/*
+ * close_check: finish closing a socket once all outgoing connections
+ * are gone. Incoming connections are dropped with it.
+ */
+void close_check(socket_list_node * r_socket) {
+    struct timeval now;
+    if (!r_socket->closing || r_socket->closed || r_socket->receivers != NULL) {
+        return;
+    }
+    //data received before the close goes out before RUDP_EVENT_CLOSED
+    batch_flush(r_socket);
+    r_socket->closed = 1;
+    while (r_socket->senders != NULL) {
+        free_sender(r_socket, r_socket->senders, RUDP_FREE_CLOSE);
+    }
+    if (r_socket->sweep_armed) {
+        event_timeout_delete(rudp_sweep, r_socket);
+        r_socket->sweep_armed = 0;
+    }
+    if (r_socket->update_armed) {
+        event_timeout_delete(update_cb, r_socket);
+        r_socket->update_armed = 0;
+    }
+    RUDP_TRACE(RUDP_TR_ALL_FIN, NULL, 0, 0);
+    if (r_socket->socket_event_handler != NULL) {
+        r_socket->socket_event_handler(r_socket->handle, RUDP_EVENT_CLOSED, NULL);
+    }
+    if (event_dgram_delete(rudp_receive_packet, (void *) r_socket) != 0) {
+        fprintf(stderr, "close_check: socket event not found\n");
+    }
+    if (r_socket->ctx->impair != NULL) {
+        rudp_impair_forget(r_socket->ctx->impair, r_socket->sockfd);
+    }
+    r_socket->ctx->net->close(r_socket->sockfd);
+    //the handle stays valid until the current callbacks have returned
+    event_gettime(&now);
+    if (event_timeout(now, release_cb, r_socket, "rudp_release") < 0) {
+        release_socket(r_socket);
+    }
+}
+
+/*
+ * arm_sweep: make sure the expiry sweep runs while a socket has connections
+ */
+void arm_sweep(socket_list_node * r_socket) {
+    struct timeval t, d;
+    if (r_socket->sweep_armed || r_socket->closed ||
+            (r_socket->senders == NULL && r_socket->receivers == NULL)) {
+        return;
+    }
+    event_gettime(&t);
+    d.tv_sec = RUDP_SWEEP / 1000;
+    d.tv_usec = (RUDP_SWEEP % 1000) * 1000;
+    timeradd(&t, &d, &t);
+    if (event_timeout(t, rudp_sweep, r_socket, "rudp_sweep") == 0) {
+        r_socket->sweep_armed = 1;
+    }
+}
+
+/*
+ * rudp_sweep: free incoming connections whose TIME_WAIT is over, and
+ * connections that have been idle for longer than the idle timeout.
+ * An expired incoming connection is reported as RUDP_EVENT_TIMEOUT.
+ */
+int rudp_sweep(int fd, void *arg) {
+    socket_list_node *socket = (socket_list_node *) arg;
+    sender_list_node *sender, *snext;
+    receiver_list_node *receiver, *rnext;
+    struct sockaddr_in addr;
+    long idle;
+
+    socket->sweep_armed = 0;
+    for (sender = socket->senders; sender != NULL; sender = snext) {
+        snext = sender->next;
+        idle = ms_since(&sender->last_active);
+        if (sender->FIN_rcvd) {
+            if (idle >= RUDP_TIMEWAIT) {
+                free_sender(socket, sender, RUDP_FREE_DONE);
+            }
+        } else if (sender->halfopen) {
+            //the peer has given up retransmitting by now; the application never heard of it
+            if (idle >= RUDP_TIMEWAIT || (socket->idle_ms > 0 && idle >= socket->idle_ms)) {
+                free_sender(socket, sender, RUDP_FREE_IDLE);
+            }
+        } else if (socket->idle_ms > 0 && idle >= socket->idle_ms) {
+            addr = sender->from;
+            free_sender(socket, sender, RUDP_FREE_IDLE);
+            if (socket->socket_event_handler != NULL) {
+                socket->socket_event_handler(socket->handle, RUDP_EVENT_TIMEOUT, &addr);
+            }
+        }
+    }
+    for (receiver = socket->receivers; receiver != NULL; receiver = rnext) {
+        rnext = receiver->next;
+        //only connections with nothing left to deliver
+        if (socket->idle_ms > 0 && receiver->inflight == 0 && receiver->queued == 0 &&
+                ms_since(&receiver->last_active) >= socket->idle_ms) {
+            free_receiver(socket, receiver, RUDP_FREE_IDLE);
+        }
+    }
+    arm_sweep(socket);
+    close_check(socket);
+    return 0;
+}
+
 int retransmit_packet(int fd, void *arg) {
     event_timeout_delete(retransmit_packet, arg);
     packet_queue_node *pk = (packet_queue_node*) arg;
     struct sockaddr_in to = pk->to;
-    socket_list_node *temp_socket = sock_list;
-    receiver_list_node *temp_receiver;
-    packet_queue_node *temp_packet;
-    int found = 0;
-    while (temp_socket != NULL) {
-        temp_receiver = temp_socket->receivers;
-        while (temp_receiver != NULL) {
-            temp_packet = temp_receiver->bufferd_packet;
-            while (temp_packet != NULL) {
-                if (temp_packet ->packet.header.seqno == pk->packet.header.seqno && ntohs(temp_packet ->to.sin_port) == ntohs(pk->to.sin_port) && !strcmp(inet_ntoa(temp_packet ->to.sin_addr), inet_ntoa(pk->to.sin_addr))) {
-                    found = 1;
-                    break;
-                }
-                temp_packet = temp_packet ->next;
-            }
-            if (found) break;
-            temp_receiver = temp_receiver->next;
-        }
-        if (found) break;
-        temp_socket = temp_socket->next;
+    packet_queue_node *temp_packet = pk;
+    receiver_list_node *temp_receiver = pk->owner;
+    socket_list_node *temp_socket = temp_receiver->sock;
+    STAT_ADD(temp_socket, temp_receiver, timeouts, 1);
+    //the oldest packet not acknowledged was lost, the others time out behind it
+    if (temp_receiver->fec != NULL && temp_packet == temp_receiver->unacked && temp_packet->retries == 0) {
+        temp_receiver->fec->lost++;
     }
     if (temp_packet->retries < RUDP_MAXRETRANS) {
-        printf("retransmission!\n");
+        RUDP_TRACE(RUDP_TR_RETRANS, &to, temp_packet->packet.header.seqno, temp_packet->retries);
+        STAT_ADD(temp_socket, temp_receiver, pkts_retrans, 1);
         if (send_packet(temp_socket, temp_packet, temp_packet->to) < 0) {
             fprintf(stderr, "Failed to re send packet in retransmit_packet function\n");
             return -1;
         }
         temp_packet->retries++;
-    } else {//check
-        event_timeout_delete(retransmit_packet, arg);
-        temp_receiver->FIN_ACK = 1; //fake solution
-        receiver_list_node* treceiver = temp_socket->receivers;
-        int allFIN = 1;
-        while (treceiver != NULL) {
-            if (treceiver->FIN_ACK == 0)
-                allFIN = 0;
-            treceiver = treceiver->next;
+    } else {
+        //peer unresponsive: give up the connection
+        free_receiver(temp_socket, temp_receiver, RUDP_FREE_ABORT);
+        if (temp_socket->socket_event_handler != NULL) {
+            temp_socket->socket_event_handler(temp_socket->handle, RUDP_EVENT_TIMEOUT, &to);
         }
-        if (allFIN) {
-            temp_socket->socket_event_handler((rudp_socket_t) temp_socket, RUDP_EVENT_CLOSED, NULL);
-            event_fd_delete(rudp_receive_packet, (void *) temp_socket);
+        close_check(temp_socket);
+        //its packets in flight no longer count against RUDP_OPT_TXLIMIT
+        if (!temp_socket->closed && schedule(temp_socket) < 0) {
+            return -1;
         }
-
-        temp_socket->socket_event_handler((rudp_socket_t) temp_socket, RUDP_EVENT_TIMEOUT, &to);
-
     }
     return 1;
 }
 
-int rudp_receive_packet(int fd, void *arg) {
+/*
+ * rudp_receive_packet: event_dgram() callback of a socket
+ */
+int rudp_receive_packet(int fd, void *arg, char *buf, int bytes, struct sockaddr_in *from) {
+    struct rudp_impair_state *st;
+    if ((rudp_impair_on & RUDP_IMPAIR_BIT(RUDP_IMPAIR_RECV)) &&
+            (st = ctx_impair(((socket_list_node *) arg)->ctx)) != NULL) {
+        return rudp_impair_input(st, fd, arg, buf, bytes, from, rudp_process_packet);
+    }
+    return rudp_process_packet(fd, arg, buf, bytes, from);
+}
+
+int rudp_process_packet(int fd, void *arg, char *buf, int bytes, struct sockaddr_in *from) {
 
-    socket_list_node *socket = search_socket((socket_list_node *) arg);
-    if (socket == NULL) {
-        return -1;
+    socket_list_node *socket = (socket_list_node *) arg;
+    if (socket->closed) {
+        return 0;
     }
-    struct sockaddr_in addr; //for the receiver sider here it is the address of the sender
-    int addr_size = sizeof (addr);
-    int bytes = 0;
-    rudp_packet packet;
-    memset(&packet, 0x0, sizeof (rudp_packet));
-    bytes = recvfrom((int) fd, (void*) &packet, sizeof (packet), 0, (struct sockaddr*) &addr, (socklen_t*) & addr_size);
-    if (bytes <= 0) {
-        fprintf(stderr, "recvfrom failed in rudp_receive_packet function\n");
-        return -1;
+    struct sockaddr_in addr = *from; //for the receiver sider here it is the address of the sender
+    struct rudp_hdr hdr; //only the header is copied, the data stays in buf
+    if (bytes < (int) sizeof (struct rudp_hdr) || bytes > (int) sizeof (rudp_packet) + RUDP_FECHDR) {
+        fprintf(stderr, "Bad packet size in rudp_receive_packet function\n");
+        return 0;
     }
+    memcpy(&hdr, buf, sizeof (struct rudp_hdr));
+    if (bytes > (int) sizeof (rudp_packet) && hdr.type != RUDP_FEC) {
+        fprintf(stderr, "Bad packet size in rudp_receive_packet function\n");
+        return 0;
+    }
+    char *data = buf + sizeof (struct rudp_hdr);
     int data_length = bytes - sizeof (struct rudp_hdr);
-    if (packet.header.version != RUDP_VERSION) {
-        printf("Invalid RUDP version of received packet in rudp_receive_packet\n");
-        return -1;
+    if (hdr.version != RUDP_VERSION) {
+        RUDP_TRACE(RUDP_TR_DROP, &addr, hdr.seqno, hdr.type);
+        return 0; //a stray datagram must not stop the event loop
     }
     sender_list_node *sender;
     receiver_list_node *receiver;
     packet_queue_node *temp_packet;
-    receiver_list_node *temp_receiver;
-    int number_of_unacked;
-    double random_number;
-    static double x = 0;
-    switch (packet.header.type) {
+    u_int16_t win, count;
+    u_int32_t conn;
+    int rwnd;
+    switch (hdr.type) {
             //When the receiver application socket receives an SYN:
         case RUDP_SYN:
-            sender = search_sender(socket, addr);
-            if (sender != NULL) {
+            sender = find_sender(socket, &hdr, &addr);
+            if ((sender == NULL || sender->SYN_seq != hdr.seqno) && syn_ended(socket, &addr, hdr.seqno)) {
+                RUDP_TRACE(RUDP_TR_DROP, &addr, hdr.seqno, hdr.type);
+                break; //a duplicate of an old SYN, not a new connection
+            }
+            if (sender == NULL && syn_flood(socket)) {
+                socket->stats.pkts_rcvd++;
+                socket->stats.bytes_rcvd += bytes;
+                if (socket->syncookies) {
+                    cookie_ack(socket, &hdr, &addr, data, data_length);
+                } else {
+                    RUDP_TRACE(RUDP_TR_DROP, &addr, hdr.seqno, hdr.type);
+                    socket->stats.syn_dropped++;
+                }
                 break;
             }
-            sender = add_sender(socket, addr);
             if (sender == NULL) {
-                return -1;
+                sender = add_sender(socket, addr);
+                if (sender == NULL) {
+                    //out of memory: the peer sends the SYN again
+                    RUDP_TRACE(RUDP_TR_DROP, &addr, hdr.seqno, hdr.type);
+                    break;
+                }
+            }
+            if (sender->SYN_seq != hdr.seqno) {
+                if (!sender->halfopen) {
+                    sender->halfopen = 1;
+                    socket->halfopen++;
+                }
+                //new connection, possibly reusing the address of one in TIME_WAIT
+                conn_ended(socket, sender);
+                if (sender->SYN_seq != 0) {
+                    //late packets of the old connection must not match the new one
+                    conn_del(socket, sender->conn);
+                    sender->conn = conn_add(socket, sender, 1);
+                }
+                sender->to = addr;
+                sender->from = addr;
+                sender->SYN_seq = hdr.seqno;
+                sender->last_seq = hdr.seqno;
+                sender->FIN_rcvd = 0;
+                sender->msglen = 0;
+                sender->msgdrop = 0;
+                drop_held(socket, sender);
+                free(sender->fec);
+                sender->fec = NULL;
+            }
+            if (data_length >= RUDP_SYNCONN) {
+                memcpy(&conn, data, RUDP_SYNCONN);
+                sender->peer = ntohl(conn);
             }
-            sender->to = addr;
-            sender->last_seq = packet.header.seqno;
-            packet.header.type = RUDP_ACK;
-            packet.header.seqno = packet.header.seqno + 1;
-            if (sendto((int) socket->sockfd, (void *) &packet.header, sizeof (struct rudp_hdr), 0, (struct sockaddr*) &addr, sizeof (struct sockaddr_in)) < 0) {
+            if (data_length > RUDP_SYNCONN && (data[RUDP_SYNCONN] & RUDP_SYN_FEC) && sender->fec == NULL) {
+                fec_rx_new(sender);
+            }
+            event_gettime(&sender->last_active);
+            //a repeated SYN means that our ACK was lost: acknowledge again
+            STAT_ADD(socket, sender, pkts_rcvd, 1);
+            STAT_ADD(socket, sender, bytes_rcvd, bytes);
+            if (send_ack(socket, sender, RUDP_SYN) < 0) {
                 fprintf(stderr, "Failed to send SYN ACK in rudp_send_packet function\n");
                 return -1;
             }
             break;
             //When the receiver application socket receives an FIN:
         case RUDP_FIN:
-            sender = search_sender(socket, addr);
-            if (packet.header.seqno != sender->last_seq + 1) {
+            sender = find_sender(socket, &hdr, &addr);
+            if (sender == NULL && (hdr.conn & CONN_COOKIE)) {
+                sender = cookie_accept(socket, &hdr, &addr);
+            }
+            if (sender == NULL) {
                 break;
             }
-            sender->last_seq = packet.header.seqno;
-            packet.header.type = RUDP_ACK;
-            packet.header.seqno = packet.header.seqno + 1;
-            printf("Sending FIN ACK of seq %0x\n", packet.header.seqno);
-            if (sendto((int) socket->sockfd, (void *) &packet.header, sizeof (struct rudp_hdr), 0, (struct sockaddr*) &addr, sizeof (struct sockaddr_in)) < 0) {
+            halfopen_done(socket, sender);
+            STAT_ADD(socket, sender, pkts_rcvd, 1);
+            STAT_ADD(socket, sender, bytes_rcvd, bytes);
+            //ACK a repeated FIN again; an early FIN gets a duplicate ACK
+            if (hdr.seqno == sender->last_seq + 1) {
+                sender->last_seq = hdr.seqno;
+                //TIME_WAIT: stay around to acknowledge retransmitted FINs
+                sender->FIN_rcvd = 1;
+                event_gettime(&sender->last_active);
+            }
+            if (send_ack(socket, sender, RUDP_FIN) < 0) {
                 fprintf(stderr, "Failed to send SYN ACK in rudp_send_packet function\n");
                 return -1;
             }
             break;
+            //When the receiver application socket receives a zero-window probe:
+        case RUDP_PROBE:
+            sender = find_sender(socket, &hdr, &addr);
+            if (sender == NULL) {
+                break;
+            }
+            STAT_ADD(socket, sender, pkts_rcvd, 1);
+            STAT_ADD(socket, sender, bytes_rcvd, bytes);
+            event_gettime(&sender->last_active);
+            if (send_ack(socket, sender, RUDP_PROBE) < 0) {
+                fprintf(stderr, "Failed to send PROBE ACK in rudp_send_packet function\n");
+                return -1;
+            }
+            break;
             //When the receiver application socket receives a data packet:
         case RUDP_DATA:
+        case RUDP_DATA_MORE:
+        case RUDP_DATA_PACKED:
+        case RUDP_DATA_UNORDERED:
             //srand(time(NULL));
-            printf("The packet with seq of %0x\n", packet.header.seqno);
-            if (udp_lost == 1) {
-                srand(x);
-                random_number = rand() / (double) RAND_MAX;
-                x++;
-                printf("p=%f\n", random_number);
-                if (random_number < 0.2) {
-                    printf("The ACK %0x is discard!\n", packet.header.seqno);
-                    break;
-                }
+            RUDP_TRACE(RUDP_TR_RECV_DATA, &addr, hdr.seqno, data_length);
+            sender = find_sender(socket, &hdr, &addr);
+            if (sender == NULL && (hdr.conn & CONN_COOKIE)) {
+                sender = cookie_accept(socket, &hdr, &addr);
+            }
+            //after a FIN it is from a new connection whose SYN is still on its way
+            if (sender == NULL || (sender->FIN_rcvd && SEQ_GT(hdr.seqno, sender->last_seq))) {
+                break;
             }
-            sender = search_sender(socket, addr);
-            if (packet.header.seqno == (sender->last_seq + 1)) {
-                // It is the expected data packet
-                printf("sending datagram with seq of %0x\n", packet.header.seqno);
-                socket->socket_recvfrom_handler(socket, &addr, packet.data, data_length);
-                sender->last_seq = packet.header.seqno;
+            halfopen_done(socket, sender);
+            addr = sender->from; //the same peer for the application if it has moved
+            STAT_ADD(socket, sender, pkts_rcvd, 1);
+            STAT_ADD(socket, sender, bytes_rcvd, bytes);
+            event_gettime(&sender->last_active);
+            if (sender->fec != NULL) {
+                fec_store(sender, &hdr, data, data_length);
             }
-            packet.header.type = RUDP_ACK;
-            packet.header.seqno = sender->last_seq + 1; //update header
-            if (sendto((int) socket->sockfd, (void *) &packet.header, sizeof (struct rudp_hdr), 0, (struct sockaddr*) &addr, sizeof (struct sockaddr_in)) < 0) {
+            if (take_data(socket, sender, &addr, &hdr, data, data_length) < 0) {
+                break; //no buffer: not acknowledged, the peer retransmits
+            }
+            //the handler may have closed the socket, which frees the sender
+            if (socket->closed) {
+                return 0;
+            }
+            if (sender->fec != NULL && sender->fec->nparity > 0) {
+                fec_repair(socket, sender, &addr);
+                if (socket->closed) {
+                    return 0;
+                }
+            }
+            if (send_ack(socket, sender, RUDP_DATA) < 0) {
                 fprintf(stderr, "Failed to send DATA ACK in rudp_send_packet function\n");
                 return -1;
             }
 
+            break;
+            //When the receiver application socket receives parity:
+        case RUDP_FEC:
+            sender = find_sender(socket, &hdr, &addr);
+            if (sender == NULL || sender->FIN_rcvd || data_length < RUDP_FECHDR) {
+                break;
+            }
+            addr = sender->from;
+            STAT_ADD(socket, sender, pkts_rcvd, 1);
+            STAT_ADD(socket, sender, bytes_rcvd, bytes);
+            event_gettime(&sender->last_active);
+            memcpy(&count, data, sizeof (count));
+            if (ntohs(count) < 2 || ntohs(count) > RUDP_FEC_MAXK ||
+                    (sender->fec == NULL && fec_rx_new(sender) == NULL)) {
+                break;
+            }
+            fec_park(sender, &hdr, data, data_length);
+            if (fec_repair(socket, sender, &addr) == 0) {
+                break;
+            }
+            if (socket->closed) {
+                return 0;
+            }
+            if (send_ack(socket, sender, RUDP_FEC) < 0) {
+                fprintf(stderr, "Failed to send FEC ACK in rudp_send_packet function\n");
+                return -1;
+            }
             break;
             //When the sending application socket receives an ACK:
         case RUDP_ACK:
-            printf("receiving ack!\n");
-            receiver = search_receiver(socket, addr);
+            RUDP_TRACE(RUDP_TR_RECV_ACK, &addr, hdr.seqno, 0);
+            receiver = find_receiver(socket, &hdr, &addr);
             if (receiver == NULL) {
-                return -1;
-            }
-            temp_packet = search_packet(receiver, packet.header.seqno - 1);
-            if (temp_packet->state == ACKED) {
-                //break;
-                printf("old acks %0x\n", temp_packet->packet.header.seqno);
+                //a late or duplicated ACK of a connection that is over
+                RUDP_TRACE(RUDP_TR_DROP, &addr, hdr.seqno, hdr.type);
                 break;
             }
-            if (event_timeout_delete(retransmit_packet, temp_packet) == 0) {
-                printf("going to delete retransmit for %0x\n", temp_packet->packet.header.seqno);
-                //fprintf(stderr, "Failed to delete time out event In rudp_ack\n");
-                //return -1;
-            }
-            temp_packet->state = ACKED;
-
-
-            temp_packet = receiver->bufferd_packet;
-
-
-
-            /*   while (temp_packet->packet.header.seqno != (packet.header.seqno - 1)) {
-                   if (temp_packet->state != ACKED) {
-                        printf("going to delete retransmit multi\n");
-                       if (event_timeout_delete(retransmit_packet, temp_packet) == 0) {
-                           printf("going to delete retransmit for %0x\n",temp_packet->packet.header.seqno);
-                           //fprintf(stderr, "Error deleting SYNtimeout\n");
-                           //return -1;
-                       }
-
-                       temp_packet->state = ACKED;
-                   }
-                   temp_packet = temp_packet->next;
-               }*/
-            if (packet.header.seqno == (receiver->FIN_seq + 1)) {
-                printf("ACK for FIN received\n");
-                receiver->FIN_ACK = 1;
-                temp_receiver = socket->receivers;
-                int allFIN = 1;
-                while (temp_receiver != NULL) {
-                    if (temp_receiver->FIN_ACK == 0) {
-                        printf("==Not all Finished\n");
-                        allFIN = 0;
-                        break;
-                    }
-                    temp_receiver = temp_receiver->next;
+            STAT_ADD(socket, receiver, pkts_rcvd, 1);
+            STAT_ADD(socket, receiver, bytes_rcvd, bytes);
+            receiver->probes = 0;
+            //ACKs are cumulative: seqno is the next sequence number the peer expects
+            temp_packet = receiver->unacked;
+            rwnd = receiver->rwnd;
+            //the window it advertises counts from there; older ACKs are stale
+            if (data_length >= RUDP_ACKWIN && receiver->last_sent_packet != NULL &&
+                    SEQ_GEQ(hdr.seqno, temp_packet != NULL ? temp_packet->packet.header.seqno :
+                    receiver->last_sent_packet->packet.header.seqno + 1)) {
+                memcpy(&win, data, RUDP_ACKWIN);
+                receiver->rwnd = ntohs(win);
+            }
+            if (data_length >= RUDP_ACKWIN + RUDP_ACKCONN) {
+                memcpy(&conn, data + RUDP_ACKWIN, RUDP_ACKCONN);
+                receiver->peer = ntohl(conn);
+            }
+            //repairs count as losses for adaptive FEC; the counter only grows
+            if (data_length >= RUDP_ACKWIN + RUDP_ACKCONN + RUDP_ACKFEC && receiver->fec != NULL) {
+                memcpy(&count, data + RUDP_ACKWIN + RUDP_ACKCONN, RUDP_ACKFEC);
+                if ((u_int16_t) (ntohs(count) - receiver->fec->repaired) < 0x8000) {
+                    receiver->fec->lost += (u_int16_t) (ntohs(count) - receiver->fec->repaired);
+                    receiver->fec->repaired = ntohs(count);
                 }
-                if (allFIN == 1) {
-                    printf("ALL FIN ACKs received\n");
-                    socket->socket_event_handler((rudp_socket_t) socket, RUDP_EVENT_CLOSED, NULL);
-                    if (event_fd_delete(rudp_receive_packet, (void *) socket) != 0) {
-                        printf("Not Founde\n");
-                    }
+            }
+            if (temp_packet == NULL || temp_packet->state != SENT ||
+                    SEQ_LEQ(hdr.seqno, temp_packet->packet.header.seqno)) {
+                RUDP_TRACE(RUDP_TR_DUP_ACK, &addr, hdr.seqno, 0);
+                STAT_ADD(socket, receiver, dup_acks, 1);
+                //it may be a window update
+                if (receiver->SYN_ACK && rwnd >= 0 && receiver->rwnd > rwnd &&
+                        fill_window(socket, receiver) < 0) {
+                    return -1;
                 }
-
-            } else {
-                temp_packet = search_packet(receiver, packet.header.seqno - 1);
-                number_of_unacked = 0;
-                while (temp_packet->packet.header.seqno != receiver->last_sent_packet->packet.header.seqno) {
-                    number_of_unacked++;
-                    temp_packet = temp_packet->next;
+                break;
+            }
+            if (SEQ_GT(hdr.seqno, receiver->last_sent_packet->packet.header.seqno + 1)) {
+                break; //acknowledges something never sent
+            }
+            while (temp_packet != NULL && temp_packet->state == SENT &&
+                    SEQ_LT(temp_packet->packet.header.seqno, hdr.seqno)) {
+                if (event_timeout_delete(retransmit_packet, temp_packet) == 0) {
+                    RUDP_TRACE(RUDP_TR_TIMER_DEL, &addr, temp_packet->packet.header.seqno, 0);
                 }
-                temp_packet = receiver->last_sent_packet->next;
-                if (temp_packet == NULL) {
-                    break;
+                if (receiver->inflight > 0) {
+                    receiver->inflight--;
+                    socket->inflight--;
                 }
-                while (number_of_unacked <= RUDP_WINDOW && temp_packet != NULL) {
-                    send_packet(socket, temp_packet, addr);
-                    receiver->last_sent_packet = temp_packet;
-                    number_of_unacked++;
-                    temp_packet = temp_packet->next;
+                //sample only the packet that triggered the ACK, and not after a retransmission
+                if (temp_packet->packet.header.seqno + 1 == hdr.seqno && temp_packet->retries == 0) {
+                    rtt_sample(receiver, &temp_packet->sent_time);
                 }
+                STAT_ADD(socket, receiver, pkts_acked, 1);
+                temp_packet->state = ACKED;
+                temp_packet = temp_packet->next;
+            }
+            receiver->unacked = temp_packet;
+            receiver->SYN_ACK = 1;
+            event_gettime(&receiver->last_active);
+            //free acknowledged packets, but keep the last sent one for fill_window()
+            while (receiver->bufferd_packet->state == ACKED &&
+                    receiver->bufferd_packet != receiver->last_sent_packet) {
+                temp_packet = receiver->bufferd_packet;
+                receiver->bufferd_packet = temp_packet->next;
+                pool_put(&socket->ctx->packet_pool, temp_packet);
             }
 
-
-
-
+            if (receiver->FIN_seq != 0 && hdr.seqno == (receiver->FIN_seq + 1)) {
+                RUDP_TRACE(RUDP_TR_FIN_ACK, &addr, hdr.seqno, 0);
+                free_receiver(socket, receiver, RUDP_FREE_DONE);
+                close_check(socket);
+                if (!socket->closed && schedule(socket) < 0) {
+                    return -1;
+                }
+            } else if (fill_window(socket, receiver) < 0) {
+                return -1;
+            }
             break;
         default:
             break;
@@ -1,11 +1,22 @@
 #ifndef RUDP_PROTO_H
 #define	RUDP_PROTO_H
 
-#define RUDP_VERSION	1	/* Protocol version */
+#define RUDP_VERSION	2	/* Protocol version */
 #define RUDP_MAXPKTSIZE 1000	/* Number of data bytes that can sent in a packet, RUDP header not included */
 #define RUDP_MAXRETRANS 5	/* Max. number of retransmissions */
 #define RUDP_TIMEOUT	2000	/* Timeout for the first retransmission in milliseconds */
 #define RUDP_WINDOW	3	/* Max. number of unacknowledged packets that can be sent to the network*/
+#define RUDP_TIMEWAIT	(RUDP_TIMEOUT * (RUDP_MAXRETRANS + 1)) /* Milliseconds an incoming connection is kept after FIN, to acknowledge retransmitted FINs */
+#define RUDP_IDLE	60000	/* Default idle timeout of a connection in milliseconds */
+#define RUDP_SWEEP	1000	/* Interval of the connection expiry sweep in milliseconds */
+#define RUDP_RCVWINDOW	256	/* Default receive window in packets */
+#define RUDP_PERSIST	200	/* First zero-window probe in milliseconds, the interval doubles up to RUDP_TIMEOUT */
+#define RUDP_FEC_SPAN	64	/* Received DATA packets kept for repairs, at least 2 * RUDP_FEC_MAXK */
+#define RUDP_FEC_PENDING 4	/* Parity packets kept waiting for more of their block */
+#define RUDP_FEC_ADAPT	64	/* DATA packets sent between loss estimates of adaptive FEC */
+#define RUDP_ENDED	32	/* Ended incoming connections a socket remembers, to ignore duplicates of their SYNs */
+#define RUDP_ENDED_MS	60000	/* How long it remembers them in milliseconds */
+#define RUDP_COOKIE_MS	16000	/* Period of SYN cookies, each is good for one to two */
 
 /* Packet types */
 
@@ -13,6 +24,55 @@
 #define RUDP_ACK	2
 #define RUDP_SYN	4
 #define RUDP_FIN	5
+#define RUDP_DATA_MORE	6	/* Data segment, more of the same message follows */
+#define RUDP_DATA_PACKED 7	/* Several small messages, each preceded by its length */
+#define RUDP_PROBE	8	/* Zero-window probe, answered with an ACK */
+#define RUDP_DATA_UNORDERED 9	/* Data the receiver may deliver before earlier packets */
+#define RUDP_FEC	10	/* Parity of a block of data packets, see below */
+
+#define RUDP_FRAMEHDR	2	/* Length field of a message in RUDP_DATA_PACKED */
+
+/*
+ * An ACK may carry the receive window after the header: how many packets
+ * from the acknowledged sequence number on the receiver can take, 16 bits
+ * in network byte order. An ACK without it does not limit the sender.
+ */
+
+#define RUDP_ACKWIN	2
+
+/*
+ * Connection IDs. Each end numbers its connections, and a packet carries
+ * in its header the ID the destination gave the connection, or 0 while the
+ * sender does not know it yet; the destination then goes by the source
+ * address. A SYN tells the receiver the ID at the sender, RUDP_SYNCONN
+ * bytes in network byte order before its option byte, and every ACK tells
+ * the sender the ID at the receiver in as many bytes after the window. A
+ * receiver that gets a packet with a valid ID from a new address sends its
+ * ACKs there from then on. A receiver may also answer a SYN without keeping
+ * state: the ID in its ACK is then a cookie, which lets it set up the
+ * connection when the first packet after the SYN brings it back.
+ */
+
+#define RUDP_SYNCONN	4
+#define RUDP_ACKCONN	4
+
+/*
+ * Forward error correction. A RUDP_FEC packet follows a block of up to
+ * RUDP_FEC_MAXK data packets with consecutive sequence numbers, the first
+ * of which is its seqno. Its payload is RUDP_FECHDR bytes, the number of
+ * packets in the block, the XOR of their lengths and the XOR of their
+ * types, 16 bits each in network byte order, then the XOR of their data,
+ * each padded with zeros to the longest. A receiver missing one packet of
+ * the block rebuilds it. Parity is not acknowledged nor retransmitted.
+ * A SYN with RUDP_SYN_FEC in its option byte announces it. The ACKs of
+ * a receiver that keeps packets for repairs carry, after the connection
+ * ID, the number of packets it has rebuilt, 16 bits wrapping around.
+ */
+
+#define RUDP_FECHDR	6
+#define RUDP_FEC_MAXK	32	/* Max. number of data packets per parity packet */
+#define RUDP_SYN_FEC	1
+#define RUDP_ACKFEC	2
 
 /*
  * Sequence numbers are 32-bit integers operated on with modular arithmetic.
@@ -30,6 +90,7 @@ struct rudp_hdr {
 	u_int16_t version;
 	u_int16_t type;
 	u_int32_t seqno;
+	u_int32_t conn;		/* Connection ID at the destination, 0 if unknown */
 }__attribute__ ((packed));
 
 #endif /* RUDP_PROTO_H */
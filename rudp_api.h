@@ -3,22 +3,43 @@
 
 #define RUDP_MAXPKTSIZE 1000	/* Number of data bytes that can sent in a
 				 * packet, RUDP header not included */
+#define RUDP_BATCH 64		/* Max. number of buffers handed to a batch
+				 * handler at once */
 
 /*
  * Event types for callback notifications
  */
 
 typedef enum {
-	RUDP_EVENT_TIMEOUT, 
+	RUDP_EVENT_TIMEOUT, 		/* Peer unresponsive, or idle for too long */
 	RUDP_EVENT_CLOSED,
 } rudp_event_t; 
 
 /*
- * RUDP socket handle
+ * RUDP socket handle. It is opaque and checked on every call: a handle
+ * of a socket that has been closed is rejected.
  */
 
 typedef void *rudp_socket_t;
 
+/*
+ * RUDP contexts. A context is an independent engine with its own sockets,
+ * event loop and memory pools. Each thread works on its current context,
+ * the default one unless changed with rudp_ctx_use(); sockets are created
+ * in it, and eventloop() runs its event loop. To run one engine per
+ * thread, create a context, make it current in the thread and call
+ * eventloop() there. A socket must only be used from the thread running
+ * its context.
+ */
+
+typedef struct rudp_ctx *rudp_ctx_t;
+
+rudp_ctx_t rudp_ctx_new(void);
+int rudp_ctx_free(rudp_ctx_t ctx);	/* Drops its sockets without FIN */
+rudp_ctx_t rudp_ctx_use(rudp_ctx_t ctx);	/* NULL for the default context.
+					 * Returns the previous one */
+rudp_ctx_t rudp_ctx_current(void);
+
 /*
  * Prototypes
  */
@@ -33,12 +54,102 @@ rudp_socket_t rudp_socket(int port);
  */
 int rudp_close(rudp_socket_t rsocket);
 
+/*
+ * Socket options
+ */
+#define RUDP_OPT_WINDOW	1	/* Send window in packets, default RUDP_WINDOW */
+#define RUDP_OPT_IDLE	2	/* Idle timeout of connections in milliseconds,
+				 * default RUDP_IDLE, 0 for none */
+#define RUDP_OPT_PEERS	3	/* Expected number of connections: preallocates
+				 * their state and window-sized packet buffers */
+#define RUDP_OPT_MESSAGE 4	/* Message mode: largest message in bytes, 0
+				 * (default) for no more than RUDP_MAXPKTSIZE.
+				 * Larger messages are sent as several packets
+				 * and reassembled; set on both ends */
+#define RUDP_OPT_COALESCE 5	/* Coalescing delay in microseconds, 0 (default)
+				 * for none. Small messages queued while
+				 * earlier data is in flight are packed into
+				 * one packet, held at most this long */
+#define RUDP_OPT_TXLIMIT 6	/* Packets in flight over all connections of
+				 * the socket, 0 (default) for no limit but
+				 * the window of each */
+#define RUDP_OPT_RCVWINDOW 7	/* Receive window in packets, at most 32767,
+				 * default RUDP_RCVWINDOW. Packets held after
+				 * a gap and buffers lent to the batch
+				 * handler use it up; peers send no more than
+				 * what is left */
+#define RUDP_OPT_UNORDERED 8	/* Unordered delivery, 0 (default) or 1. On the
+				 * sending side, messages sent while it is set
+				 * may be delivered out of order; each must fit
+				 * in one packet and is not coalesced. On the
+				 * receiving side, unless in message mode,
+				 * such messages are delivered as soon as they
+				 * arrive, without waiting for earlier ones,
+				 * instead of in order. Either way, all are
+				 * delivered exactly once */
+#define RUDP_OPT_FEC	9	/* Forward error correction, 0 (default) for
+				 * none. 2 to 32: a parity packet after every
+				 * that many data packets, from which the
+				 * receiver rebuilds one lost packet without
+				 * waiting for a retransmission. 1 adapts it
+				 * to the loss measured, from none to one in
+				 * two. Only the sending side sets it */
+#define RUDP_OPT_FASTOPEN 10	/* Fast open: packets that may follow the SYN
+				 * of a new connection before it is
+				 * acknowledged, 0 (default) for none, at most
+				 * the send window. They save the handshake
+				 * round trip; the peer takes them as soon as
+				 * the SYN has arrived */
+#define RUDP_OPT_HALFOPEN 11	/* Incoming connections that may wait for
+				 * their first data after the SYN, 0 (default)
+				 * for no limit. Past it, SYNs from new peers
+				 * are dropped or, with RUDP_OPT_SYNCOOKIES,
+				 * answered without keeping state */
+#define RUDP_OPT_SYNCOOKIES 12	/* SYN cookies: 0 (default) never, 1 past the
+				 * RUDP_OPT_HALFOPEN limit, 2 always. The ACK
+				 * of a SYN then carries a cookie and the
+				 * connection is set up with the first packet
+				 * that returns it. Its first parity packets
+				 * and fast open data are lost to the
+				 * retransmission */
+#define RUDP_OPT_MAXRECV 13	/* Largest message the receive handler takes,
+				 * 0 (default) for any. RUDP_OPT_MESSAGE may
+				 * not be set above it, nor it below
+				 * RUDP_OPT_MESSAGE. rudp_thread_deliver()
+				 * sets it to RUDP_MAXPKTSIZE */
+
+int rudp_setsockopt(rudp_socket_t rsocket, int opt, int value);
+
+/*
+ * Scheduling weight of the connection to a peer, default 1. Connections
+ * with packets to send take turns; each turn a connection may send
+ * weight * RUDP_MAXPKTSIZE bytes (deficit round robin).
+ */
+int rudp_setweight(rudp_socket_t rsocket, struct sockaddr_in *to, int weight);
+
+/*
+ * Local port of a socket
+ */
+int rudp_port(rudp_socket_t rsocket);
+
 /* 
  * Send a datagram 
  */
 int rudp_sendto(rudp_socket_t rsocket, void* data, int len, 
 		struct sockaddr_in* to);
 
+/*
+ * Send the messages held for coalescing now, within the window
+ */
+int rudp_flush(rudp_socket_t rsocket);
+
+/*
+ * Send a datagram gathered from iovcnt buffers
+ */
+struct iovec;
+int rudp_sendv(rudp_socket_t rsocket, const struct iovec *iov, int iovcnt,
+	       struct sockaddr_in* to);
+
 /* 
  * Register callback function for packet receiption 
  * Note: data and len arguments to callback function 
@@ -48,6 +159,29 @@ int rudp_recvfrom_handler(rudp_socket_t rsocket,
 			  int (*handler)(rudp_socket_t, 
 					 struct sockaddr_in *, 
 					 char *, int));
+/*
+ * Batched delivery, in place of the receive callback. The batch handler
+ * gets a list of n buffers with the data received since its last call,
+ * at most RUDP_BATCH of them, when the event loop has no more input ready.
+ * The buffers belong to the application until it returns them with
+ * rudp_buf_free(), from the thread running the socket's context and
+ * before the context is freed. In message mode, messages are not
+ * reassembled: a message is a run of buffers from the same peer, all but
+ * the last with more set.
+ */
+struct rudp_buf {
+	struct rudp_buf *next;
+	struct sockaddr_in from;
+	int more;			/* Message continues in a later buffer */
+	int len;
+	char *data;
+};
+
+int rudp_recvbatch_handler(rudp_socket_t rsocket, 
+			   int (*handler)(rudp_socket_t, 
+					  struct rudp_buf *, int));
+void rudp_buf_free(struct rudp_buf *list);	/* Frees the buffers linked from list too */
+
 /*
  * Register callback handler for event notifications
  */
@@ -55,4 +189,174 @@ int rudp_event_handler(rudp_socket_t rsocket,
 		       int (*handler)(rudp_socket_t, 
 				      rudp_event_t, 
 				      struct sockaddr_in *));
+
+/*
+ * Datagram layer below RUDP. The default uses UDP sockets; a simulator or
+ * test harness can install its own in the current context before creating
+ * sockets. Received datagrams are handed to RUDP with event_dgram_input().
+ */
+
+struct rudp_netops {
+	int (*open)(int port, struct sockaddr_in *bound); /* Returns fd or -1 */
+	int (*close)(int fd);
+	int (*sendto)(int fd, void *buf, int len, struct sockaddr_in *to);
+	int (*random)(void *buf, int len); /* Secret bytes for the keys of
+					    * sockets, returns 0 or -1. If
+					    * NULL or failing, rand() */
+};
+
+void rudp_netops(struct rudp_netops *ops);
+
+/*
+ * Statistics
+ */
+
+struct rudp_counters {
+	unsigned long pkts_sent;	/* Packets sent, ACKs included */
+	unsigned long bytes_sent;	/* Bytes sent, RUDP headers included */
+	unsigned long pkts_rcvd;
+	unsigned long bytes_rcvd;
+	unsigned long pkts_retrans;	/* Retransmitted packets */
+	unsigned long pkts_acked;	/* Own packets acknowledged by peer */
+	unsigned long timeouts;		/* Retransmission timer expiries */
+	unsigned long dup_acks;		/* ACKs for already acknowledged packets */
+	unsigned long pkts_parity;	/* FEC parity packets sent */
+	unsigned long pkts_repaired;	/* Lost packets rebuilt from parity */
+	unsigned long syn_cookies;	/* SYNs answered with a cookie, socket only */
+	unsigned long syn_dropped;	/* SYNs dropped past RUDP_OPT_HALFOPEN */
+};
+
+struct rudp_peer_stats {
+	struct sockaddr_in peer;
+	int outgoing;			/* 1 if we send data to peer, 0 if peer sends to us */
+	struct rudp_counters c;
+	int window;			/* Current send window (packets) */
+	int inflight;			/* Sent, not yet acknowledged */
+	int queued;			/* Waiting for room in the window */
+	int weight;			/* Scheduling weight, outgoing only */
+	int rwnd;			/* Receive window advertised by the peer
+					 * (outgoing) or to it (incoming), -1
+					 * before the first */
+	long srtt_us;			/* Smoothed RTT, 0 before the first sample */
+	long rttvar_us;
+	long rto_us;			/* Retransmission timeout */
+};
+
+struct rudp_stats {
+	struct rudp_counters c;		/* Socket-wide totals */
+	int npeers;
+};
+
+/*
+ * Get socket totals and up to maxpeers per-peer records. 
+ * Returns the number of peers, which may exceed maxpeers.
+ */
+int rudp_getstats(rudp_socket_t rsocket, struct rudp_stats *total,
+		  struct rudp_peer_stats *peers, int maxpeers);
+
+/*
+ * Memory pools. Packet buffers, connection records and event records
+ * come from fixed-size pools that grow by slabs and keep freed objects
+ * for reuse. Slabs can be backed by huge pages, also by setting the
+ * environment variable RUDP_HUGEPAGES=1.
+ */
+
+struct rudp_pool_stats {
+	const char *name;		/* "packet", "sender", "receiver", "event", ... */
+	unsigned long objsize;		/* Bytes per object, cache line aligned */
+	unsigned long capacity;		/* Objects allocated from the system */
+	unsigned long in_use;
+	unsigned long high_water;	/* Largest in_use */
+	unsigned long gets;		/* Allocations served */
+	unsigned long slabs;
+	unsigned long huge_slabs;	/* Slabs on explicit huge pages */
+};
+
+/* Pools of the current context. Returns their number, which may exceed max */
+int rudp_poolstats(struct rudp_pool_stats *st, int max);
+int rudp_hugepages(int on);	/* Returns the previous setting */
+
+/*
+ * Binary event tracing: start tracing into the file path, which is written
+ * when tracing is stopped with path NULL, or at exit. Tracing can also be
+ * enabled by setting the environment variable RUDP_TRACE to a file name.
+ * Decode the file with rudp_tracedump.
+ */
+int rudp_trace(const char *path);
+
+/*
+ * Network impairment on the send or receive path of all sockets, for
+ * testing and measurements on a single machine. Random decisions come
+ * from a generator seeded with seed, so runs are reproducible.
+ * The configuration applies to all contexts and is set before threads
+ * are started; each context impairs its own sockets with generators,
+ * held datagrams and statistics of its own, and rudp_impair_getstats()
+ * returns those of the current context.
+ * It can also be configured with the environment variables RUDP_IMPAIR
+ * (send path) and RUDP_IMPAIR_RECV (receive path), holding a spec such as
+ *   loss=0.01,burst=0.005:0.3,reorder=0.02:20000,dup=0.01,
+ *   delay=10000,jitter=2000,rate=8000000,queue=50000,seed=7
+ * burst=enter:leave[:loss] selects Gilbert-Elliott bursts,
+ * reorder=prob:extra_us, times are microseconds, rate is bits/s.
+ */
+
+#define RUDP_IMPAIR_SEND	0
+#define RUDP_IMPAIR_RECV	1
+
+struct rudp_impair {
+	double loss;			/* Drop probability, good state */
+	double burst_enter;		/* Gilbert-Elliott P(good -> bad) per packet, 0 for none */
+	double burst_leave;		/* P(bad -> good) per packet */
+	double burst_loss;		/* Drop probability, bad state */
+	double reorder;			/* Probability of holding a packet back ... */
+	long reorder_us;		/* ... by this much extra delay */
+	double duplicate;		/* Probability of sending a packet twice */
+	long delay_us;			/* Fixed extra delay */
+	long jitter_us;			/* Extra delay, uniform in [0, jitter_us] */
+	long rate_bps;			/* Rate limit, 0 for none */
+	long queue_us;			/* Drop when rate limiter backlog exceeds this, 0 for no limit */
+	unsigned long seed;
+};
+
+struct rudp_impair_stats {
+	unsigned long packets;		/* Packets entering the shim */
+	unsigned long dropped;		/* Random loss, both states */
+	unsigned long burst_dropped;	/* Random loss in the bad state */
+	unsigned long queue_dropped;	/* Rate limiter backlog overflow */
+	unsigned long duplicated;
+	unsigned long reordered;
+	unsigned long delayed;		/* Held back for any reason */
+};
+
+int rudp_impair(int dir, struct rudp_impair *imp); /* NULL turns it off */
+int rudp_impair_parse(const char *spec, struct rudp_impair *imp);
+int rudp_impair_getstats(int dir, struct rudp_impair_stats *st);
+
+/*
+ * Threaded mode: the protocol runs on a dedicated I/O thread.
+ * Create sockets and register handlers (or rudp_thread_deliver()) first,
+ * then call rudp_thread_start(). After that, application threads use
+ * only the rudp_thread_* functions; the data path takes no locks.
+ */
+
+#define RUDP_DELIVER_DATA	1
+#define RUDP_DELIVER_EVENT	2
+
+struct rudp_delivery {
+	int type;			/* RUDP_DELIVER_DATA or _EVENT */
+	rudp_socket_t rsocket;
+	rudp_event_t event;		/* For RUDP_DELIVER_EVENT */
+	int has_remote;			/* Event carries a remote address */
+	struct sockaddr_in remote;
+	int len;
+	char data[RUDP_MAXPKTSIZE];
+};
+
+int rudp_thread_start(void);
+int rudp_thread_stop(void);
+int rudp_thread_deliver(rudp_socket_t rsocket);
+int rudp_thread_sendto(rudp_socket_t rsocket, void* data, int len, 
+		       struct sockaddr_in* to);
+int rudp_thread_close(rudp_socket_t rsocket);
+int rudp_thread_recv(struct rudp_delivery *d, int wait);
 #endif /* RUDP_API_H */
@@ -0,0 +1,340 @@
+/*
+ * rudp_bench: Loopback throughput and latency benchmark for RUDP.
+ * Runs sender/receiver pairs in one process over 127.0.0.1 for every
+ * combination of file size, message size, window and peer count, and
+ * prints one JSON object per run on stdout.
+ * Each run is executed in a child process so that runs do not share
+ * RUDP state.
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "rudp_api.h"
+#include "event.h"
+
+#define MAXLIST 16			/* Max number of values per parameter */
+#define MAXBENCHPEERS 256		/* Max number of sender peers */
+
+/*
+ * Message header written at the start of each message
+ */
+
+struct benchmsg {
+	u_int32_t peer;			/* Index of sending peer */
+	u_int32_t seq;			/* Message number */
+	struct timeval sent;		/* Time of rudp_sendto() */
+};
+
+/*
+ * Sending side of one peer
+ */
+
+struct benchpeer {
+	rudp_socket_t rsock;
+	long nmsgs;			/* Messages to send */
+	long sent;			/* Messages handed to rudp_sendto() */
+	long delivered;			/* Messages delivered at the receiver */
+	int closed;
+};
+
+/*
+ * Prototypes
+ */
+
+int usage();
+int bench_receiver(rudp_socket_t rsocket, struct sockaddr_in *remote, char *buf, int len);
+int bench_event(rudp_socket_t rsocket, rudp_event_t event, struct sockaddr_in *remote);
+
+/*
+ * Global variables
+ */
+
+long filesizes[MAXLIST] = {65536, 1048576, 4194304};
+int nfilesizes = 3;
+long msgsizes[MAXLIST] = {128, 1000};
+int nmsgsizes = 2;
+long windows[MAXLIST] = {3, 16, 64};
+int nwindows = 3;
+long npeerss[MAXLIST] = {1, 8};
+int nnpeerss = 2;
+int uring = 0;				/* Use io_uring event backend */
+int coalesce_us = 0;			/* RUDP_OPT_COALESCE of the senders */
+int fec = 0;				/* RUDP_OPT_FEC of the senders */
+char *impair = NULL;			/* Impairment spec for the send path */
+struct rudp_impair imp;
+
+struct benchpeer peers[MAXBENCHPEERS];
+int npeers;
+int msgsize;
+int depth;				/* Max undelivered messages per peer */
+int nclosed;
+unsigned long pkts, retrans;		/* Totals of the closed peer sockets */
+long *lat;				/* Latency samples, microseconds */
+long nlat;
+struct timeval start;			/* Start of the run */
+char msgbuf[RUDP_MAXPKTSIZE];
+struct sockaddr_in dest;
+
+/*
+ * usage: how to use program
+ */
+
+int usage() {
+	fprintf(stderr, "Usage: rudp_bench [-u] [-c coalesce_us] [-F fec] [-f sizes] [-m msgsizes] [-w windows] [-p peers] [-I impairment]\n"
+		"  each list is comma separated, e.g. -f 65536,1048576\n"
+		"  -c packs small messages, holding them at most coalesce_us\n"
+		"  -F sends a parity packet every fec packets, 1 adapts it to the loss\n"
+		"  -I applies a network impairment, e.g. -I loss=0.01,delay=5000\n");
+	exit(1);
+}
+
+/*
+ * parselist: parse a comma separated list of positive numbers
+ */
+
+static int parselist(char *s, long *list) {
+	int n = 0;
+	char *tok;
+
+	for (tok = strtok(s, ","); tok != NULL; tok = strtok(NULL, ",")) {
+		if (n == MAXLIST || (list[n] = atol(tok)) <= 0)
+			usage();
+		n++;
+	}
+	return n;
+}
+
+static int lcmp(const void *a, const void *b) {
+	long x = *(const long *) a, y = *(const long *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+static long percentile(int p) {
+	long i;
+
+	if (nlat == 0)
+		return 0;
+	i = (nlat * p) / 100;
+	return lat[i < nlat ? i : nlat - 1];
+}
+
+/*
+ * pump: keep up to depth undelivered messages outstanding for a peer
+ */
+
+static void pump(struct benchpeer *bp) {
+	struct benchmsg *m = (struct benchmsg *) msgbuf;
+
+	while (bp->sent < bp->nmsgs && bp->sent - bp->delivered < depth) {
+		m->peer = bp - peers;
+		m->seq = bp->sent;
+		gettimeofday(&m->sent, NULL);
+		if (rudp_sendto(bp->rsock, msgbuf, msgsize, &dest) < 0) {
+			fprintf(stderr, "rudp_bench: send failure\n");
+			exit(1);
+		}
+		bp->sent++;
+	}
+	if (bp->sent == bp->nmsgs && bp->delivered == bp->nmsgs && !bp->closed) {
+		bp->closed = 1;
+		rudp_close(bp->rsock);
+	}
+}
+
+int bench_receiver(rudp_socket_t rsocket, struct sockaddr_in *remote, char *buf, int len) {
+	struct benchmsg m;
+	struct timeval now, d;
+
+	if (len < sizeof(m))
+		return 0;
+	memcpy(&m, buf, sizeof(m));
+	if (m.peer >= npeers)
+		return 0;
+	gettimeofday(&now, NULL);
+	timersub(&now, &m.sent, &d);
+	lat[nlat++] = d.tv_sec * 1000000L + d.tv_usec;
+	peers[m.peer].delivered++;
+	pump(&peers[m.peer]);
+	return 0;
+}
+
+/*
+ * report: print the result of a run and end the child process
+ */
+
+static void report(void) {
+	struct timeval end, d;
+	struct rusage ru;
+	double secs, cpu, bytes;
+
+	gettimeofday(&end, NULL);
+	timersub(&end, &start, &d);
+	secs = d.tv_sec + d.tv_usec / 1e6;
+	getrusage(RUSAGE_SELF, &ru);
+	cpu = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+		ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+	bytes = (double) nlat * msgsize;
+	qsort(lat, nlat, sizeof(long), lcmp);
+	printf("{\"file_size\": %ld, \"msg_size\": %d, \"window\": %d, \"peers\": %d, "
+	       "\"coalesce_us\": %d, \"fec\": %d, \"backend\": \"%s\", \"impair\": \"%s\", \"messages\": %ld, \"bytes\": %.0f, \"secs\": %.6f, "
+	       "\"mbytes_per_sec\": %.3f, \"packets_per_sec\": %.1f, \"retransmits\": %lu, "
+	       "\"lat_p50_us\": %ld, \"lat_p90_us\": %ld, \"lat_p99_us\": %ld, \"lat_max_us\": %ld, "
+	       "\"cpu_ns_per_byte\": %.3f}\n",
+	       peers[0].nmsgs * msgsize, msgsize, depth / 2, npeers, coalesce_us, fec,
+	       uring ? "io_uring" : "select", impair ? impair : "", nlat, bytes, secs,
+	       bytes / secs / 1e6, pkts / secs, retrans,
+	       percentile(50), percentile(90), percentile(99),
+	       nlat ? lat[nlat - 1] : 0, bytes > 0 ? cpu * 1e9 / bytes : 0);
+	fflush(stdout);
+	exit(0);
+}
+
+int bench_event(rudp_socket_t rsocket, rudp_event_t event, struct sockaddr_in *remote) {
+	struct rudp_stats st;
+
+	switch (event) {
+	case RUDP_EVENT_TIMEOUT:
+		fprintf(stderr, "rudp_bench: time out\n");
+		exit(1);
+		break;
+	case RUDP_EVENT_CLOSED:
+		/* The handle is valid until the handler returns */
+		if (rudp_getstats(rsocket, &st, NULL, 0) >= 0) {
+			pkts += st.c.pkts_sent;
+			retrans += st.c.pkts_retrans;
+		}
+		if (++nclosed == npeers)
+			report();
+		break;
+	}
+	return 0;
+}
+
+/*
+ * runone: benchmark one configuration. Runs in a child process.
+ */
+
+static void runone(long filesize, int msize, int window, int np) {
+	rudp_socket_t rsock;
+	int p;
+
+	if (uring)
+		event_backend(EVENT_BACKEND_URING);
+	if (impair != NULL && rudp_impair(RUDP_IMPAIR_SEND, &imp) < 0) {
+		fprintf(stderr, "rudp_bench: bad impairment\n");
+		exit(1);
+	}
+	msgsize = msize < sizeof(struct benchmsg) ? sizeof(struct benchmsg) : msize;
+	if (msgsize > RUDP_MAXPKTSIZE)
+		msgsize = RUDP_MAXPKTSIZE;
+	npeers = np;
+	depth = 2 * window;
+	if ((rsock = rudp_socket(0)) == NULL) {
+		fprintf(stderr, "rudp_bench: rudp_socket() failed\n");
+		exit(1);
+	}
+	rudp_recvfrom_handler(rsock, bench_receiver);
+	rudp_event_handler(rsock, bench_event);
+	memset(&dest, 0, sizeof(dest));
+	dest.sin_family = AF_INET;
+	dest.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	dest.sin_port = htons(rudp_port(rsock));
+
+	if ((lat = malloc(sizeof(long) * np * (filesize / msgsize + 1))) == NULL) {
+		fprintf(stderr, "rudp_bench: malloc failed\n");
+		exit(1);
+	}
+	gettimeofday(&start, NULL);
+	for (p = 0; p < np; p++) {
+		if ((peers[p].rsock = rudp_socket(0)) == NULL) {
+			fprintf(stderr, "rudp_bench: rudp_socket() failed\n");
+			exit(1);
+		}
+		rudp_setsockopt(peers[p].rsock, RUDP_OPT_WINDOW, window);
+		if (coalesce_us > 0)
+			rudp_setsockopt(peers[p].rsock, RUDP_OPT_COALESCE, coalesce_us);
+		if (fec > 0 && rudp_setsockopt(peers[p].rsock, RUDP_OPT_FEC, fec) < 0) {
+			fprintf(stderr, "rudp_bench: bad FEC setting\n");
+			exit(1);
+		}
+		rudp_event_handler(peers[p].rsock, bench_event);
+		peers[p].nmsgs = (filesize + msgsize - 1) / msgsize;
+		pump(&peers[p]);
+	}
+	eventloop();
+	exit(1);
+}
+
+int main(int argc, char* argv[]) {
+	int c, f, m, w, p, status;
+	pid_t pid;
+
+	opterr = 0;
+	while ((c = getopt(argc, argv, "uc:F:f:m:w:p:I:")) != -1) {
+		switch (c) {
+		case 'u':
+			uring = 1;
+			break;
+		case 'c':
+			if ((coalesce_us = atoi(optarg)) < 0)
+				usage();
+			break;
+		case 'F':
+			if ((fec = atoi(optarg)) < 0)
+				usage();
+			break;
+		case 'f':
+			nfilesizes = parselist(optarg, filesizes);
+			break;
+		case 'm':
+			nmsgsizes = parselist(optarg, msgsizes);
+			break;
+		case 'w':
+			nwindows = parselist(optarg, windows);
+			break;
+		case 'I':
+			if (rudp_impair_parse(optarg, &imp) < 0)
+				usage();
+			impair = optarg;
+			break;
+		case 'p':
+			nnpeerss = parselist(optarg, npeerss);
+			for (p = 0; p < nnpeerss; p++)
+				if (npeerss[p] > MAXBENCHPEERS)
+					usage();
+			break;
+		default:
+			usage();
+		}
+	}
+	for (f = 0; f < nfilesizes; f++)
+		for (m = 0; m < nmsgsizes; m++)
+			for (w = 0; w < nwindows; w++)
+				for (p = 0; p < nnpeerss; p++) {
+					fflush(stdout);
+					if ((pid = fork()) < 0) {
+						perror("rudp_bench: fork");
+						exit(1);
+					}
+					if (pid == 0)
+						runone(filesizes[f], msgsizes[m],
+						       windows[w], npeerss[p]);
+					if (waitpid(pid, &status, 0) < 0 ||
+					    !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+						fprintf(stderr, "rudp_bench: run failed: "
+							"file %ld msg %ld window %ld peers %ld\n",
+							filesizes[f], msgsizes[m],
+							windows[w], npeerss[p]);
+				}
+	return 0;
+}
@@ -0,0 +1,484 @@
+/*
+ * rudp_impair.c: network impairment shim below RUDP.
+ *
+ * Each direction has its own configuration, random generator and queue
+ * of held datagrams. A datagram first goes through the loss model, is
+ * possibly duplicated, and every copy then gets a release time from the
+ * rate limiter, the fixed delay, jitter and reordering. Copies due now
+ * pass straight through; the others wait in a list sorted by release
+ * time, drained by a single event timer. Time comes from event_gettime(),
+ * so the shim also works under the simulator's virtual clock.
+ *
+ * The configuration is shared by all contexts; the rest, generators,
+ * held datagrams, timer and statistics, is kept per context. The shim
+ * then runs in the thread of the context's event loop without locks,
+ * and held datagrams are released by that loop. Configure it before
+ * starting threads.
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <pthread.h>
+
+#include "event.h"
+#include "rudp.h"
+#include "rudp_api.h"
+#include "rudp_impair.h"
+#include "rudp_trace.h"
+#include "pool.h"
+
+struct heldpkt {
+    struct heldpkt *next;
+    long long due; //release time, microseconds
+    int fd;
+    struct sockaddr_in addr; //destination (send) or source (receive)
+    int (*out)(int, void *, int, struct sockaddr_in *); //send path only
+    int len;
+    char data[EVENT_MAXDGRAM];
+};
+
+struct impair_dir {
+    int dir;
+    struct rudp_impair_state *st;
+    unsigned long gen; //of the configuration cfg is a copy of
+    struct rudp_impair cfg;
+    unsigned long long rng;
+    int bad; //Gilbert-Elliott state
+    long long busy_until; //rate limiter
+    struct heldpkt *held, *held_last;
+    int armed; //release timer registered
+    struct rudp_impair_stats stats;
+};
+
+struct rudp_impair_state {
+    struct impair_dir dirs[2];
+    int id; //of the context, for random streams of its own
+    int reinject; //a held datagram is being handed to RUDP
+    struct pool held_pool;
+};
+
+volatile int rudp_impair_on = 0;
+static struct rudp_impair cfgs[2]; //set by rudp_impair()
+static unsigned long cfg_gen[2]; //counts rudp_impair() calls
+static pthread_once_t env_once = PTHREAD_ONCE_INIT;
+
+static int impair_timer(int fd, void *arg);
+
+static long long now_us(void) {
+    struct timeval t;
+    event_gettime(&t);
+    return (long long) t.tv_sec * 1000000 + t.tv_usec;
+}
+
+/*
+ * xorshift64*, one generator per direction
+ */
+static double uniform(struct impair_dir *d) {
+    d->rng ^= d->rng >> 12;
+    d->rng ^= d->rng << 25;
+    d->rng ^= d->rng >> 27;
+    return ((d->rng * 2685821657736338717ULL) >> 11) / 9007199254740992.0;
+}
+
+static int chance(struct impair_dir *d, double p) {
+    return p > 0 && uniform(d) < p;
+}
+
+/*
+ * impair_dir: state of a direction in a context, started afresh when
+ * the configuration has changed
+ */
+static struct impair_dir *impair_dir(struct rudp_impair_state *st, int dir) {
+    struct impair_dir *d = &st->dirs[dir];
+    if (d->gen != cfg_gen[dir]) {
+        d->gen = cfg_gen[dir];
+        d->cfg = cfgs[dir];
+        //distinct streams for the directions and contexts, never the zero state
+        d->rng = (d->cfg.seed ^ (0x9e3779b97f4a7c15ULL * (dir + 1)) ^
+                (unsigned long long) st->id << 32) | 1;
+        d->bad = 0;
+        d->busy_until = 0;
+        memset(&d->stats, 0, sizeof (d->stats));
+    }
+    return d;
+}
+
+static void trace_drop(void *buf, int len, struct sockaddr_in *addr) {
+    struct rudp_hdr *h = (struct rudp_hdr *) buf;
+    if (len >= (int) sizeof (struct rudp_hdr)) {
+        RUDP_TRACE(RUDP_TR_DROP, addr, h->seqno, h->type);
+    }
+}
+
+/*
+ * lost: run the loss model for one datagram
+ */
+static int lost(struct impair_dir *d) {
+    struct rudp_impair *c = &d->cfg;
+    if (c->burst_enter > 0) {
+        if (d->bad) {
+            if (chance(d, c->burst_leave)) {
+                d->bad = 0;
+            }
+        } else if (chance(d, c->burst_enter)) {
+            d->bad = 1;
+        }
+        if (d->bad) {
+            if (chance(d, c->burst_loss)) {
+                d->stats.dropped++;
+                d->stats.burst_dropped++;
+                return 1;
+            }
+            return 0;
+        }
+    }
+    if (chance(d, c->loss)) {
+        d->stats.dropped++;
+        return 1;
+    }
+    return 0;
+}
+
+static void arm(struct impair_dir *d) {
+    struct timeval t;
+    if (d->armed || d->held == NULL) {
+        return;
+    }
+    t.tv_sec = d->held->due / 1000000;
+    t.tv_usec = d->held->due % 1000000;
+    if (event_timeout(t, impair_timer, d, "impair_timer") == 0) {
+        d->armed = 1;
+    }
+}
+
+static int hold(struct impair_dir *d, struct heldpkt *h) {
+    struct heldpkt **pp;
+    d->stats.delayed++;
+    h->next = NULL;
+    if (d->held_last != NULL && d->held_last->due <= h->due) {
+        d->held_last->next = h;
+        d->held_last = h;
+        arm(d);
+        return 0;
+    }
+    for (pp = &d->held; *pp != NULL && (*pp)->due <= h->due; pp = &(*pp)->next)
+        ;
+    h->next = *pp;
+    *pp = h;
+    if (h->next == NULL) {
+        d->held_last = h;
+    }
+    if (d->held == h && d->armed) {
+        //new earliest release: move the timer
+        event_timeout_delete(impair_timer, d);
+        d->armed = 0;
+    }
+    arm(d);
+    return 0;
+}
+
+static int release(struct impair_dir *d, struct heldpkt *h) {
+    int res;
+    if (d->dir == RUDP_IMPAIR_SEND) {
+        return h->out(h->fd, h->data, h->len, &h->addr);
+    }
+    //through the event layer, so that datagrams for closed sockets vanish
+    d->st->reinject = 1;
+    res = event_dgram_input(h->fd, h->data, h->len, &h->addr);
+    d->st->reinject = 0;
+    return res;
+}
+
+static int impair_timer(int fd, void *arg) {
+    struct impair_dir *d = (struct impair_dir *) arg;
+    struct heldpkt *h;
+    long long now = now_us();
+    int res = 0;
+
+    d->armed = 0;
+    while (d->held != NULL && d->held->due <= now) {
+        h = d->held;
+        d->held = h->next;
+        if (d->held == NULL) {
+            d->held_last = NULL;
+        }
+        if (release(d, h) < 0) {
+            res = -1;
+        }
+        pool_put(&d->st->held_pool, h);
+    }
+    arm(d);
+    return res;
+}
+
+/*
+ * impair: decide the fate of a datagram. Returns the number of copies
+ * to pass on now (0, 1 or 2); copies that must wait are queued.
+ */
+static int impair(struct impair_dir *d, int fd, void *buf, int len, struct sockaddr_in *addr,
+        int (*out)(int, void *, int, struct sockaddr_in *)) {
+    struct rudp_impair *c = &d->cfg;
+    struct heldpkt *h;
+    long long now, due, start;
+    int copies, i, now_copies = 0;
+
+    d->stats.packets++;
+    if (lost(d)) {
+        trace_drop(buf, len, addr);
+        return 0;
+    }
+    copies = 1;
+    if (chance(d, c->duplicate)) {
+        d->stats.duplicated++;
+        copies = 2;
+    }
+    now = now_us();
+    for (i = 0; i < copies; i++) {
+        due = now;
+        if (c->rate_bps > 0) {
+            start = d->busy_until > now ? d->busy_until : now;
+            if (c->queue_us > 0 && start - now > c->queue_us) {
+                d->stats.queue_dropped++;
+                trace_drop(buf, len, addr);
+                continue;
+            }
+            d->busy_until = start + (long long) len * 8 * 1000000 / c->rate_bps;
+            due = d->busy_until;
+        }
+        due += c->delay_us;
+        if (c->jitter_us > 0) {
+            due += (long long) (uniform(d) * (c->jitter_us + 1));
+        }
+        if (chance(d, c->reorder)) {
+            d->stats.reordered++;
+            due += c->reorder_us;
+        }
+        if (due <= now || len > EVENT_MAXDGRAM) {
+            now_copies++;
+            continue;
+        }
+        if ((h = pool_get(&d->st->held_pool)) == NULL) {
+            now_copies++;
+            continue;
+        }
+        h->due = due;
+        h->fd = fd;
+        h->addr = *addr;
+        h->out = out;
+        h->len = len;
+        memcpy(h->data, buf, len);
+        hold(d, h);
+    }
+    return now_copies;
+}
+
+/*
+ * rudp_impair_output: send path. Returns len unless the datagram layer fails.
+ */
+int rudp_impair_output(struct rudp_impair_state *st, int fd, void *buf, int len,
+        struct sockaddr_in *to, int (*out)(int, void *, int, struct sockaddr_in *)) {
+    int n = impair(impair_dir(st, RUDP_IMPAIR_SEND), fd, buf, len, to, out);
+    while (n-- > 0) {
+        if (out(fd, buf, len, to) < 0) {
+            return -1;
+        }
+    }
+    return len;
+}
+
+/*
+ * rudp_impair_input: receive path, called by the event_dgram() callback
+ * of a socket with the function that processes the datagram.
+ */
+int rudp_impair_input(struct rudp_impair_state *st, int fd, void *arg, char *buf, int len,
+        struct sockaddr_in *from, int (*in)(int, void *, char *, int, struct sockaddr_in *)) {
+    int n;
+    if (st->reinject) {
+        return in(fd, arg, buf, len, from);
+    }
+    n = impair(impair_dir(st, RUDP_IMPAIR_RECV), fd, buf, len, from, NULL);
+    while (n-- > 0) {
+        if (in(fd, arg, buf, len, from) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * rudp_impair_state_new: impairment state of context id, NULL if out of memory
+ */
+struct rudp_impair_state *rudp_impair_state_new(int id) {
+    struct rudp_impair_state *st;
+    int dir;
+    if ((st = calloc(1, sizeof (struct rudp_impair_state))) == NULL) {
+        return NULL;
+    }
+    for (dir = RUDP_IMPAIR_SEND; dir <= RUDP_IMPAIR_RECV; dir++) {
+        st->dirs[dir].dir = dir;
+        st->dirs[dir].st = st;
+        st->dirs[dir].gen = ~0UL; //seeded on first use
+    }
+    st->id = id;
+    st->held_pool = (struct pool) POOL_INIT("impair", sizeof (struct heldpkt));
+    return st;
+}
+
+/*
+ * rudp_impair_state_free: free the state of a context whose event base,
+ * with the release timers, is gone
+ */
+void rudp_impair_state_free(struct rudp_impair_state *st) {
+    if (st == NULL) {
+        return;
+    }
+    pool_destroy(&st->held_pool);
+    free(st);
+}
+
+/*
+ * rudp_impair_forget: drop the datagrams held back for a socket that is
+ * closed; its descriptor may soon belong to another one
+ */
+void rudp_impair_forget(struct rudp_impair_state *st, int fd) {
+    struct impair_dir *d;
+    struct heldpkt **pp, *h;
+    int dir;
+    for (dir = RUDP_IMPAIR_SEND; dir <= RUDP_IMPAIR_RECV; dir++) {
+        d = &st->dirs[dir];
+        d->held_last = NULL;
+        for (pp = &d->held; (h = *pp) != NULL; ) {
+            if (h->fd == fd) {
+                trace_drop(h->data, h->len, &h->addr);
+                *pp = h->next;
+                pool_put(&st->held_pool, h);
+            } else {
+                d->held_last = h;
+                pp = &h->next;
+            }
+        }
+    }
+}
+
+/*
+ * rudp_impair: configure one direction, for all contexts. Datagrams
+ * already held back are still released at their time.
+ */
+int rudp_impair(int dir, struct rudp_impair *imp) {
+    if (dir != RUDP_IMPAIR_SEND && dir != RUDP_IMPAIR_RECV) {
+        return -1;
+    }
+    if (imp == NULL) {
+        rudp_impair_on &= ~RUDP_IMPAIR_BIT(dir);
+        return 0;
+    }
+    if (imp->loss < 0 || imp->loss > 1 || imp->burst_enter < 0 || imp->burst_enter > 1 ||
+            imp->burst_leave < 0 || imp->burst_leave > 1 || imp->burst_loss < 0 || imp->burst_loss > 1 ||
+            imp->reorder < 0 || imp->reorder > 1 || imp->duplicate < 0 || imp->duplicate > 1 ||
+            imp->reorder_us < 0 || imp->delay_us < 0 || imp->jitter_us < 0 ||
+            imp->rate_bps < 0 || imp->queue_us < 0) {
+        return -1;
+    }
+    cfgs[dir] = *imp;
+    cfg_gen[dir]++;
+    rudp_impair_on |= RUDP_IMPAIR_BIT(dir);
+    return 0;
+}
+
+/*
+ * rudp_impair_parse: fill in imp from a spec such as "loss=0.01,delay=5000".
+ * Returns -1 on a syntax error.
+ */
+int rudp_impair_parse(const char *spec, struct rudp_impair *imp) {
+    char *s, *tok, *val, *save = NULL;
+    int res = 0;
+
+    memset(imp, 0, sizeof (*imp));
+    if ((s = strdup(spec)) == NULL) {
+        return -1;
+    }
+    for (tok = strtok_r(s, ",", &save); tok != NULL; tok = strtok_r(NULL, ",", &save)) {
+        if ((val = strchr(tok, '=')) == NULL) {
+            res = -1;
+            break;
+        }
+        *val++ = '\0';
+        if (strcmp(tok, "loss") == 0) {
+            imp->loss = atof(val);
+        } else if (strcmp(tok, "burst") == 0) {
+            imp->burst_loss = 1.0;
+            if (sscanf(val, "%lf:%lf:%lf", &imp->burst_enter, &imp->burst_leave, &imp->burst_loss) < 2) {
+                res = -1;
+            }
+        } else if (strcmp(tok, "reorder") == 0) {
+            if (sscanf(val, "%lf:%ld", &imp->reorder, &imp->reorder_us) != 2) {
+                res = -1;
+            }
+        } else if (strcmp(tok, "dup") == 0) {
+            imp->duplicate = atof(val);
+        } else if (strcmp(tok, "delay") == 0) {
+            imp->delay_us = atol(val);
+        } else if (strcmp(tok, "jitter") == 0) {
+            imp->jitter_us = atol(val);
+        } else if (strcmp(tok, "rate") == 0) {
+            imp->rate_bps = atol(val);
+        } else if (strcmp(tok, "queue") == 0) {
+            imp->queue_us = atol(val);
+        } else if (strcmp(tok, "seed") == 0) {
+            imp->seed = strtoul(val, NULL, 0);
+        } else {
+            res = -1;
+        }
+        if (res < 0) {
+            break;
+        }
+    }
+    free(s);
+    return res;
+}
+
+/*
+ * rudp_impair_getstats: statistics of the current context
+ */
+int rudp_impair_getstats(int dir, struct rudp_impair_stats *st) {
+    struct rudp_impair_state *s;
+    if (dir != RUDP_IMPAIR_SEND && dir != RUDP_IMPAIR_RECV) {
+        return -1;
+    }
+    if ((s = rudp_impair_current()) == NULL) {
+        memset(st, 0, sizeof (*st));
+        return 0;
+    }
+    *st = impair_dir(s, dir)->stats;
+    return 0;
+}
+
+static void impair_env_once(void) {
+    static const char *names[2] = {"RUDP_IMPAIR", "RUDP_IMPAIR_RECV"};
+    struct rudp_impair imp;
+    char *spec;
+    int dir;
+
+    for (dir = RUDP_IMPAIR_SEND; dir <= RUDP_IMPAIR_RECV; dir++) {
+        if ((spec = getenv(names[dir])) == NULL || *spec == '\0') {
+            continue;
+        }
+        if (rudp_impair_parse(spec, &imp) < 0 || rudp_impair(dir, &imp) < 0) {
+            fprintf(stderr, "rudp: bad %s spec \"%s\", ignored\n", names[dir], spec);
+        }
+    }
+}
+
+/*
+ * rudp_impair_env: configure from RUDP_IMPAIR and RUDP_IMPAIR_RECV.
+ * Checked once, when the first socket is created, in whichever thread;
+ * threads creating theirs meanwhile wait for it.
+ */
+void rudp_impair_env(void) {
+    pthread_once(&env_once, impair_env_once);
+}
@@ -0,0 +1,28 @@
+#ifndef RUDP_IMPAIR_H
+#define	RUDP_IMPAIR_H
+
+/*
+ * Internal interface of the network impairment shim, see rudp_impair.c.
+ * rudp.c passes every datagram through it while rudp_impair_on has the
+ * bit of the direction set, with the shim state of the socket's context.
+ */
+
+#define RUDP_IMPAIR_BIT(dir)	(1 << (dir))
+
+struct rudp_impair_state;
+
+extern volatile int rudp_impair_on;
+
+int rudp_impair_output(struct rudp_impair_state *st, int fd, void *buf, int len,
+		       struct sockaddr_in *to, int (*out)(int, void *, int, struct sockaddr_in *));
+int rudp_impair_input(struct rudp_impair_state *st, int fd, void *arg, char *buf, int len,
+		      struct sockaddr_in *from, int (*in)(int, void *, char *, int, struct sockaddr_in *));
+struct rudp_impair_state *rudp_impair_state_new(int id);
+void rudp_impair_state_free(struct rudp_impair_state *st);
+void rudp_impair_forget(struct rudp_impair_state *st, int fd);
+void rudp_impair_env(void);
+
+/* In rudp.c: state of the current context, NULL if it has none */
+struct rudp_impair_state *rudp_impair_current(void);
+
+#endif /* RUDP_IMPAIR_H */
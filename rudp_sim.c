@@ -0,0 +1,292 @@
+/*
+ * rudp_sim.c: in-memory link model and virtual clock for RUDP.
+ *
+ * Every datagram gets a delivery time from the egress link of the
+ * sending socket (serialization behind earlier datagrams, propagation
+ * delay and jitter) and waits in a binary heap ordered by that time.
+ * The run loop jumps the clock to the earlier of the next delivery and
+ * the next timer. Ties are broken by send order, so runs are deterministic.
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "event.h"
+#include "rudp_api.h"
+#include "rudp_sim.h"
+#include "pool.h"
+
+#define SIM_FDBASE	(1 << 20)	/* Virtual fd of a socket is SIM_FDBASE + port */
+#define SIM_EPOCH	1000000000LL	/* Virtual time at start, microseconds */
+#define SIM_FIRSTPORT	1024		/* First port handed out for port 0 */
+
+struct simpkt {
+    long long at; //delivery time
+    unsigned long order; //send order, tie breaker
+    struct sockaddr_in from;
+    int dport;
+    int len;
+    char data[EVENT_MAXDGRAM];
+};
+
+struct simport {
+    int open;
+    int haslink; //use link below instead of the default
+    struct rudp_sim_link link;
+    long long busy_until; //egress serialization
+};
+
+static long long now_us = SIM_EPOCH;
+static unsigned long long rng;
+static unsigned long order = 0;
+static struct rudp_sim_link deflink;
+static struct simport ports[65536];
+static int nextport = SIM_FIRSTPORT;
+static struct simpkt **heap = NULL;
+static int heaplen = 0, heapsize = 0;
+static struct rudp_sim_stats stats;
+static struct pool pkt_pool = POOL_INIT("sim", sizeof (struct simpkt));
+
+/*
+ * rudp_sim_random: xorshift64* generator, seeded by rudp_sim_init()
+ */
+unsigned long rudp_sim_random(void) {
+    rng ^= rng >> 12;
+    rng ^= rng << 25;
+    rng ^= rng >> 27;
+    return (unsigned long) ((rng * 2685821657736338717ULL) >> 32);
+}
+
+static double uniform(void) {
+    return rudp_sim_random() / 4294967296.0;
+}
+
+static int before(struct simpkt *a, struct simpkt *b) {
+    return a->at < b->at || (a->at == b->at && a->order < b->order);
+}
+
+static int heap_push(struct simpkt *p) {
+    int i;
+    struct simpkt *t;
+    if (heaplen == heapsize) {
+        heapsize = heapsize ? 2 * heapsize : 1024;
+        if ((heap = realloc(heap, heapsize * sizeof (*heap))) == NULL) {
+            fprintf(stderr, "rudp_sim: out of memory\n");
+            return -1;
+        }
+    }
+    i = heaplen++;
+    heap[i] = p;
+    while (i > 0 && before(heap[i], heap[(i - 1) / 2])) {
+        t = heap[i];
+        heap[i] = heap[(i - 1) / 2];
+        heap[(i - 1) / 2] = t;
+        i = (i - 1) / 2;
+    }
+    return 0;
+}
+
+static struct simpkt *heap_pop(void) {
+    struct simpkt *top = heap[0], *t;
+    int i = 0, c;
+    heap[0] = heap[--heaplen];
+    for (;;) {
+        c = 2 * i + 1;
+        if (c >= heaplen) {
+            break;
+        }
+        if (c + 1 < heaplen && before(heap[c + 1], heap[c])) {
+            c++;
+        }
+        if (!before(heap[c], heap[i])) {
+            break;
+        }
+        t = heap[i];
+        heap[i] = heap[c];
+        heap[c] = t;
+        i = c;
+    }
+    return top;
+}
+
+static void sim_clock(struct timeval *t) {
+    t->tv_sec = now_us / 1000000;
+    t->tv_usec = now_us % 1000000;
+}
+
+static int sim_open(int port, struct sockaddr_in *bound) {
+    int tries;
+    if (port == 0) {
+        for (tries = 0; tries < 65536 && ports[nextport].open; tries++) {
+            nextport = nextport == 65535 ? SIM_FIRSTPORT : nextport + 1;
+        }
+        port = nextport;
+    }
+    if (port <= 0 || port > 65535 || ports[port].open) {
+        fprintf(stderr, "rudp_sim: port %d not available\n", port);
+        return -1;
+    }
+    memset(&ports[port], 0, sizeof (ports[port]));
+    ports[port].open = 1;
+    memset(bound, 0, sizeof (*bound));
+    bound->sin_family = AF_INET;
+    bound->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    bound->sin_port = htons(port);
+    return SIM_FDBASE + port;
+}
+
+static int sim_close(int fd) {
+    ports[fd - SIM_FDBASE].open = 0;
+    return 0;
+}
+
+static int sim_sendto(int fd, void *buf, int len, struct sockaddr_in *to) {
+    struct simport *sp = &ports[fd - SIM_FDBASE];
+    struct rudp_sim_link *l = sp->haslink ? &sp->link : &deflink;
+    struct simpkt *p;
+    long long start;
+
+    if (len > EVENT_MAXDGRAM) {
+        return -1;
+    }
+    stats.sent++;
+    /* Serialization happens even if the datagram is lost further on */
+    start = sp->busy_until > now_us ? sp->busy_until : now_us;
+    if (l->bandwidth_bps > 0) {
+        sp->busy_until = start + (long long) len * 8 * 1000000 / l->bandwidth_bps;
+    } else {
+        sp->busy_until = start;
+    }
+    if (l->loss > 0 && uniform() < l->loss) {
+        stats.dropped++;
+        return len;
+    }
+    if ((p = pool_get(&pkt_pool)) == NULL) {
+        return -1;
+    }
+    p->at = sp->busy_until + l->latency_us;
+    if (l->jitter_us > 0) {
+        p->at += rudp_sim_random() % (l->jitter_us + 1);
+    }
+    p->order = order++;
+    memset(&p->from, 0, sizeof (p->from));
+    p->from.sin_family = AF_INET;
+    p->from.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    p->from.sin_port = htons(fd - SIM_FDBASE);
+    p->dport = ntohs(to->sin_port);
+    p->len = len;
+    memcpy(p->data, buf, len);
+    if (heap_push(p) < 0) {
+        pool_put(&pkt_pool, p);
+        return -1;
+    }
+    return len;
+}
+
+/*
+ * sim_random: socket keys from the generator, so that a seed repeats a run
+ */
+static int sim_random(void *buf, int len) {
+    unsigned char *b = buf;
+    int i;
+
+    for (i = 0; i < len; i++) {
+        b[i] = rudp_sim_random();
+    }
+    return 0;
+}
+
+static struct rudp_netops sim_netops = {sim_open, sim_close, sim_sendto, sim_random};
+
+/*
+ * rudp_sim_init: switch RUDP and the event layer to simulation.
+ * Must be called before any socket is created. link is the default
+ * link of every socket.
+ */
+void rudp_sim_init(unsigned long seed, struct rudp_sim_link *link) {
+    rng = seed ? seed : 0x9e3779b97f4a7c15ULL;
+    now_us = SIM_EPOCH;
+    memset(&deflink, 0, sizeof (deflink));
+    if (link != NULL) {
+        deflink = *link;
+    }
+    memset(&stats, 0, sizeof (stats));
+    rudp_netops(&sim_netops);
+    event_clock(sim_clock);
+}
+
+/*
+ * rudp_sim_setlink: give the socket bound to port its own egress link
+ */
+int rudp_sim_setlink(int port, struct rudp_sim_link *link) {
+    if (port <= 0 || port > 65535 || !ports[port].open) {
+        return -1;
+    }
+    ports[port].link = *link;
+    ports[port].haslink = 1;
+    return 0;
+}
+
+/*
+ * rudp_sim_run: run until no datagram is in flight and no timer is
+ * pending (returns 0), or until max_us of virtual time have passed
+ * (returns 1). max_us 0 means no limit. Returns -1 if a callback fails.
+ */
+int rudp_sim_run(long max_us) {
+    long long end = max_us > 0 ? now_us + max_us : -1;
+    long long next;
+    struct timeval tv;
+    struct simpkt *p;
+    int havetimer;
+
+    for (;;) {
+        havetimer = event_next_timeout(&tv) == 0;
+        if (heaplen == 0 && !havetimer) {
+            return 0;
+        }
+        next = heaplen > 0 ? heap[0]->at : -1;
+        if (havetimer) {
+            long long t = (long long) tv.tv_sec * 1000000 + tv.tv_usec;
+            if (next < 0 || t < next) {
+                next = t;
+            }
+        }
+        if (end >= 0 && next > end) {
+            now_us = end;
+            return 1;
+        }
+        if (next > now_us) {
+            now_us = next;
+        }
+        while (heaplen > 0 && heap[0]->at <= now_us) {
+            p = heap_pop();
+            if (ports[p->dport].open) {
+                stats.delivered++;
+                if (event_dgram_input(SIM_FDBASE + p->dport, p->data, p->len, &p->from) < 0) {
+                    pool_put(&pkt_pool, p);
+                    return -1;
+                }
+            } else {
+                stats.unreachable++;
+            }
+            pool_put(&pkt_pool, p);
+        }
+        if (event_run_timers() < 0) {
+            return -1;
+        }
+    }
+}
+
+void rudp_sim_gettime(struct timeval *t) {
+    sim_clock(t);
+}
+
+void rudp_sim_getstats(struct rudp_sim_stats *st) {
+    *st = stats;
+}
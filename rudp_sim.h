@@ -0,0 +1,35 @@
+#ifndef RUDP_SIM_H
+#define	RUDP_SIM_H
+
+/*
+ * Deterministic in-process network simulator for RUDP.
+ *
+ * rudp_sim_init() replaces the UDP layer below rudp.c with an in-memory
+ * link model and the clock of event.c with a virtual clock. All sockets
+ * live on 127.0.0.1. rudp_sim_run() then advances virtual time from event
+ * to event, so timeouts cost no real time. Given the same seed, a run is
+ * exactly reproducible.
+ */
+
+struct rudp_sim_link {
+	long latency_us;		/* One-way propagation delay */
+	long jitter_us;			/* Extra delay, uniform in [0, jitter_us] */
+	long bandwidth_bps;		/* Serialization rate per sender, 0 for unlimited */
+	double loss;			/* Drop probability */
+};
+
+struct rudp_sim_stats {
+	unsigned long sent;		/* Datagrams handed to the link */
+	unsigned long dropped;		/* Lost on the link */
+	unsigned long delivered;	/* Handed to a socket */
+	unsigned long unreachable;	/* Destination port not open */
+};
+
+void rudp_sim_init(unsigned long seed, struct rudp_sim_link *link);
+int rudp_sim_setlink(int port, struct rudp_sim_link *link);
+int rudp_sim_run(long max_us);
+void rudp_sim_gettime(struct timeval *t);
+void rudp_sim_getstats(struct rudp_sim_stats *st);
+unsigned long rudp_sim_random(void);
+
+#endif /* RUDP_SIM_H */
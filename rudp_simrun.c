@@ -0,0 +1,249 @@
+/*
+ * rudp_simrun: Run a RUDP scenario in the network simulator.
+ * Many senders each transfer a number of messages to one receiver, or to
+ * each of several, over simulated links. The receivers check that every
+ * message arrives once and in order. Prints one JSON object and exits non-zero if the check
+ * fails, so it serves both as a regression test and a scaling benchmark.
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "rudp_api.h"
+#include "rudp_sim.h"
+
+#define RECVPORT 9000			/* Port of the receiver */
+#define MAXPOOLS 16
+#define MAXMSGSIZE (16 * 1024 * 1024)	/* Beyond RUDP_MAXPKTSIZE in message mode */
+#define MAXRECV 8			/* Max. number of receivers */
+
+/*
+ * Per-sender state, indexed by sender port
+ */
+
+struct simpeer {
+	rudp_socket_t rsock;
+	long expect[MAXRECV];		/* Next message number expected, by receiver */
+	int closed;
+};
+
+/*
+ * Prototypes
+ */
+
+int usage();
+int sim_receiver(rudp_socket_t rsocket, struct sockaddr_in *remote, char *buf, int len);
+int sim_event(rudp_socket_t rsocket, rudp_event_t event, struct sockaddr_in *remote);
+
+/*
+ * Global variables
+ */
+
+struct simpeer *peers;			/* Indexed by port */
+int npeers = 100;
+int nrecv = 1;				/* Receivers each sender sends to */
+rudp_socket_t recvsocks[MAXRECV];
+long nmsgs = 100;
+int msgsize = 500;
+int coalesce_us = 0;			/* RUDP_OPT_COALESCE of the senders */
+long delivered = 0;
+long errors = 0;			/* Duplicate, missing or reordered messages */
+long timeouts = 0;
+int nclosed = 0;
+
+int usage() {
+	fprintf(stderr, "Usage: rudp_simrun [-n peers] [-r receivers] [-m messages] [-s msgsize] [-w window] [-c coalesce_us]\n"
+		"         [-l latency_us] [-j jitter_us] [-b bandwidth_bps] [-L loss] [-S seed] [-t max_secs]\n"
+		"         [-I impairment]   e.g. -I burst=0.01:0.3,dup=0.01,reorder=0.02:5000\n");
+	exit(1);
+}
+
+int sim_receiver(rudp_socket_t rsocket, struct sockaddr_in *remote, char *buf, int len) {
+	struct simpeer *sp = &peers[ntohs(remote->sin_port)];
+	u_int32_t n;
+	u_int32_t last;
+	int r;
+
+	for (r = 0; r < nrecv && recvsocks[r] != rsocket; r++)
+		;
+
+	if (len != msgsize) {
+		errors++;
+		return 0;
+	}
+	/* The number is at both ends, which checks reassembled messages */
+	memcpy(&n, buf, sizeof(n));
+	memcpy(&last, buf + len - sizeof(last), sizeof(last));
+	if (r == nrecv || n != sp->expect[r] || last != n)
+		errors++;
+	else
+		sp->expect[r] = n + 1;
+	delivered++;
+	return 0;
+}
+
+int sim_event(rudp_socket_t rsocket, rudp_event_t event, struct sockaddr_in *remote) {
+	switch (event) {
+	case RUDP_EVENT_TIMEOUT:
+		timeouts++;
+		break;
+	case RUDP_EVENT_CLOSED:
+		nclosed++;
+		break;
+	}
+	return 0;
+}
+
+int main(int argc, char* argv[]) {
+	struct rudp_sim_link link = {1000, 0, 0, 0.0};
+	struct rudp_sim_stats ss;
+	struct rudp_impair imp;
+	struct rudp_impair_stats is;
+	struct rudp_pool_stats pools[MAXPOOLS];
+	unsigned long inuse = 0, pktpeak = 0;
+	char *impair = NULL;
+	struct timeval w0, w1, v0, v1, d;
+	struct sockaddr_in dest;
+	rudp_socket_t rsock;
+	unsigned long seed = 1;
+	long maxsecs = 0;
+	int window = 0;
+	char *msg;
+	long i;
+	int c, p, r, port, res, ok, left, np;
+	double wall, virt;
+
+	opterr = 0;
+	while ((c = getopt(argc, argv, "n:r:m:s:w:c:l:j:b:L:S:t:I:")) != -1) {
+		switch (c) {
+		case 'n': npeers = atoi(optarg); break;
+		case 'r': nrecv = atoi(optarg); break;
+		case 'm': nmsgs = atol(optarg); break;
+		case 's': msgsize = atoi(optarg); break;
+		case 'w': window = atoi(optarg); break;
+		case 'c': coalesce_us = atoi(optarg); break;
+		case 'l': link.latency_us = atol(optarg); break;
+		case 'j': link.jitter_us = atol(optarg); break;
+		case 'b': link.bandwidth_bps = atol(optarg); break;
+		case 'L': link.loss = atof(optarg); break;
+		case 'S': seed = strtoul(optarg, NULL, 0); break;
+		case 't': maxsecs = atol(optarg); break;
+		case 'I':
+			if (rudp_impair_parse(optarg, &imp) < 0)
+				usage();
+			impair = optarg;
+			break;
+		default: usage();
+		}
+	}
+	if (npeers <= 0 || npeers > 60000 || nrecv <= 0 || nrecv > MAXRECV || nmsgs < 0 ||
+	    msgsize < sizeof(u_int32_t) || msgsize > MAXMSGSIZE)
+		usage();
+	if ((peers = calloc(65536, sizeof(struct simpeer))) == NULL ||
+	    (msg = calloc(1, msgsize)) == NULL) {
+		fprintf(stderr, "rudp_simrun: out of memory\n");
+		exit(1);
+	}
+
+	gettimeofday(&w0, NULL);
+	rudp_sim_init(seed, &link);
+	if (impair != NULL) {
+		if (imp.seed == 0)
+			imp.seed = seed;
+		if (rudp_impair(RUDP_IMPAIR_SEND, &imp) < 0)
+			usage();
+	}
+	rudp_sim_gettime(&v0);
+	for (r = 0; r < nrecv; r++) {
+		if ((recvsocks[r] = rudp_socket(RECVPORT + r)) == NULL) {
+			fprintf(stderr, "rudp_simrun: rudp_socket() failed\n");
+			exit(1);
+		}
+		rudp_recvfrom_handler(recvsocks[r], sim_receiver);
+		rudp_event_handler(recvsocks[r], sim_event);
+		if (msgsize > RUDP_MAXPKTSIZE)
+			rudp_setsockopt(recvsocks[r], RUDP_OPT_MESSAGE, msgsize);
+	}
+	memset(&dest, 0, sizeof(dest));
+	dest.sin_family = AF_INET;
+	dest.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	for (p = 0; p < npeers; p++) {
+		if ((rsock = rudp_socket(0)) == NULL) {
+			fprintf(stderr, "rudp_simrun: rudp_socket() failed\n");
+			exit(1);
+		}
+		port = rudp_port(rsock);
+		peers[port].rsock = rsock;
+		rudp_event_handler(rsock, sim_event);
+		if (window > 0)
+			rudp_setsockopt(rsock, RUDP_OPT_WINDOW, window);
+		if (msgsize > RUDP_MAXPKTSIZE)
+			rudp_setsockopt(rsock, RUDP_OPT_MESSAGE, msgsize);
+		if (coalesce_us > 0)
+			rudp_setsockopt(rsock, RUDP_OPT_COALESCE, coalesce_us);
+		for (i = 0; i < nmsgs; i++) {
+			u_int32_t n = i;
+			memcpy(msg, &n, sizeof(n));
+			memcpy(msg + msgsize - sizeof(n), &n, sizeof(n));
+			for (r = 0; r < nrecv; r++) {
+				dest.sin_port = htons(RECVPORT + r);
+				if (rudp_sendto(rsock, msg, msgsize, &dest) < 0) {
+					fprintf(stderr, "rudp_simrun: send failure\n");
+					exit(1);
+				}
+			}
+		}
+		rudp_close(rsock);
+	}
+
+	res = rudp_sim_run(maxsecs * 1000000L);
+	rudp_sim_gettime(&v1);
+	gettimeofday(&w1, NULL);
+	rudp_sim_getstats(&ss);
+	rudp_impair_getstats(RUDP_IMPAIR_SEND, &is);
+	/* Connection state must all be reclaimed by now */
+	left = 0;
+	for (r = 0; r < nrecv; r++)
+		left += rudp_getstats(recvsocks[r], NULL, NULL, 0);
+	/* and the packet buffers and connection records returned */
+	np = rudp_poolstats(pools, MAXPOOLS);
+	for (p = 0; p < np && p < MAXPOOLS; p++) {
+		if (strcmp(pools[p].name, "packet") == 0)
+			pktpeak = pools[p].high_water;
+		if (strcmp(pools[p].name, "packet") == 0 || strcmp(pools[p].name, "sender") == 0 ||
+		    strcmp(pools[p].name, "receiver") == 0)
+			inuse += pools[p].in_use;
+	}
+
+	for (port = 0; port < 65536; port++)
+		for (r = 0; r < nrecv; r++)
+			if (peers[port].rsock != NULL && peers[port].expect[r] != nmsgs)
+				errors++;
+	ok = res == 0 && errors == 0 && timeouts == 0 &&
+		delivered == (long) npeers * nrecv * nmsgs && nclosed == npeers && left == 0 && inuse == 0;
+	timersub(&w1, &w0, &d);
+	wall = d.tv_sec + d.tv_usec / 1e6;
+	timersub(&v1, &v0, &d);
+	virt = d.tv_sec + d.tv_usec / 1e6;
+	printf("{\"peers\": %d, \"receivers\": %d, \"messages\": %ld, \"msg_size\": %d, \"coalesce_us\": %d, \"seed\": %lu, "
+	       "\"latency_us\": %ld, \"jitter_us\": %ld, \"bandwidth_bps\": %ld, \"loss\": %g, "
+	       "\"delivered\": %ld, \"errors\": %ld, \"timeouts\": %ld, \"closed\": %d, \"peers_left\": %d, "
+	       "\"pool_in_use\": %lu, \"packet_pool_peak\": %lu, "
+	       "\"datagrams\": %lu, \"dropped\": %lu, \"impair\": \"%s\", \"impair_dropped\": %lu, "
+	       "\"duplicated\": %lu, \"reordered\": %lu, \"virtual_secs\": %.6f, "
+	       "\"wall_secs\": %.6f, \"speedup\": %.1f, \"ok\": %s}\n",
+	       npeers, nrecv, nmsgs, msgsize, coalesce_us, seed, link.latency_us, link.jitter_us,
+	       link.bandwidth_bps, link.loss, delivered, errors, timeouts, nclosed, left,
+	       inuse, pktpeak,
+	       ss.sent, ss.dropped, impair ? impair : "", is.dropped + is.queue_dropped,
+	       is.duplicated, is.reordered, virt, wall, wall > 0 ? virt / wall : 0,
+	       ok ? "true" : "false");
+	return ok ? 0 : 1;
+}
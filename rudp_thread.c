@@ -0,0 +1,352 @@
+/*
+ * rudp_thread.c: Threaded mode for the RUDP API.
+ *
+ * The protocol and the event loop run on a dedicated I/O thread.
+ * Application threads hand sends to it through a bounded lock-free
+ * multi-producer ring, and the I/O thread hands received datagrams and
+ * events back through a lock-free single-producer/single-consumer ring.
+ * The only system calls on the data path are eventfd wakeups, which are
+ * coalesced so that a burst of submissions costs a single write().
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/select.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+
+#include "event.h"
+#include "rudp.h"
+#include "rudp_api.h"
+
+#define RUDP_THREAD_SUBMITQ	1024	/* Submission ring entries, power of two */
+#define RUDP_THREAD_DELIVERQ	1024	/* Delivery ring entries, power of two */
+
+#define SUBMIT_SEND	1
+#define SUBMIT_CLOSE	2
+#define SUBMIT_STOP	3
+
+struct submit_entry {
+    atomic_uint seq; //ring slot sequence, see submit_push()
+    int type;
+    rudp_socket_t rsocket;
+    struct sockaddr_in to;
+    int len;
+    char data[RUDP_MAXPKTSIZE];
+};
+
+/*
+ * Multi-producer, single-consumer ring. Producers claim a slot by
+ * advancing tail with a CAS and publish it through the slot sequence.
+ */
+struct submit_ring {
+    _Alignas(64) atomic_uint tail;
+    _Alignas(64) unsigned int head; //only touched by the I/O thread
+    _Alignas(64) atomic_int wake_pending;
+    struct submit_entry slot[RUDP_THREAD_SUBMITQ];
+};
+
+/*
+ * Single-producer, single-consumer ring of deliveries.
+ */
+struct deliver_ring {
+    _Alignas(64) atomic_uint tail;
+    _Alignas(64) atomic_uint head;
+    _Alignas(64) atomic_int consumer_waiting;
+    struct rudp_delivery slot[RUDP_THREAD_DELIVERQ];
+};
+
+static struct submit_ring *submitq = NULL;
+static struct deliver_ring *deliverq = NULL;
+static int submit_efd = -1;
+static int deliver_efd = -1;
+static pthread_t io_thread;
+static atomic_int running = 0;
+
+static int submit_drain(int fd, void *arg);
+
+static void wake(int efd) {
+    u_int64_t one = 1;
+    if (write(efd, &one, sizeof (one)) < 0 && errno != EAGAIN) {
+        perror("rudp_thread: eventfd write");
+    }
+}
+
+static int submit_push(int type, rudp_socket_t rsocket, void *data, int len, struct sockaddr_in *to) {
+    struct submit_entry *e;
+    unsigned int pos, seq;
+    int diff;
+
+    pos = atomic_load_explicit(&submitq->tail, memory_order_relaxed);
+    for (;;) {
+        e = &submitq->slot[pos & (RUDP_THREAD_SUBMITQ - 1)];
+        seq = atomic_load_explicit(&e->seq, memory_order_acquire);
+        diff = (int) (seq - pos);
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&submitq->tail, &pos, pos + 1,
+                    memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            errno = EAGAIN; //ring full
+            return -1;
+        } else {
+            pos = atomic_load_explicit(&submitq->tail, memory_order_relaxed);
+        }
+    }
+    e->type = type;
+    e->rsocket = rsocket;
+    e->len = len;
+    if (to != NULL) {
+        e->to = *to;
+    }
+    if (len > 0) {
+        memcpy(e->data, data, len);
+    }
+    atomic_store_explicit(&e->seq, pos + 1, memory_order_release);
+
+    if (!atomic_exchange_explicit(&submitq->wake_pending, 1, memory_order_acq_rel)) {
+        wake(submit_efd);
+    }
+    return 0;
+}
+
+/*
+ * submit_drain: event_fd callback on the I/O thread. Run every submitted
+ * request through the ordinary single-threaded API.
+ */
+static int submit_drain(int fd, void *arg) {
+    struct submit_entry *e;
+    u_int64_t cnt;
+    unsigned int seq;
+
+    if (read(fd, &cnt, sizeof (cnt)) < 0 && errno != EAGAIN) {
+        perror("rudp_thread: eventfd read");
+    }
+    /* Clear before draining so that a concurrent push always wakes us again */
+    atomic_store_explicit(&submitq->wake_pending, 0, memory_order_release);
+    for (;;) {
+        e = &submitq->slot[submitq->head & (RUDP_THREAD_SUBMITQ - 1)];
+        seq = atomic_load_explicit(&e->seq, memory_order_acquire);
+        if ((int) (seq - (submitq->head + 1)) < 0) {
+            break; //empty
+        }
+        switch (e->type) {
+            case SUBMIT_SEND:
+                if (rudp_sendto(e->rsocket, e->data, e->len, &e->to) < 0) {
+                    fprintf(stderr, "rudp_thread: rudp_sendto failed\n");
+                }
+                break;
+            case SUBMIT_CLOSE:
+                rudp_close(e->rsocket);
+                break;
+            case SUBMIT_STOP:
+                event_fd_delete(submit_drain, NULL);
+                break;
+        }
+        atomic_store_explicit(&e->seq, submitq->head + RUDP_THREAD_SUBMITQ, memory_order_release);
+        submitq->head++;
+    }
+    return 0;
+}
+
+/*
+ * deliver_push: hand a delivery to the consumer. The ring gives the
+ * protocol back-pressure: when the consumer falls behind, the I/O
+ * thread yields until a slot is free rather than dropping data that
+ * will be acknowledged.
+ */
+static void deliver_push(struct rudp_delivery *d) {
+    unsigned int tail = atomic_load_explicit(&deliverq->tail, memory_order_relaxed);
+
+    while (tail - atomic_load_explicit(&deliverq->head, memory_order_acquire) >= RUDP_THREAD_DELIVERQ) {
+        sched_yield();
+    }
+    deliverq->slot[tail & (RUDP_THREAD_DELIVERQ - 1)] = *d;
+    atomic_store_explicit(&deliverq->tail, tail + 1, memory_order_seq_cst);
+    if (atomic_load_explicit(&deliverq->consumer_waiting, memory_order_seq_cst)) {
+        wake(deliver_efd);
+    }
+}
+
+static int deliver_data(rudp_socket_t rsocket, struct sockaddr_in *remote, char *buf, int len) {
+    struct rudp_delivery d;
+
+    if (len > RUDP_MAXPKTSIZE) {
+        fprintf(stderr, "rudp_thread: %d byte message does not fit a delivery, dropped\n", len);
+        return 0;
+    }
+    d.type = RUDP_DELIVER_DATA;
+    d.rsocket = rsocket;
+    d.remote = *remote;
+    d.len = len;
+    memcpy(d.data, buf, len);
+    deliver_push(&d);
+    return 0;
+}
+
+static int deliver_event(rudp_socket_t rsocket, rudp_event_t event, struct sockaddr_in *remote) {
+    struct rudp_delivery d;
+
+    memset(&d, 0, sizeof (d));
+    d.type = RUDP_DELIVER_EVENT;
+    d.rsocket = rsocket;
+    d.event = event;
+    if (remote != NULL) {
+        d.remote = *remote;
+        d.has_remote = 1;
+    }
+    deliver_push(&d);
+    return 0;
+}
+
+static void *io_main(void *arg) {
+    rudp_ctx_use((rudp_ctx_t) arg);
+    if (eventloop() < 0) {
+        fprintf(stderr, "rudp_thread: eventloop failed\n");
+    }
+    atomic_store(&running, 0);
+    wake(deliver_efd); //a waiting consumer sees the end without its timeout
+    return NULL;
+}
+
+/*
+ * rudp_thread_deliver: route data and events of a socket to the delivery
+ * ring instead of calling handlers on the I/O thread. A delivery holds
+ * RUDP_MAXPKTSIZE bytes, so the socket's RUDP_OPT_MESSAGE may not be
+ * larger: this fails if it is, and setting it larger later fails.
+ * Call before rudp_thread_start().
+ */
+int rudp_thread_deliver(rudp_socket_t rsocket) {
+    if (rudp_setsockopt(rsocket, RUDP_OPT_MAXRECV, RUDP_MAXPKTSIZE) < 0) {
+        return -1;
+    }
+    rudp_recvfrom_handler(rsocket, deliver_data);
+    rudp_event_handler(rsocket, deliver_event);
+    return 0;
+}
+
+/*
+ * rudp_thread_start: move the event loop of the current context to a
+ * dedicated I/O thread. Sockets must have been created before. From now on, the application may
+ * only use rudp_thread_sendto(), rudp_thread_close() and rudp_thread_recv().
+ */
+int rudp_thread_start(void) {
+    unsigned int i;
+
+    if (atomic_load(&running)) {
+        return -1;
+    }
+    if (submitq == NULL) {
+        if (posix_memalign((void **) &submitq, 64, sizeof (struct submit_ring)) != 0 ||
+                posix_memalign((void **) &deliverq, 64, sizeof (struct deliver_ring)) != 0) {
+            fprintf(stderr, "rudp_thread_start: out of memory\n");
+            return -1;
+        }
+        submit_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        deliver_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (submit_efd < 0 || deliver_efd < 0) {
+            perror("rudp_thread_start: eventfd");
+            return -1;
+        }
+    }
+    memset(submitq, 0, sizeof (struct submit_ring));
+    memset(deliverq, 0, sizeof (struct deliver_ring));
+    for (i = 0; i < RUDP_THREAD_SUBMITQ; i++) {
+        atomic_init(&submitq->slot[i].seq, i);
+    }
+    if (event_fd(submit_efd, submit_drain, NULL, "rudp_thread_submit") < 0) {
+        return -1;
+    }
+    atomic_store(&running, 1);
+    if (pthread_create(&io_thread, NULL, io_main, rudp_ctx_current()) != 0) {
+        fprintf(stderr, "rudp_thread_start: pthread_create failed\n");
+        atomic_store(&running, 0);
+        event_fd_delete(submit_drain, NULL);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * rudp_thread_stop: stop accepting submissions and wait until the I/O
+ * thread has finished, i.e. until all its sockets have been closed.
+ */
+int rudp_thread_stop(void) {
+    while (submit_push(SUBMIT_STOP, NULL, NULL, 0, NULL) < 0) {
+        sched_yield();
+    }
+    if (pthread_join(io_thread, NULL) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * rudp_thread_sendto: queue a datagram for rudp_sendto() on the I/O thread.
+ * Safe to call from any number of threads. Returns -1 with errno EAGAIN
+ * when the submission ring is full.
+ */
+int rudp_thread_sendto(rudp_socket_t rsocket, void *data, int len, struct sockaddr_in *to) {
+    if (len > RUDP_MAXPKTSIZE || len < 0) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    return submit_push(SUBMIT_SEND, rsocket, data, len, to);
+}
+
+/*
+ * rudp_thread_close: queue a rudp_close() on the I/O thread.
+ */
+int rudp_thread_close(rudp_socket_t rsocket) {
+    return submit_push(SUBMIT_CLOSE, rsocket, NULL, 0, NULL);
+}
+
+/*
+ * rudp_thread_recv: fetch the next delivery. Only one thread may consume.
+ * Returns 1 if a delivery was stored in d, 0 if none was available and
+ * wait is zero, -1 once the I/O thread has exited and the ring is empty.
+ */
+int rudp_thread_recv(struct rudp_delivery *d, int wait) {
+    unsigned int head = atomic_load_explicit(&deliverq->head, memory_order_relaxed);
+    u_int64_t cnt;
+
+    for (;;) {
+        if (atomic_load_explicit(&deliverq->tail, memory_order_acquire) != head) {
+            *d = deliverq->slot[head & (RUDP_THREAD_DELIVERQ - 1)];
+            atomic_store_explicit(&deliverq->head, head + 1, memory_order_release);
+            return 1;
+        }
+        if (!atomic_load(&running)) {
+            /* The last deliveries, CLOSED among them, are pushed before running is cleared */
+            if (atomic_load_explicit(&deliverq->tail, memory_order_acquire) != head) {
+                continue;
+            }
+            return -1;
+        }
+        if (!wait) {
+            return 0;
+        }
+        /* Announce that we sleep, then re-check before blocking */
+        atomic_store_explicit(&deliverq->consumer_waiting, 1, memory_order_seq_cst);
+        if (atomic_load_explicit(&deliverq->tail, memory_order_seq_cst) == head && atomic_load(&running)) {
+            struct timeval tv = {0, 100000};
+            fd_set fds;
+            FD_ZERO(&fds);
+            FD_SET(deliver_efd, &fds);
+            select(deliver_efd + 1, &fds, NULL, NULL, &tv);
+            if (read(deliver_efd, &cnt, sizeof (cnt)) < 0 && errno != EAGAIN) {
+                perror("rudp_thread_recv: eventfd read");
+            }
+        }
+        atomic_store_explicit(&deliverq->consumer_waiting, 0, memory_order_relaxed);
+    }
+}
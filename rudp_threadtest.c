@@ -0,0 +1,201 @@
+/*
+ * rudp_threadtest: Test of the threaded mode over loopback.
+ * Several producer threads send numbered messages over one socket with
+ * rudp_thread_sendto() while the main thread takes them from
+ * rudp_thread_recv(). A control thread closes the sockets and stops the
+ * I/O thread while the main thread is still reading, which it does until
+ * rudp_thread_recv() returns -1. Every message must arrive exactly once
+ * and in order per producer, and the CLOSED events of both sockets must
+ * be seen. Prints one JSON object and exits non-zero if the check fails.
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "rudp_api.h"
+
+#define MAXPROD 64			/* Max. number of producer threads */
+
+/*
+ * Message sent by a producer, padded to msgsize
+ */
+
+struct testmsg {
+	u_int32_t producer;
+	u_int32_t seq;
+};
+
+/*
+ * Prototypes
+ */
+
+int usage();
+void *producer_main(void *arg);
+void *control_main(void *arg);
+
+/*
+ * Global variables
+ */
+
+int nprod = 4;
+long nmsgs = 10000;			/* Messages per producer */
+int msgsize = 64;
+int nrounds = 10;
+rudp_socket_t sendsock, recvsock;
+struct sockaddr_in dest;
+pthread_t producers[MAXPROD];
+volatile int sendclosed;		/* Set by the main thread */
+
+int usage() {
+	fprintf(stderr, "Usage: rudp_threadtest [-p producers] [-m messages] [-s msgsize] [-R rounds]\n");
+	exit(1);
+}
+
+/*
+ * producer_main: send messages 0 to nmsgs-1 of a producer, waiting
+ * while the submission ring is full
+ */
+
+void *producer_main(void *arg) {
+	char msg[RUDP_MAXPKTSIZE];
+	struct testmsg *tm = (struct testmsg *) msg;
+	long i;
+
+	memset(msg, 0, msgsize);
+	tm->producer = (long) arg;
+	for (i = 0; i < nmsgs; i++) {
+		tm->seq = i;
+		while (rudp_thread_sendto(sendsock, msg, msgsize, &dest) < 0) {
+			if (errno != EAGAIN) {
+				perror("rudp_threadtest: rudp_thread_sendto");
+				exit(1);
+			}
+			sched_yield();
+		}
+	}
+	return NULL;
+}
+
+/*
+ * control_main: once all is sent, close the sending socket, then the
+ * receiving one when the sender has closed, and stop the I/O thread
+ */
+
+void *control_main(void *arg) {
+	int p;
+
+	for (p = 0; p < nprod; p++)
+		pthread_join(producers[p], NULL);
+	rudp_thread_close(sendsock);
+	while (!__atomic_load_n(&sendclosed, __ATOMIC_ACQUIRE))
+		usleep(100);
+	rudp_thread_close(recvsock);
+	rudp_thread_stop();
+	return NULL;
+}
+
+int main(int argc, char* argv[]) {
+	struct rudp_delivery d;
+	struct testmsg tm;
+	struct timeval t0, t1, diff;
+	pthread_t control;
+	long expect[MAXPROD];
+	long delivered = 0, errors = 0, timeouts = 0;
+	int closed = 0, sclosed, rclosed;
+	int c, p, round, ok;
+
+	while ((c = getopt(argc, argv, "p:m:s:R:")) != -1) {
+		switch (c) {
+		case 'p': nprod = atoi(optarg); break;
+		case 'm': nmsgs = atol(optarg); break;
+		case 's': msgsize = atoi(optarg); break;
+		case 'R': nrounds = atoi(optarg); break;
+		default: usage();
+		}
+	}
+	if (nprod < 1 || nprod > MAXPROD || nmsgs < 0 || nrounds < 1 ||
+	    msgsize < (int) sizeof(struct testmsg) || msgsize > RUDP_MAXPKTSIZE)
+		usage();
+
+	gettimeofday(&t0, NULL);
+	for (round = 0; round < nrounds; round++) {
+		if ((sendsock = rudp_socket(0)) == NULL || (recvsock = rudp_socket(0)) == NULL) {
+			fprintf(stderr, "rudp_threadtest: rudp_socket() failed\n");
+			exit(1);
+		}
+		rudp_thread_deliver(sendsock);
+		rudp_thread_deliver(recvsock);
+		memset(&dest, 0, sizeof(dest));
+		dest.sin_family = AF_INET;
+		dest.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		dest.sin_port = htons(rudp_port(recvsock));
+		if (rudp_thread_start() < 0) {
+			fprintf(stderr, "rudp_threadtest: rudp_thread_start() failed\n");
+			exit(1);
+		}
+		sendclosed = 0;
+		for (p = 0; p < nprod; p++) {
+			expect[p] = 0;
+			if (pthread_create(&producers[p], NULL, producer_main, (void *) (long) p) != 0) {
+				fprintf(stderr, "rudp_threadtest: pthread_create failed\n");
+				exit(1);
+			}
+		}
+		if (pthread_create(&control, NULL, control_main, NULL) != 0) {
+			fprintf(stderr, "rudp_threadtest: pthread_create failed\n");
+			exit(1);
+		}
+
+		/* Read until the I/O thread has exited and all is taken */
+		sclosed = rclosed = 0;
+		while (rudp_thread_recv(&d, 1) > 0) {
+			if (d.type == RUDP_DELIVER_EVENT) {
+				if (d.event == RUDP_EVENT_TIMEOUT) {
+					timeouts++;
+				}
+				else if (d.event == RUDP_EVENT_CLOSED && d.rsocket == recvsock) {
+					rclosed++;
+				}
+				else if (d.event == RUDP_EVENT_CLOSED && d.rsocket == sendsock) {
+					sclosed++;
+				}
+				if (d.rsocket == sendsock)
+					__atomic_store_n(&sendclosed, 1, __ATOMIC_RELEASE);
+				continue;
+			}
+			memcpy(&tm, d.data, sizeof(tm));
+			if (d.rsocket != recvsock || d.len != msgsize || tm.producer >= (u_int32_t) nprod ||
+			    tm.seq != expect[tm.producer])
+				errors++;
+			else
+				expect[tm.producer]++;
+			delivered++;
+		}
+		pthread_join(control, NULL);
+		for (p = 0; p < nprod; p++)
+			if (expect[p] != nmsgs)
+				errors++;
+		if (sclosed == 1 && rclosed == 1)
+			closed++;
+	}
+	gettimeofday(&t1, NULL);
+	timersub(&t1, &t0, &diff);
+
+	ok = errors == 0 && timeouts == 0 && closed == nrounds &&
+		delivered == (long) nrounds * nprod * nmsgs;
+	printf("{\"producers\": %d, \"messages\": %ld, \"msg_size\": %d, \"rounds\": %d, "
+	       "\"delivered\": %ld, \"errors\": %ld, \"timeouts\": %ld, \"closed_rounds\": %d, "
+	       "\"wall_secs\": %.6f, \"ok\": %s}\n",
+	       nprod, nmsgs, msgsize, nrounds, delivered, errors, timeouts, closed,
+	       diff.tv_sec + diff.tv_usec / 1e6, ok ? "true" : "false");
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,152 @@
+/*
+ * rudp_trace.c: per-thread lock-free ring buffers of binary trace events.
+ *
+ * Each thread owns its ring and is its only writer. Rings are linked on a
+ * global list with a CAS so that the dumper can find them; a ring is never
+ * freed. Dumping while other threads still trace may yield a few torn
+ * events at the wrap point.
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <sys/types.h>
+#include <sys/syscall.h>
+#include <netinet/in.h>
+#include <pthread.h>
+
+#include "rudp_api.h"
+#include "rudp_trace.h"
+
+struct trace_ring {
+    struct trace_ring *next;
+    u_int32_t tid;
+    atomic_ulong head; //total number of events written
+    struct rudp_trace_event ev[RUDP_TRACE_RING];
+};
+
+volatile int rudp_trace_on = 0;
+static char *trace_path = NULL;
+static _Atomic(struct trace_ring *) rings = NULL;
+static __thread struct trace_ring *my_ring = NULL;
+static pthread_once_t env_once = PTHREAD_ONCE_INIT;
+
+static struct trace_ring *ring_new(void) {
+    struct trace_ring *r = calloc(1, sizeof (struct trace_ring));
+    if (r == NULL) {
+        return NULL;
+    }
+    r->tid = (u_int32_t) syscall(SYS_gettid);
+    r->next = atomic_load(&rings);
+    while (!atomic_compare_exchange_weak(&rings, &r->next, r))
+        ;
+    return r;
+}
+
+void rudp_trace_record(int type, struct sockaddr_in *addr, u_int32_t seqno, u_int32_t arg) {
+    struct rudp_trace_event *e;
+    struct timespec ts;
+    unsigned long h;
+
+    if (my_ring == NULL && (my_ring = ring_new()) == NULL) {
+        return;
+    }
+    h = atomic_load_explicit(&my_ring->head, memory_order_relaxed);
+    e = &my_ring->ev[h & (RUDP_TRACE_RING - 1)];
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    e->ts_ns = (u_int64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    e->peer_addr = addr ? addr->sin_addr.s_addr : 0;
+    e->peer_port = addr ? addr->sin_port : 0;
+    e->type = type;
+    e->seqno = seqno;
+    e->arg = arg;
+    atomic_store_explicit(&my_ring->head, h + 1, memory_order_release);
+}
+
+static int trace_write(const char *path) {
+    struct rudp_trace_filehdr fh;
+    struct rudp_trace_section sec;
+    struct trace_ring *r;
+    unsigned long head, first, i;
+    FILE *f;
+
+    if ((f = fopen(path, "w")) == NULL) {
+        perror("rudp_trace: fopen");
+        return -1;
+    }
+    memset(&fh, 0, sizeof (fh));
+    memcpy(fh.magic, RUDP_TRACE_MAGIC, sizeof (fh.magic));
+    fh.evsize = sizeof (struct rudp_trace_event);
+    for (r = atomic_load(&rings); r != NULL; r = r->next) {
+        fh.nsections++;
+    }
+    fwrite(&fh, sizeof (fh), 1, f);
+    for (r = atomic_load(&rings); r != NULL; r = r->next) {
+        head = atomic_load_explicit(&r->head, memory_order_acquire);
+        first = head > RUDP_TRACE_RING ? head - RUDP_TRACE_RING : 0;
+        sec.tid = r->tid;
+        sec.nevents = head - first;
+        sec.overwritten = first;
+        fwrite(&sec, sizeof (sec), 1, f);
+        for (i = first; i < head; i++) {
+            fwrite(&r->ev[i & (RUDP_TRACE_RING - 1)], sizeof (struct rudp_trace_event), 1, f);
+        }
+    }
+    if (fclose(f) != 0) {
+        perror("rudp_trace: fclose");
+        return -1;
+    }
+    return 0;
+}
+
+static void trace_atexit(void) {
+    if (rudp_trace_on && trace_path != NULL) {
+        rudp_trace_on = 0;
+        trace_write(trace_path);
+    }
+}
+
+/*
+ * rudp_trace: start tracing into the file path, written when tracing is
+ * stopped or at exit. With path NULL, stop tracing and write the file.
+ */
+int rudp_trace(const char *path) {
+    static int registered = 0;
+
+    if (path == NULL) {
+        if (!rudp_trace_on || trace_path == NULL) {
+            return -1;
+        }
+        rudp_trace_on = 0;
+        return trace_write(trace_path);
+    }
+    free(trace_path);
+    if ((trace_path = strdup(path)) == NULL) {
+        return -1;
+    }
+    if (!registered) {
+        atexit(trace_atexit);
+        registered = 1;
+    }
+    rudp_trace_on = 1;
+    return 0;
+}
+
+static void trace_env_once(void) {
+    char *path;
+
+    if ((path = getenv("RUDP_TRACE")) != NULL && *path != '\0') {
+        rudp_trace(path);
+    }
+}
+
+/*
+ * rudp_trace_env: enable tracing if RUDP_TRACE names a trace file.
+ * Checked once, when the first socket is created, in whichever thread.
+ */
+void rudp_trace_env(void) {
+    pthread_once(&env_once, trace_env_once);
+}
@@ -0,0 +1,79 @@
+#ifndef RUDP_TRACE_H
+#define	RUDP_TRACE_H
+
+/*
+ * Binary event tracing for the RUDP protocol.
+ *
+ * Events are fixed-size records appended to a per-thread ring buffer
+ * without locks or formatting. The rings are written to a file by
+ * rudp_trace(NULL) or at exit, and decoded offline with rudp_tracedump.
+ * Build with -DRUDP_NOTRACE to compile tracing out completely.
+ */
+
+#define RUDP_TRACE_MAGIC	"RUDPTRC1"
+#define RUDP_TRACE_RING	65536	/* Events per thread, power of two */
+
+/* Event types */
+
+#define RUDP_TR_SOCKET		1	/* Socket created, arg: port */
+#define RUDP_TR_SEND		2	/* Packet sent, arg: packet type */
+#define RUDP_TR_RETRANS		3	/* Retransmission, arg: retries so far */
+#define RUDP_TR_RECV_DATA	4	/* DATA received, arg: payload length */
+#define RUDP_TR_DELIVER		5	/* DATA delivered to application, arg: length */
+#define RUDP_TR_SEND_ACK	6	/* ACK sent, arg: type of acknowledged packet */
+#define RUDP_TR_RECV_ACK	7	/* ACK received */
+#define RUDP_TR_DUP_ACK		8	/* ACK for an acknowledged packet */
+#define RUDP_TR_TIMER_DEL	9	/* Retransmission timer cancelled */
+#define RUDP_TR_FIN_ACK		10	/* ACK for our FIN received */
+#define RUDP_TR_ALL_FIN		11	/* FIN acknowledged by all receivers */
+#define RUDP_TR_DROP		12	/* Packet dropped on purpose */
+#define RUDP_TR_FREE		13	/* Connection state freed, arg: RUDP_FREE_* */
+#define RUDP_TR_HOLD		14	/* DATA after a gap kept for later, arg: packets held */
+#define RUDP_TR_PROBE		15	/* Zero-window probe sent, arg: probes unanswered */
+#define RUDP_TR_EARLY		16	/* Unordered DATA after a gap delivered, arg: length */
+#define RUDP_TR_REPAIR		17	/* Lost DATA rebuilt from parity, arg: length */
+#define RUDP_TR_MIGRATE		18	/* Peer of a connection moved, arg: its new port */
+#define RUDP_TR_MAX		18
+
+#define RUDP_FREE_DONE		0	/* FIN acknowledged, or TIME_WAIT over */
+#define RUDP_FREE_IDLE		1	/* Idle timeout */
+#define RUDP_FREE_ABORT		2	/* Retransmissions exhausted */
+#define RUDP_FREE_CLOSE		3	/* Socket closed */
+
+struct rudp_trace_event {
+	u_int64_t ts_ns;		/* CLOCK_MONOTONIC nanoseconds */
+	u_int32_t peer_addr;		/* Network byte order */
+	u_int16_t peer_port;		/* Network byte order */
+	u_int16_t type;			/* RUDP_TR_* */
+	u_int32_t seqno;
+	u_int32_t arg;
+} __attribute__ ((packed));
+
+/* Trace file layout: header, then one section per thread followed by its events */
+
+struct rudp_trace_filehdr {
+	char magic[8];
+	u_int32_t evsize;		/* sizeof(struct rudp_trace_event) */
+	u_int32_t nsections;
+} __attribute__ ((packed));
+
+struct rudp_trace_section {
+	u_int32_t tid;
+	u_int32_t nevents;
+	u_int64_t overwritten;		/* Events lost to ring wrap-around */
+} __attribute__ ((packed));
+
+#ifdef RUDP_NOTRACE
+#define RUDP_TRACE(type, addr, seq, arg) do { } while (0)
+#else
+extern volatile int rudp_trace_on;
+void rudp_trace_record(int type, struct sockaddr_in *addr, u_int32_t seqno, u_int32_t arg);
+#define RUDP_TRACE(type, addr, seq, arg) do { \
+	if (rudp_trace_on) \
+		rudp_trace_record((type), (addr), (seq), (arg)); \
+} while (0)
+#endif
+
+void rudp_trace_env(void);
+
+#endif /* RUDP_TRACE_H */
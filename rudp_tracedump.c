@@ -0,0 +1,93 @@
+/*
+ * rudp_tracedump: decode a binary RUDP trace file into text, one event per
+ * line, ordered by time across threads.
+ * Arguments: trace file
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "rudp_trace.h"
+
+struct tevent {
+	u_int32_t tid;
+	struct rudp_trace_event ev;
+};
+
+static const char *names[RUDP_TR_MAX + 1] = {
+	"?", "SOCKET", "SEND", "RETRANS", "RECV_DATA", "DELIVER", "SEND_ACK",
+	"RECV_ACK", "DUP_ACK", "TIMER_DEL", "FIN_ACK", "ALL_FIN", "DROP", "FREE",
+	"HOLD", "PROBE", "EARLY", "REPAIR", "MIGRATE"
+};
+
+int usage() {
+	fprintf(stderr, "Usage: rudp_tracedump tracefile\n");
+	exit(1);
+}
+
+static int tcmp(const void *a, const void *b) {
+	const struct tevent *x = a, *y = b;
+
+	if (x->ev.ts_ns != y->ev.ts_ns)
+		return x->ev.ts_ns < y->ev.ts_ns ? -1 : 1;
+	return 0;
+}
+
+int main(int argc, char* argv[]) {
+	struct rudp_trace_filehdr fh;
+	struct rudp_trace_section sec;
+	struct tevent *tev = NULL;
+	struct in_addr a;
+	size_t n = 0, i;
+	u_int32_t s, k;
+	FILE *f;
+
+	if (argc != 2)
+		usage();
+	if ((f = fopen(argv[1], "r")) == NULL) {
+		perror("rudp_tracedump: fopen");
+		exit(1);
+	}
+	if (fread(&fh, sizeof(fh), 1, f) != 1 || 
+	    memcmp(fh.magic, RUDP_TRACE_MAGIC, sizeof(fh.magic)) != 0 ||
+	    fh.evsize != sizeof(struct rudp_trace_event)) {
+		fprintf(stderr, "rudp_tracedump: %s is not a RUDP trace\n", argv[1]);
+		exit(1);
+	}
+	for (s = 0; s < fh.nsections; s++) {
+		if (fread(&sec, sizeof(sec), 1, f) != 1) {
+			fprintf(stderr, "rudp_tracedump: truncated file\n");
+			exit(1);
+		}
+		if (sec.overwritten)
+			fprintf(stderr, "rudp_tracedump: thread %u lost %llu events\n",
+				sec.tid, (unsigned long long) sec.overwritten);
+		if ((tev = realloc(tev, (n + sec.nevents) * sizeof(*tev))) == NULL) {
+			fprintf(stderr, "rudp_tracedump: out of memory\n");
+			exit(1);
+		}
+		for (k = 0; k < sec.nevents; k++, n++) {
+			tev[n].tid = sec.tid;
+			if (fread(&tev[n].ev, sizeof(tev[n].ev), 1, f) != 1) {
+				fprintf(stderr, "rudp_tracedump: truncated file\n");
+				exit(1);
+			}
+		}
+	}
+	fclose(f);
+	qsort(tev, n, sizeof(*tev), tcmp);
+	for (i = 0; i < n; i++) {
+		a.s_addr = tev[i].ev.peer_addr;
+		printf("%llu.%06llu %u %s:%d %s seq=%x arg=%u\n",
+			(unsigned long long) (tev[i].ev.ts_ns - tev[0].ev.ts_ns) / 1000000000ULL,
+			(unsigned long long) ((tev[i].ev.ts_ns - tev[0].ev.ts_ns) / 1000) % 1000000ULL,
+			tev[i].tid, inet_ntoa(a), ntohs(tev[i].ev.peer_port),
+			tev[i].ev.type <= RUDP_TR_MAX ? names[tev[i].ev.type] : "?",
+			tev[i].ev.seqno, tev[i].ev.arg);
+	}
+	free(tev);
+	return 0;
+}
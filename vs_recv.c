@@ -13,25 +13,128 @@
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <pthread.h>
 #include "rudp_api.h" 
 #include "event.h" 
 #include "vsftp.h"
 
+#define MAXSTATPEERS 64			/* Max number of peers in statistics */
+#define MAXSTATPOOLS 16			/* Max number of memory pools in statistics */
+#define RXHASHSIZE 4096			/* Buckets in rxfile hash table, power of two */
+#define NWORKERS 4			/* Default number of file writer threads */
+#define MAXWORKERS 64
+#define VS_PIECE 65536			/* Max. bytes of a file handed to a writer at once */
+#define WORKQ 64			/* Max. pieces queued for a writer */
+#define VS_CKPT (1 << 20)		/* Bytes of a file between checkpoints */
+#define CKPTSUFFIX ".vsck"		/* Checkpoint file of file name */
+#define PARTSUFFIX ".vspart"		/* File being received, renamed when complete */
+#define HALFOPEN 256			/* Peers waiting for their first data after
+					 * the SYN; past it SYNs get cookies */
+#define PROGNAME "vs_recv"
 
 /*
- * Data structure for keeping track of partially received files 
+ * Files of bulk transfers are created and written by writer threads, so
+ * that the event loop does not wait for creat(), write() and close().
+ * All pieces of a file go to the same writer, in order, and consecutive
+ * files to different writers.
+ */
+
+struct piece {
+	struct piece *next;
+	int first;			/* Create the file first */
+	int last;			/* Close it afterwards */
+	char name[VS_FILENAMELENGTH+1];
+	int len;
+	int cap;
+	char data[];
+};
+
+struct writer {
+	pthread_t tid;
+	pthread_mutex_t lock;
+	pthread_cond_t nonempty;
+	pthread_cond_t nonfull;
+	struct piece *head, *tail;
+	int npieces;
+	int fd;				/* File being written, writer thread only */
+};
+
+struct bulkfile {
+	char name[VS_FILENAMELENGTH+1];
+	u_int32_t size;
+};
+
+/*
+ * A file received in stripes, over several connections. It stays open
+ * until all stripes have ended, or one has failed and none is left.
+ */
+
+struct stripefile {
+	struct stripefile *next;
+	char name[VS_FILENAMELENGTH+1];
+	u_int64_t size;
+	u_int64_t id;
+	int fd;
+	int count;			/* Stripes of the file */
+	int attached;			/* Connections writing it */
+	int ended;			/* Stripes complete */
+	int failed;
+};
+
+/*
+ * Bytes of a file written after a gap, which unordered DATA leaves
+ */
+
+struct range {
+	struct range *next;
+	u_int64_t start;
+	u_int64_t end;
+};
+
+
+/*
+ * Data structure for keeping track of partially received files.
+ * A transfer is identified by peer address, peer port and stream,
+ * and is found through a hash table on that key.
  */
 
 struct rxfile {
-	struct rxfile *next;		/* Next pointer for linked list */
+	struct rxfile *next;		/* Next in hash bucket */
 	int fileopen;			/* True if file is open */
 	int fd;				/* File descriptor */
 	struct sockaddr_in remote;	/* Peer */
+	u_int32_t stream;		/* Stream within the peer connection */
 	char name[VS_FILENAMELENGTH+1]; /* Name of file */
+	struct bulkfile *files;		/* Manifest of a bulk transfer */
+	int nfiles;
+	int maxfiles;
+	int cur;			/* File the bulk stream is in */
+	u_int32_t pos;			/* Bytes of it received */
+	struct piece *piece;		/* Of it, not handed to its writer yet */
+	int resume;			/* Resumable: keeps a checkpoint */
+	u_int64_t size;			/* Size and identity from BEGIN */
+	u_int64_t id;
+	u_int64_t offset;		/* Contiguous bytes of the file written */
+	struct range *ranges;		/* Written beyond offset, in order */
+	struct stripefile *sf;		/* File of a stripe */
+	u_int64_t end;			/* Of the stripe */
+	u_int64_t ckpt;			/* Of them, recorded in the checkpoint */
+};
+
+/*
+ * Checkpoint of a resumable file, in the file name followed by
+ * CKPTSUFFIX. The data up to offset is on disk when it is written.
+ */
 
+struct ckpt {
+	u_int64_t size;
+	u_int64_t id;
+	u_int64_t offset;
 };
 
 /* 
@@ -39,22 +142,33 @@ struct rxfile {
  */
 
 int filesender(int fd, void *arg);
+int printstats(int fd, void *arg);
 int rudp_receiver(rudp_socket_t rsocket, struct sockaddr_in *remote, char *buf, int len);
+int rudp_batchreceiver(rudp_socket_t rsocket, struct rudp_buf *list, int n);
 int eventhandler(rudp_socket_t rsocket, rudp_event_t event, struct sockaddr_in *remote);
 int usage();
+void *writer_main(void *arg);
+static void bulkfree(struct rxfile *rx);
+static void stripedetach(struct rxfile *rx, int done);
 
 /* 
  * Global variables 
  */
 int debug = 0;				/* Print debug messages */
-struct rxfile *rxhead = NULL;		/* Pointer to linked list of rxfiles */
+int batch = 0;				/* Batched delivery */
+int statsecs = 0;			/* Statistics interval, 0 for none */
+struct rxfile *rxhash[RXHASHSIZE];	/* Hash table of rxfiles */
+int nrx = 0;				/* Number of rxfiles */
+int nwriters = NWORKERS;		/* Writer threads of bulk transfers */
+struct writer *writers = NULL;		/* Started with the first bulk transfer */
+struct stripefile *stripefiles = NULL;	/* Files being received in stripes */
 
 /* 
  * usage: how to use program
  */
 
 int usage() {
-	fprintf(stderr, "Usage: vs_recv [-d] port\n");
+	fprintf(stderr, "Usage: vs_recv [-b] [-d] [-u] [-j writers] [-s secs] port [port2 ...]\n");
 	exit(1);
 }
 
@@ -63,53 +177,99 @@ int main(int argc, char* argv[]) {
 	int port;
 
 	int c;
+	int i;
 
 	/* 
 	 * Parse and collect arguments
 	 */
 	opterr = 0;
 
-	while ((c = getopt(argc, argv, "d")) != -1) {
-		if (c == 'd') {
+	while ((c = getopt(argc, argv, "bdj:us:")) != -1) {
+		if (c == 'b') {
+			batch = 1;
+		}
+		else if (c == 'j') {
+			if ((nwriters = atoi(optarg)) <= 0 || nwriters > MAXWORKERS)
+				usage();
+		}
+		else if (c == 'd') {
 			debug = 1;
 		}
+		else if (c == 's') {
+			if ((statsecs = atoi(optarg)) <= 0)
+				usage();
+		}
+		else if (c == 'u') {
+			event_backend(EVENT_BACKEND_URING);
+		}
 		else 
 			usage();
 	}
-	if (argc - optind != 1) {
+	if (argc - optind < 1) {
 		usage();
 	}
 	
-	port = atoi(argv[optind]);
+	/*
+	 * One socket per port, so that a peer can reach this receiver over
+	 * several paths
+	 */
+
+	for (i = optind; i < argc; i++) {
+		port = atoi(argv[i]);
 		if (port <= 0) {
-		fprintf(stderr, "Bad destination port: %s\n", argv[optind]);
-		exit(1);
-	}
+			fprintf(stderr, "Bad destination port: %s\n", argv[i]);
+			exit(1);
+		}
 
-	if (debug) {
-		printf("RUDP receiver waiting on port %i.\n",port);
-	}
+		if (debug) {
+			printf("RUDP receiver waiting on port %i.\n",port);
+		}
 
-	/*
-	 * Create RUDP listener socket
-	 */
+		/*
+		 * Create RUDP listener socket
+		 */
 
-	if ((rsock = rudp_socket(port)) == NULL) {
-		fprintf(stderr,"vs_recv: rudp_socket() failed\n");
-		exit(1);
-	}
+		if ((rsock = rudp_socket(port)) == NULL) {
+			fprintf(stderr,"vs_recv: rudp_socket() failed\n");
+			exit(1);
+		}
 
-	/*
-	 * Register receiver callback function
-	 */
+		/*
+		 * Register receiver callback function
+		 */
 
-	rudp_recvfrom_handler(rsock, rudp_receiver);
+		if (batch)
+			rudp_recvbatch_handler(rsock, rudp_batchreceiver);
+		else
+			rudp_recvfrom_handler(rsock, rudp_receiver);
 
-	/*
-	 * Register event handler callback function
-	 */
+		/*
+		 * DATA is written where its offset says: take it as it arrives
+		 */
 
-	rudp_event_handler(rsock, eventhandler);
+		rudp_setsockopt(rsock, RUDP_OPT_UNORDERED, 1);
+
+		/*
+		 * A flood of SYNs gets no state: established transfers go on
+		 */
+
+		rudp_setsockopt(rsock, RUDP_OPT_HALFOPEN, HALFOPEN);
+		rudp_setsockopt(rsock, RUDP_OPT_SYNCOOKIES, 1);
+
+		/*
+		 * Register event handler callback function
+		 */
+
+		rudp_event_handler(rsock, eventhandler);
+
+		/*
+		 * Print statistics periodically
+		 */
+
+		if (statsecs) {
+			event_periodic(statsecs, printstats, rsock, "printstats");
+		}
+	}
 
 	/*
 	 * Hand over control to event manager
@@ -121,26 +281,96 @@ int main(int argc, char* argv[]) {
 }
 
 /*
- * rxfind: helper function to lookup a rxfile descriptor on the linked list.
- * Create new if not found
+ * printstats: periodic callback printing RUDP statistics of a socket
  */
 
-static struct rxfile *rxfind(struct sockaddr_in *addr) {
+int printstats(int fd, void *arg) {
+	rudp_socket_t rsock = (rudp_socket_t) arg;
+	struct rudp_stats st;
+	struct rudp_peer_stats ps[MAXSTATPEERS];
+	struct rudp_pool_stats pools[MAXSTATPOOLS];
+	int n, np, i;
+
+	if ((n = rudp_getstats(rsock, &st, ps, MAXSTATPEERS)) < 0)
+		return 0;
+	fprintf(stderr, "%s: stats: active transfers %d\n", PROGNAME, nrx);
+	fprintf(stderr, "%s: stats: peers %d sent %lu/%luB rcvd %lu/%luB "
+		"retrans %lu acked %lu timeouts %lu dupacks %lu "
+		"syncookies %lu syndrops %lu\n", PROGNAME,
+		st.npeers, st.c.pkts_sent, st.c.bytes_sent, st.c.pkts_rcvd, 
+		st.c.bytes_rcvd, st.c.pkts_retrans, st.c.pkts_acked, 
+		st.c.timeouts, st.c.dup_acks, st.c.syn_cookies, st.c.syn_dropped);
+	for (i = 0; i < n && i < MAXSTATPEERS; i++) {
+		fprintf(stderr, "%s: stats:   %s:%d %s sent %lu/%luB rcvd %lu/%luB "
+			"retrans %lu acked %lu timeouts %lu dupacks %lu "
+			"win %d inflight %d queued %d srtt %ldus rto %ldus\n", PROGNAME,
+			inet_ntoa(ps[i].peer.sin_addr), ntohs(ps[i].peer.sin_port),
+			ps[i].outgoing ? "out" : "in",
+			ps[i].c.pkts_sent, ps[i].c.bytes_sent, ps[i].c.pkts_rcvd,
+			ps[i].c.bytes_rcvd, ps[i].c.pkts_retrans, ps[i].c.pkts_acked,
+			ps[i].c.timeouts, ps[i].c.dup_acks, ps[i].window, 
+			ps[i].inflight, ps[i].queued, ps[i].srtt_us, ps[i].rto_us);
+	}
+	np = rudp_poolstats(pools, MAXSTATPOOLS);
+	for (i = 0; i < np && i < MAXSTATPOOLS; i++)
+		fprintf(stderr, "%s: stats: pool %s in use %lu peak %lu capacity %lu "
+			"objsize %lu slabs %lu huge %lu\n", PROGNAME, pools[i].name,
+			pools[i].in_use, pools[i].high_water, pools[i].capacity,
+			pools[i].objsize, pools[i].slabs, pools[i].huge_slabs);
+	return 0;
+}
+
+/*
+ * rxhashfn: hash bucket of a (address, port, stream) key
+ */
+
+static unsigned int rxhashfn(struct sockaddr_in *addr, u_int32_t stream) {
+	u_int32_t h;
+
+	h = addr->sin_addr.s_addr * 2654435761u;
+	h ^= (addr->sin_port + (stream << 16)) * 2246822519u;
+	h ^= h >> 15;
+	return h & (RXHASHSIZE - 1);
+}
+
+/*
+ * rxfind: helper function to lookup a rxfile descriptor in the hash table.
+ * Create new if not found and create is set, otherwise return NULL.
+ */
+
+static struct rxfile *rxfind(struct sockaddr_in *addr, u_int32_t stream, int create) {
 	struct rxfile *rx;
+	unsigned int h = rxhashfn(addr, stream);
 
-	for (rx = rxhead; rx != NULL; rx = rx->next) {
-		if (memcmp(&rx->remote, addr, sizeof(struct in_addr)) == 0)
+	for (rx = rxhash[h]; rx != NULL; rx = rx->next) {
+		if (rx->remote.sin_addr.s_addr == addr->sin_addr.s_addr &&
+		    rx->remote.sin_port == addr->sin_port && rx->stream == stream)
 			return rx;
 	}
+	if (!create)
+		return NULL;
 	/* Not found, create new */
 	if ((rx = malloc(sizeof(struct rxfile))) == NULL) {
 		fprintf(stderr, "vs_receiver: malloc failed\n");
 		exit(1);
 	}
 	rx->fileopen = 0;
+	rx->files = NULL;
+	rx->nfiles = 0;
+	rx->maxfiles = 0;
+	rx->cur = 0;
+	rx->pos = 0;
+	rx->piece = NULL;
+	rx->resume = 0;
+	rx->offset = 0;
+	rx->ckpt = 0;
+	rx->ranges = NULL;
+	rx->sf = NULL;
 	rx->remote = *addr;
-	rx->next = rxhead;
-	rxhead = rx;
+	rx->stream = stream;
+	rx->next = rxhash[h];
+	rxhash[h] = rx;
+	nrx++;
 	return rx;
 }
 
@@ -150,18 +380,554 @@ static struct rxfile *rxfind(struct sockaddr_in *addr) {
 
 static int rxdel(struct rxfile *rx) {
 	struct rxfile **rxp;
+	struct range *r;
 
-	for (rxp = &rxhead; *rxp != NULL && *rxp != rx; rxp = &(*rxp)->next)
+	for (rxp = &rxhash[rxhashfn(&rx->remote, rx->stream)]; *rxp != NULL && *rxp != rx; 
+	     rxp = &(*rxp)->next)
 		;
 	if (*rxp == NULL) { /* Not found */
 		fprintf(stderr, "vs_recv: Can't find rx record for peer\n");
 		return -1;
 	}
 	*rxp = rx->next;
+	bulkfree(rx);
+	while ((r = rx->ranges) != NULL) {
+		rx->ranges = r->next;
+		free(r);
+	}
 	free(rx);
+	nrx--;
+	return 0;
+}
+
+/*
+ * writer_main: writer thread, creates and writes the files of the pieces
+ * queued for it
+ */
+
+void *writer_main(void *arg) {
+	struct writer *w = (struct writer *) arg;
+	struct piece *pc;
+	int off, n;
+
+	for (;;) {
+		pthread_mutex_lock(&w->lock);
+		while (w->head == NULL)
+			pthread_cond_wait(&w->nonempty, &w->lock);
+		pc = w->head;
+		if ((w->head = pc->next) == NULL)
+			w->tail = NULL;
+		if (w->npieces-- == WORKQ)
+			pthread_cond_signal(&w->nonfull);
+		pthread_mutex_unlock(&w->lock);
+
+		if (pc->first && (w->fd = creat(pc->name, 0644)) < 0)
+			perror("vs_recv: create");
+		for (off = 0; w->fd >= 0 && off < pc->len; off += n) {
+			if ((n = write(w->fd, pc->data + off, pc->len - off)) < 0) {
+				perror("vs_recv: write");
+				break;
+			}
+		}
+		if (pc->last && w->fd >= 0) {
+			close(w->fd);
+			w->fd = -1;
+		}
+		free(pc);
+	}
+	return NULL;
+}
+
+/*
+ * submit: queue a piece for the writer of file number f of a transfer.
+ * Waits while the writer is WORKQ pieces behind.
+ */
+
+static void submit(struct piece *pc, int f) {
+	struct writer *w;
+	int i;
+
+	if (writers == NULL) {
+		if ((writers = calloc(nwriters, sizeof(struct writer))) == NULL) {
+			fprintf(stderr, "vs_receiver: malloc failed\n");
+			exit(1);
+		}
+		for (i = 0; i < nwriters; i++) {
+			pthread_mutex_init(&writers[i].lock, NULL);
+			pthread_cond_init(&writers[i].nonempty, NULL);
+			pthread_cond_init(&writers[i].nonfull, NULL);
+			writers[i].fd = -1;
+			if (pthread_create(&writers[i].tid, NULL, writer_main, &writers[i]) != 0) {
+				fprintf(stderr, "vs_recv: pthread_create failed\n");
+				exit(1);
+			}
+		}
+	}
+	w = &writers[f % nwriters];
+	pc->next = NULL;
+	pthread_mutex_lock(&w->lock);
+	while (w->npieces >= WORKQ)
+		pthread_cond_wait(&w->nonfull, &w->lock);
+	if (w->tail)
+		w->tail->next = pc;
+	else
+		w->head = pc;
+	w->tail = pc;
+	if (w->npieces++ == 0)
+		pthread_cond_signal(&w->nonempty);
+	pthread_mutex_unlock(&w->lock);
+}
+
+/*
+ * newpiece: allocate a piece of up to cap bytes of a file
+ */
+
+static struct piece *newpiece(char *name, int first, int cap) {
+	struct piece *pc;
+
+	if ((pc = malloc(sizeof(struct piece) + cap)) == NULL) {
+		fprintf(stderr, "vs_receiver: malloc failed\n");
+		exit(1);
+	}
+	strcpy(pc->name, name);
+	pc->first = first;
+	pc->last = 0;
+	pc->len = 0;
+	pc->cap = cap;
+	return pc;
+}
+
+/*
+ * validname: only alpha-numerical, period, dash and underscore are
+ * allowed in file names
+ */
+
+static int validname(char *name) {
+	for (; *name; name++) {
+		if (!(isalnum(*name) || *name == '.' || *name == '_' || *name == '-'))
+			return 0;
+	}
+	return 1;
+}
+
+/*
+ * manifest: add the entries of a MANIFEST message to a bulk transfer.
+ * Returns -1 if one is malformed.
+ */
+
+static int manifest(struct rxfile *rx, u_int8_t *data, int len) {
+	struct bulkfile *bf;
+	u_int32_t size;
+	int namelen;
+
+	while (len > 0) {
+		if (len < VS_ENTRYHDR || (namelen = data[sizeof(size)]) == 0 ||
+		    namelen > VS_FILENAMELENGTH || len < VS_ENTRYHDR + namelen)
+			return -1;
+		if (rx->nfiles == rx->maxfiles) {
+			rx->maxfiles = rx->maxfiles ? 2 * rx->maxfiles : 64;
+			if ((bf = realloc(rx->files, rx->maxfiles * sizeof(struct bulkfile))) == NULL) {
+				fprintf(stderr, "vs_receiver: malloc failed\n");
+				exit(1);
+			}
+			rx->files = bf;
+		}
+		bf = &rx->files[rx->nfiles];
+		memcpy(&size, data, sizeof(size));
+		bf->size = ntohl(size);
+		memcpy(bf->name, data + VS_ENTRYHDR, namelen);
+		bf->name[namelen] = '\0';
+		if (!validname(bf->name)) {
+			fprintf(stderr, "vs_recv: Illegal file name \"%s\"\n", bf->name);
+			return -1;
+		}
+		rx->nfiles++;
+		data += VS_ENTRYHDR + namelen;
+		len -= VS_ENTRYHDR + namelen;
+	}
+	return 0;
+}
+
+/*
+ * bulkdata: take the next bytes of a bulk stream. They are collected into
+ * pieces of at most VS_PIECE bytes of one file, which go to the file's
+ * writer when full or when the file is complete. Files of size 0 are
+ * complete as soon as the stream reaches them. Returns the number of
+ * bytes beyond the end of the manifest.
+ */
+
+static int bulkdata(struct rxfile *rx, char *data, int len) {
+	struct bulkfile *bf;
+	u_int32_t n;
+
+	while (rx->cur < rx->nfiles) {
+		bf = &rx->files[rx->cur];
+		if (len == 0 && rx->pos < bf->size)
+			break;
+		if (rx->piece == NULL) {
+			n = bf->size - rx->pos;
+			rx->piece = newpiece(bf->name, rx->pos == 0, n < VS_PIECE ? n : VS_PIECE);
+		}
+		n = rx->piece->cap - rx->piece->len;
+		if (n > (u_int32_t) len)
+			n = len;
+		memcpy(rx->piece->data + rx->piece->len, data, n);
+		rx->piece->len += n;
+		rx->pos += n;
+		data += n;
+		len -= n;
+		if (rx->pos == bf->size) {
+			if (debug) {
+				fprintf(stderr, "vs_recv: end of \"%s\" (%u bytes) in bulk transfer\n",
+					bf->name, bf->size);
+			}
+			rx->piece->last = 1;
+			submit(rx->piece, rx->cur);
+			rx->piece = NULL;
+			rx->cur++;
+			rx->pos = 0;
+		}
+		else if (rx->piece->len == rx->piece->cap) {
+			submit(rx->piece, rx->cur);
+			rx->piece = NULL;
+		}
+	}
+	return len;
+}
+
+/*
+ * bulkfree: end the bulk transfer of a rxfile. A file left incomplete is
+ * closed with what has been received of it.
+ */
+
+static void bulkfree(struct rxfile *rx) {
+	if (rx->files == NULL)
+		return;
+	if (rx->cur < rx->nfiles) {
+		fprintf(stderr, "vs_recv: bulk transfer from %s:%d ended after %d of %d files\n",
+			inet_ntoa(rx->remote.sin_addr), ntohs(rx->remote.sin_port),
+			rx->cur, rx->nfiles);
+		if (rx->piece == NULL && rx->pos > 0)
+			rx->piece = newpiece(rx->files[rx->cur].name, 0, 0);
+		if (rx->piece) {
+			rx->piece->last = 1;
+			submit(rx->piece, rx->cur);
+		}
+	}
+	free(rx->files);
+	rx->files = NULL;
+	rx->piece = NULL;
+}
+
+/*
+ * ckptname: name of the checkpoint file of a rxfile
+ */
+
+static void ckptname(struct rxfile *rx, char *path, int size) {
+	snprintf(path, size, "%s" CKPTSUFFIX, rx->name);
+}
+
+/*
+ * partname: name a file is received under until all of it is written
+ */
+
+static void partname(char *name, char *path, int size) {
+	snprintf(path, size, "%s" PARTSUFFIX, name);
+}
+
+/*
+ * checkpoint: record how much of a resumable file is on disk. The data
+ * is synced first, and the checkpoint replaced atomically, so that it
+ * never claims more than a crash leaves in the file.
+ */
+
+static void checkpoint(struct rxfile *rx) {
+	char path[VS_FILENAMELENGTH + 16], tmp[VS_FILENAMELENGTH + 32];
+	struct ckpt ck;
+	int fd;
+
+	if (!rx->resume || !rx->fileopen || rx->ckpt == rx->offset)
+		return;
+	ckptname(rx, path, sizeof(path));
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	ck.size = rx->size;
+	ck.id = rx->id;
+	ck.offset = rx->offset;
+	if (fdatasync(rx->fd) < 0 ||
+	    (fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+		perror("vs_recv: checkpoint");
+		return;
+	}
+	if (write(fd, &ck, sizeof(ck)) != sizeof(ck) || fsync(fd) < 0) {
+		perror("vs_recv: checkpoint");
+		close(fd);
+		unlink(tmp);
+		return;
+	}
+	close(fd);
+	if (rename(tmp, path) < 0) {
+		perror("vs_recv: checkpoint");
+		unlink(tmp);
+		return;
+	}
+	rx->ckpt = rx->offset;
+}
+
+/*
+ * rxwritten: n bytes of a file have been written at off. Bytes after a
+ * gap are kept as a range until the gap is filled. Checkpoints a
+ * resumable file every VS_CKPT contiguous bytes.
+ */
+
+static void rxwritten(struct rxfile *rx, u_int64_t off, int n) {
+	struct range **rp, *r;
+	u_int64_t end = off + n;
+
+	if (off > rx->offset) {
+		for (rp = &rx->ranges; *rp != NULL && (*rp)->end < off; rp = &(*rp)->next)
+			;
+		if ((r = *rp) == NULL || r->start > end) {
+			if ((r = malloc(sizeof(struct range))) == NULL) {
+				fprintf(stderr, "vs_receiver: malloc failed\n");
+				exit(1);
+			}
+			r->start = off;
+			r->end = end;
+			r->next = *rp;
+			*rp = r;
+			return;
+		}
+		/* Overlaps or touches r, and maybe the ones after it */
+		if (off < r->start)
+			r->start = off;
+		if (end > r->end)
+			r->end = end;
+		while (r->next != NULL && r->next->start <= r->end) {
+			*rp = r->next;
+			if (r->end > r->next->end)
+				r->next->end = r->end;
+			r->next->start = r->start;
+			free(r);
+			r = *rp;
+		}
+		return;
+	}
+	if (end > rx->offset)
+		rx->offset = end;
+	while ((r = rx->ranges) != NULL && r->start <= rx->offset) {
+		if (r->end > rx->offset)
+			rx->offset = r->end;
+		rx->ranges = r->next;
+		free(r);
+	}
+	if (rx->resume && rx->offset - rx->ckpt >= VS_CKPT)
+		checkpoint(rx);
+}
+
+/*
+ * resumeopen: open a resumable file. If its checkpoint is of the same
+ * size and identity, keep what it records; otherwise start over.
+ * Returns the file descriptor or -1.
+ */
+
+static int resumeopen(struct rxfile *rx) {
+	char path[VS_FILENAMELENGTH + 16], part[VS_FILENAMELENGTH + 16];
+	struct ckpt ck;
+	struct stat st;
+	int fd;
+
+	partname(rx->name, part, sizeof(part));
+
+	ckptname(rx, path, sizeof(path));
+	if ((fd = open(path, O_RDONLY)) >= 0) {
+		if (read(fd, &ck, sizeof(ck)) == sizeof(ck) &&
+		    ck.size == rx->size && ck.id == rx->id && ck.offset <= ck.size) {
+			rx->offset = rx->ckpt = ck.offset;
+		}
+		close(fd);
+	}
+	if (rx->offset > 0) {
+		if ((fd = open(part, O_WRONLY)) >= 0 && 
+		    fstat(fd, &st) == 0 && (u_int64_t) st.st_size >= rx->offset)
+			return fd;
+		if (fd >= 0)
+			close(fd);
+		rx->offset = rx->ckpt = 0;
+	}
+	unlink(path);
+	return creat(part, 0644);
+}
+
+/*
+ * rxclose: close the file of a broken off transfer. A resumable one is
+ * checkpointed and cut back to its contiguous bytes, any other removed.
+ */
+
+static void rxclose(struct rxfile *rx) {
+	char path[VS_FILENAMELENGTH + 16];
+
+	if (rx->sf) {
+		stripedetach(rx, 0);
+		return;
+	}
+	checkpoint(rx);
+	/* Unordered DATA leaves gaps after the contiguous bytes */
+	if (rx->resume && ftruncate(rx->fd, rx->offset) < 0)
+		perror("vs_recv: truncate");
+	close(rx->fd);
+	rx->fileopen = 0;
+	if (!rx->resume) {
+		partname(rx->name, path, sizeof(path));
+		unlink(path);
+	}
+}
+
+/*
+ * rxstripe: open the file of a STRIPE, shared with the other stripes
+ * of it, and answer with RESUME at the start of the range. Returns -1 on
+ * failure.
+ */
+
+static int rxstripe(rudp_socket_t rsocket, struct sockaddr_in *remote, struct rxfile *rx,
+		    u_int64_t start, int index, int count) {
+	u_int8_t msg[sizeof(u_int32_t) + VS_OFFSETLEN];
+	u_int32_t vs_type = htonl(VS_TYPE_RESUME);
+	char path[VS_FILENAMELENGTH + 16];
+	struct stripefile *sf;
+
+	if (start > rx->end || rx->end > rx->size || index >= count) {
+		fprintf(stderr, "vs_recv: bad stripe %d of %d of \"%s\"\n", index, count, rx->name);
+		return -1;
+	}
+	for (sf = stripefiles; sf != NULL; sf = sf->next) {
+		if (strcmp(sf->name, rx->name) == 0 && sf->size == rx->size &&
+		    sf->id == rx->id && sf->count == count)
+			break;
+	}
+	if (sf == NULL) {
+		if ((sf = calloc(1, sizeof(struct stripefile))) == NULL) {
+			fprintf(stderr, "vs_receiver: malloc failed\n");
+			exit(1);
+		}
+		/* Not truncated: other stripes may be written already */
+		partname(rx->name, path, sizeof(path));
+		if ((sf->fd = open(path, O_WRONLY | O_CREAT, 0644)) < 0 ||
+		    ftruncate(sf->fd, rx->size) < 0) {
+			perror("vs_recv: create");
+			if (sf->fd >= 0)
+				close(sf->fd);
+			free(sf);
+			return -1;
+		}
+		strcpy(sf->name, rx->name);
+		sf->size = rx->size;
+		sf->id = rx->id;
+		sf->count = count;
+		sf->next = stripefiles;
+		stripefiles = sf;
+	}
+	sf->attached++;
+	rx->sf = sf;
+	rx->fd = sf->fd;
+	rx->fileopen = 1;
+	rx->offset = start;
+	memcpy(msg, &vs_type, sizeof(vs_type));
+	vs_put64(msg + sizeof(vs_type), rx->offset);
+	if (rudp_sendto(rsocket, msg, sizeof(msg), remote) < 0) {
+		fprintf(stderr, "vs_recv: send failure\n");
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * stripedetach: a stripe has ended, complete if done is set, or failed.
+ * Closes the file when no stripe is missing any more, and gives it its
+ * name if all of them are complete.
+ */
+
+static void stripedetach(struct rxfile *rx, int done) {
+	struct stripefile *sf = rx->sf, **sfp;
+	char path[VS_FILENAMELENGTH + 16];
+
+	if (done && rx->offset != rx->end) {
+		fprintf(stderr, "vs_recv: stripe of \"%s\" ended at %llu, expected %llu\n",
+			rx->name, (unsigned long long) rx->offset,
+			(unsigned long long) rx->end);
+		done = 0;
+	}
+	if (done && ++sf->ended == sf->count)
+		printf("vs_recv: received end of file \"%s\" (%d stripes)\n", sf->name, sf->count);
+	if (!done)
+		sf->failed = 1;
+	rx->sf = NULL;
+	rx->fileopen = 0;
+	if (--sf->attached > 0 || (sf->ended < sf->count && !sf->failed))
+		return;		/* Other stripes to come */
+	close(sf->fd);
+	partname(sf->name, path, sizeof(path));
+	if (sf->failed)
+		unlink(path);
+	else if (rename(path, sf->name) < 0)
+		perror("vs_recv: rename");
+	for (sfp = &stripefiles; *sfp != sf; sfp = &(*sfp)->next)
+		;
+	*sfp = sf->next;
+	free(sf);
+}
+
+/*
+ * rxbegin: open the file of a BEGIN. A resumable one is answered with
+ * RESUME and the bytes of it kept from before. Returns -1 on failure.
+ */
+
+static int rxbegin(rudp_socket_t rsocket, struct sockaddr_in *remote, struct rxfile *rx) {
+	u_int8_t msg[sizeof(u_int32_t) + VS_OFFSETLEN];
+	u_int32_t vs_type = htonl(VS_TYPE_RESUME);
+	char path[VS_FILENAMELENGTH + 16];
+
+	if (!rx->resume) {
+		partname(rx->name, path, sizeof(path));
+		if ((rx->fd = creat(path, 0644)) < 0) {
+			perror("vs_recv: create");
+			return -1;
+		}
+		rx->fileopen = 1;
+		return 0;
+	}
+	if ((rx->fd = resumeopen(rx)) < 0) {
+		perror("vs_recv: create");
+		return -1;
+	}
+	rx->fileopen = 1;
+	if (rx->offset > 0) {
+		printf("vs_recv: \"%s\" has %llu of %llu bytes\n", rx->name,
+		       (unsigned long long) rx->offset, (unsigned long long) rx->size);
+	}
+	memcpy(msg, &vs_type, sizeof(vs_type));
+	vs_put64(msg + sizeof(vs_type), rx->offset);
+	if (rudp_sendto(rsocket, msg, sizeof(msg), remote) < 0) {
+		fprintf(stderr, "vs_recv: send failure\n");
+		return -1;
+	}
 	return 0;
 }
 
+/*
+ * rxoffset: DATA of a resumable file continues at offset, at most the
+ * bytes the receiver has. Unordered DATA may have overtaken the OFFSET
+ * and been written already: the bytes it has stay counted, and DATA
+ * below them is written again harmlessly. Returns -1 on failure.
+ */
+
+static int rxoffset(struct rxfile *rx, u_int64_t offset) {
+	if (!rx->fileopen || !(rx->resume || rx->sf) || offset > rx->offset) {
+		fprintf(stderr, "vs_recv: bad OFFSET %llu for \"%s\"\n",
+			(unsigned long long) offset, rx->name);
+		return -1;
+	}
+	return 0;
+}
 
 /* 
  * eventhandler: callback function for RUDP events
@@ -176,9 +942,9 @@ int eventhandler(rudp_socket_t rsocket, rudp_event_t event, struct sockaddr_in *
 			fprintf(stderr, "vs_recv: time out in communication with %s:%d\n",
 				inet_ntoa(remote->sin_addr),
 				ntohs(remote->sin_port));
-			if ((rx = rxfind(remote))) {
+			if ((rx = rxfind(remote, 0, 0))) {
 				if (rx->fileopen) {
-					close(rx->fd);
+					rxclose(rx);
 				}
 				rxdel(rx);
 			}
@@ -188,12 +954,12 @@ int eventhandler(rudp_socket_t rsocket, rudp_event_t event, struct sockaddr_in *
 		}
 		break;
 	case RUDP_EVENT_CLOSED:
-		if (remote && (rx = rxfind(remote))) {
+		if (remote && (rx = rxfind(remote, 0, 0))) {
 			if (rx->fileopen) {
 				fprintf(stderr, "vs_recv: prematurely closed communication with %s:%d\n",
 					inet_ntoa(remote->sin_addr),
 					ntohs(remote->sin_port));
-				close(rx->fd);
+				rxclose(rx);
 			}
 			rxdel(rx);
 		} /* else ignore */
@@ -212,8 +978,13 @@ int eventhandler(rudp_socket_t rsocket, rudp_event_t event, struct sockaddr_in *
 
 int rudp_receiver(rudp_socket_t rsocket, struct sockaddr_in *remote, char *buf, int len) {
 	struct rxfile *rx;
+	char path[VS_FILENAMELENGTH + 16];
+	u_int8_t *info;
+	u_int64_t off;
+	u_int32_t w[2];
 	int namelen;
-	int i;
+	int stripe;
+	int n;
 
 	struct vsftp *vs = (struct vsftp *) buf;
 	if (len < VS_MINLEN) {
@@ -221,52 +992,83 @@ int rudp_receiver(rudp_socket_t rsocket, struct sockaddr_in *remote, char *buf,
 			len);
 		return 0;
 	}
-	rx = rxfind(remote);
+	rx = rxfind(remote, 0, 1); /* VSFTP sends one file per connection: stream 0 */
 	switch (ntohl(vs->vs_type)) {
 	case VS_TYPE_BEGIN:
-		namelen = len - sizeof(vs->vs_type);
+	case VS_TYPE_STRIPE:
+		namelen = strnlen(vs->vs_info.vs_filename, len - sizeof(vs->vs_type));
 		if (namelen > VS_FILENAMELENGTH)
 			namelen = VS_FILENAMELENGTH;
 		strncpy(rx->name, vs->vs_info.vs_filename, namelen);
 		rx->name[namelen] = '\0'; /* Null terminated */
 
-		/* Verify that file name is valid
-		 * Only alpha-numerical, period, dash and
-		 * underscore are allowed */
-		for (i = 0; i < namelen; i++) {
-			char c = rx->name[i];
-			if (!(isalnum(c) || c == '.' || c == '_' || c == '-')) {
-				fprintf(stderr, "vs_recv: Illegal file name \"%s\"\n", 
-					rx->name);
-				rudp_close(rsocket);
-				return 0;
-			}
+		/* Size and identity follow for a resumable file */
+		info = (u_int8_t *) buf + sizeof(vs->vs_type) + namelen + 1;
+		if ((rx->resume = (len >= (int) sizeof(vs->vs_type) + namelen + 1 + VS_RESUMEINFO))) {
+			rx->size = vs_get64(info);
+			rx->id = vs_get64(info + VS_RESUMEINFO / 2);
+		}
+		stripe = ntohl(vs->vs_type) == VS_TYPE_STRIPE;
+		if (stripe && (!rx->resume || 
+			       len < (int) sizeof(vs->vs_type) + namelen + 1 + VS_RESUMEINFO + VS_STRIPEINFO)) {
+			fprintf(stderr, "vs_recv: Too short STRIPE (%d bytes)\n", len);
+			rudp_close(rsocket);
+			return 0;
+		}
+
+		/* Verify that file name is valid */
+		if (!validname(rx->name)) {
+			fprintf(stderr, "vs_recv: Illegal file name \"%s\"\n", 
+				rx->name);
+			rudp_close(rsocket);
+			return 0;
 		}
 
 		if (debug) {
-			fprintf(stderr, "vs_recv: BEGIN \"%s\" (%d bytes) from %s:%d\n", rx->name, len,
+			fprintf(stderr, "vs_recv: %s \"%s\" (%d bytes) from %s:%d\n", 
+				stripe ? "STRIPE" : "BEGIN", rx->name, len,
 				inet_ntoa(remote->sin_addr), ntohs(remote->sin_port));
 		}
-		if ((rx->fd = creat(rx->name, 0644)) < 0) {
-			perror("vs_recv: create");
+		if (stripe) {
+			/* Stripes are not resumed, see vsftp.h */
+			rx->resume = 0;
+			info += VS_RESUMEINFO;
+			rx->end = vs_get64(info + VS_OFFSETLEN);
+			memcpy(w, info + 2 * VS_OFFSETLEN, sizeof(w));
+			if (rxstripe(rsocket, remote, rx, vs_get64(info), ntohl(w[0]), ntohl(w[1])) < 0) {
+				rudp_close(rsocket);
+			}
+		}
+		else if (rxbegin(rsocket, remote, rx) < 0) {
 			rudp_close(rsocket);
 		}
-		else {
-			rx->fileopen = 1;
+		break;
+	case VS_TYPE_OFFSET:
+		if (len < (int) sizeof(vs->vs_type) + VS_OFFSETLEN ||
+		    rxoffset(rx, vs_get64((u_int8_t *) buf + sizeof(vs->vs_type))) < 0) {
+			rudp_close(rsocket);
 		}
 		break;
 	case VS_TYPE_DATA:
+		if (len < VS_DATAHDR) {
+			fprintf(stderr, "vs_recv: Too short DATA (%d bytes)\n", len);
+			break;
+		}
+		off = vs_get64((u_int8_t *) buf + sizeof(vs->vs_type));
 		if (debug) {
-			fprintf(stderr, "vs_recv: DATA (%d bytes) from %s:%d\n", 
-				len, 
+			fprintf(stderr, "vs_recv: DATA (%d bytes at %llu) from %s:%d\n", 
+				len, (unsigned long long) off,
 				inet_ntoa(remote->sin_addr), ntohs(remote->sin_port));
 		}
-		len -= sizeof(vs->vs_type);
-		/* len now is length of payload (data or file name) */
+		len -= VS_DATAHDR;
+		/* len now is length of payload */
 		if (rx->fileopen) {
-			if ((write(rx->fd, vs->vs_info.vs_filename, len)) < 0) {
+			if ((n = pwrite(rx->fd, buf + VS_DATAHDR, len, off)) < 0) {
 				perror("vs_recv: write");
 			}
+			else {
+				rxwritten(rx, off, n);
+			}
 		}
 		else {
 			fprintf(stderr, "vs_recv: DATA ignored (file not open)\n");
@@ -277,12 +1079,54 @@ int rudp_receiver(rudp_socket_t rsocket, struct sockaddr_in *remote, char *buf,
 			fprintf(stderr, "vs_recv: END (%d bytes) from %s:%d\n",
 				len, inet_ntoa(remote->sin_addr), ntohs(remote->sin_port));
 		}
-		printf("vs_recv: received end of file \"%s\"\n", rx->name);
-		if (rx->fileopen) {
-			close(rx->fd);
-			rxdel(rx);
+		if (rx->files) {
+			printf("vs_recv: received end of bulk transfer, %d files\n", rx->cur);
+		}
+		else if (!rx->sf) {
+			printf("vs_recv: received end of file \"%s\"\n", rx->name);
+		}
+		if (rx->sf) {
+			stripedetach(rx, 1);
+		}
+		else if (rx->fileopen) {
+			/* Renamed only with no gap left in it */
+			if (rx->ranges != NULL || (rx->resume && rx->offset != rx->size)) {
+				fprintf(stderr, "vs_recv: \"%s\" incomplete, %llu contiguous bytes\n",
+					rx->name, (unsigned long long) rx->offset);
+				rxclose(rx);
+			}
+			else {
+				close(rx->fd);
+				partname(rx->name, path, sizeof(path));
+				if (rename(path, rx->name) < 0)
+					perror("vs_recv: rename");
+				if (rx->resume) {
+					ckptname(rx, path, sizeof(path));
+					unlink(path);
+				}
+			}
+		}
+		rxdel(rx);
+		break;
+	case VS_TYPE_MANIFEST:
+		if (debug) {
+			fprintf(stderr, "vs_recv: MANIFEST (%d bytes) from %s:%d\n",
+				len, inet_ntoa(remote->sin_addr), ntohs(remote->sin_port));
+		}
+		if (manifest(rx, (u_int8_t *) buf + sizeof(vs->vs_type), len - sizeof(vs->vs_type)) < 0) {
+			fprintf(stderr, "vs_recv: bad manifest from %s:%d\n",
+				inet_ntoa(remote->sin_addr), ntohs(remote->sin_port));
+			rudp_close(rsocket);
+		}
+		break;
+	case VS_TYPE_BULK:
+		if (debug) {
+			fprintf(stderr, "vs_recv: BULK (%d bytes) from %s:%d\n",
+				len, inet_ntoa(remote->sin_addr), ntohs(remote->sin_port));
+		}
+		if (bulkdata(rx, buf + sizeof(vs->vs_type), len - sizeof(vs->vs_type)) > 0) {
+			fprintf(stderr, "vs_recv: BULK data beyond the manifest ignored\n");
 		}
-		/* else ignore */
 		break;
 	default:
 		fprintf(stderr, "vs_recv: bad vsftp type %d from %s:%d\n",
@@ -291,8 +1135,67 @@ int rudp_receiver(rudp_socket_t rsocket, struct sockaddr_in *remote, char *buf,
 	return 0;
 }
 
+/*
+ * isdata: true if a received buffer is a VSFTP DATA packet
+ */
 
+static int isdata(struct rudp_buf *b) {
+	return b->len >= VS_DATAHDR && 
+		ntohl(((struct vsftp *) b->data)->vs_type) == VS_TYPE_DATA;
+}
 
+/*
+ * dataoff: file offset of the data of a DATA packet
+ */
 
+static u_int64_t dataoff(struct rudp_buf *b) {
+	return vs_get64((u_int8_t *) b->data + sizeof(u_int32_t));
+}
 
+/*
+ * rudp_batchreceiver: batch handler for data received on RUDP socket.
+ * A run of DATA packets from the same peer, for consecutive bytes of the
+ * file, is written with one pwritev(), straight from the received
+ * buffers. Other packets go to rudp_receiver().
+ */
+
+int rudp_batchreceiver(rudp_socket_t rsocket, struct rudp_buf *list, int n) {
+	struct iovec iov[RUDP_BATCH];
+	struct rudp_buf *b, *first;
+	struct rxfile *rx;
+	int niov;
+	ssize_t written;
+	u_int64_t off, next;
 
+	b = list;
+	while (b) {
+		if (debug || !isdata(b)) {
+			rudp_receiver(rsocket, &b->from, b->data, b->len);
+			b = b->next;
+			continue;
+		}
+		first = b;
+		off = next = dataoff(b);
+		for (niov = 0; b && niov < RUDP_BATCH && isdata(b) &&
+			     b->from.sin_addr.s_addr == first->from.sin_addr.s_addr &&
+			     b->from.sin_port == first->from.sin_port &&
+			     dataoff(b) == next; b = b->next) {
+			iov[niov].iov_base = b->data + VS_DATAHDR;
+			iov[niov].iov_len = b->len - VS_DATAHDR;
+			next += iov[niov].iov_len;
+			niov++;
+		}
+		rx = rxfind(&first->from, 0, 1);
+		if (!rx->fileopen) {
+			fprintf(stderr, "vs_recv: DATA ignored (file not open)\n");
+		}
+		else if ((written = pwritev(rx->fd, iov, niov, off)) < 0) {
+			perror("vs_recv: writev");
+		}
+		else {
+			rxwritten(rx, off, written);
+		}
+	}
+	rudp_buf_free(list);
+	return 0;
+}
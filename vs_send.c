@@ -13,22 +13,116 @@
 #include <string.h>
 #include <sys/types.h>
 #include <sys/file.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <errno.h>
 #include "rudp_api.h"
 #include "event.h"
 #include "vsftp.h"
 
 #define MAXPEERS 32			/* Max number of remote peers */
 #define MAXPEERNAMELEN 256		/* Max length of peer name */
+#define MAXSTATPEERS 64			/* Max number of peers in statistics */
+#define MAXSTATPOOLS 16			/* Max number of memory pools in statistics */
+#define PROGNAME "vs_send"
+#define READAHEAD 256			/* Default number of chunks read ahead */
+#define MAXPATHS 8			/* Max number of addresses of a peer */
+#define VS_MINSTRIPE (1 << 20)		/* Min. bytes of a stripe */
+#define FASTOPEN 16			/* Packets sent behind the SYN before it is
+					 * acknowledged */
+
+/*
+ * File data is read by a reader thread per transfer, into a ring of chunks
+ * ahead of the sending, so that the event loop never waits for the disk.
+ * The thread writes a byte into the notify pipe for every chunk filled,
+ * which makes the event loop call filesender(); free slots are counted
+ * by a semaphore. A bulk transfer reads its files one after the other,
+ * and a chunk may hold the end of one and the start of the next.
+ */
+
+struct chunk {
+	int len;			/* 0 at end of transfer, -1 on error */
+	int err;			/* errno of a failed read */
+	u_int64_t off;			/* Offset of data in the file */
+	u_int8_t data[VS_MAXBULK];
+};
+
+struct reader {
+	char **names;
+	int *files;			/* -1 if not open yet */
+	long *sizes;			/* Bytes to read from each, -1 up to EOF */
+	int nfiles;
+	int type;			/* VS_TYPE_DATA or VS_TYPE_BULK */
+	int chunksize;
+	rudp_socket_t rsock;
+	struct sockaddr_in to[MAXPEERS];	/* Where the data goes */
+	int notify[2];			/* Reader thread -> event loop */
+	sem_t free;			/* Empty chunks */
+	volatile int stop;
+	int nchunks;
+	int head;			/* Next chunk to send, event loop only */
+	struct chunk *chunks;
+	pthread_t tid;
+};
+
+/*
+ * A file transfer waiting for the RESUME answers of its peers, before
+ * its data goes out
+ */
+
+struct xfer {
+	struct xfer *next;
+	rudp_socket_t rsock;
+	char *filename;
+	int file;
+	long end;			/* Of a stripe, -1 for up to EOF */
+	struct sockaddr_in to[MAXPEERS];
+	int nanswers;
+	int answered[MAXPEERS];
+	u_int64_t offset;		/* Smallest offset answered */
+};
+
+/*
+ * A range of a large file, sent over a connection of its own by a thread
+ */
+
+struct stripe {
+	struct stripe *next;
+	pthread_t tid;
+	char *filename;
+	int index;
+	int count;
+	long start;
+	long end;
+};
+
 /* 
  * Prototypes 
  */
 
 int usage();
 int filesender(int fd, void *arg);
+int resumehandler(rudp_socket_t rsocket, struct sockaddr_in *remote, char *buf, int len);
+u_int64_t fileid(struct stat *st);
+void *reader_main(void *arg);
+void reader_stop(struct reader *rd);
+void reader_start(rudp_socket_t rsock, struct sockaddr_in *to, char **names, int *files, 
+		  long *sizes, int nfiles, int type);
+int printstats(int fd, void *arg);
 void send_file(char *filename);
+int vs_header(u_int8_t *msg, int type, char *filename, struct stat *st);
+void xfer_start(char *filename, int file, u_int8_t *msg, int vslen, 
+		struct sockaddr_in *to, long end);
+void send_striped(char *filename, long size);
+void *stripe_main(void *arg);
+int parseaddr(char *str, struct sockaddr_in *addr);
+void send_bulk(char **filenames, int nfiles);
+char *basename1(char *filename);
 int eventhandler(rudp_socket_t rsocket, rudp_event_t event, struct sockaddr_in *remote);
 
 /* 
@@ -36,23 +130,37 @@ int eventhandler(rudp_socket_t rsocket, rudp_event_t event, struct sockaddr_in *
  */
 
 int debug = 0;			/* Debug flag */
+int statsecs = 0;		/* Statistics interval, 0 for none */
 struct sockaddr_in peers[MAXPEERS];	/* IP address and port */
 int npeers = 0;			/* Number of elements in peers */
+struct sockaddr_in paths[MAXPEERS][MAXPATHS];	/* Addresses of each peer, the
+						 * first one in peers */
+int npaths[MAXPEERS];
+int readahead = READAHEAD;	/* Chunks read ahead of the sending */
+int bulk = 0;			/* All files in one bulk transfer */
+int nconns = 1;			/* Connections a large file is striped over */
+int fec = 0;			/* RUDP_OPT_FEC of the sending sockets */
+int uring = 0;			/* io_uring event backend */
+struct stripe *stripes = NULL;	/* Stripe threads, joined at exit */
+static __thread struct xfer *xfers = NULL;	/* Transfers waiting for RESUME, 
+						 * of the thread's context */
+int nxfers = 0;			/* Transfers started, by all threads */
+int nended = 0;			/* Transfers that sent END to every peer */
+int nclosed = 0;		/* Sending sockets that reached CLOSED */
+int failed = 0;			/* An event loop aborted */
 
 /* 
  * usage: how to use program
  */
 
 int usage() {
-	fprintf(stderr, "Usage: vs_send [-d] host1:port1 [host2:port2] ... file1 [file2]... \n");
+	fprintf(stderr, "Usage: vs_send [-d] [-m] [-u] [-c conns] [-F fec] [-r chunks] [-s secs] host1:port1[,host1b:port1b...] [host2:port2] ... file1 [file2]... \n");
 	exit(1);
 }
 
 int main(int argc, char* argv[]) {
-	int port;
-	char *hoststr;
-	struct hostent* hp;
-	struct in_addr *addr;
+	char *hoststr, *path, *save;
+	struct stripe *sp;
 	int c;
 	int i;
 
@@ -61,10 +169,32 @@ int main(int argc, char* argv[]) {
 	 */
 	opterr = 0;
 
-	while ((c = getopt(argc, argv, "d")) != -1) {
+	while ((c = getopt(argc, argv, "c:dF:mur:s:")) != -1) {
 		if (c == 'd') {
 			debug = 1;
 		}
+		else if (c == 'c') {
+			if ((nconns = atoi(optarg)) <= 0)
+				usage();
+		}
+		else if (c == 'F') {
+			if ((fec = atoi(optarg)) < 0)
+				usage();
+		}
+		else if (c == 'm') {
+			bulk = 1;
+		}
+		else if (c == 'r') {
+			if ((readahead = atoi(optarg)) <= 0)
+				usage();
+		}
+		else if (c == 's') {
+			if ((statsecs = atoi(optarg)) <= 0)
+				usage();
+		}
+		else if (c == 'u') {
+			uring = event_backend(EVENT_BACKEND_URING) == EVENT_BACKEND_URING;
+		}
 		else 
 			usage();
 	}
@@ -73,6 +203,10 @@ int main(int argc, char* argv[]) {
 		/* found last host:port? */
 		if (strchr(argv[i], ':') == NULL)
 			break;
+		if (npeers == MAXPEERS) {
+			fprintf(stderr, "vs_send: too many peers\n");
+			exit(1);
+		}
 		/* Make a copy of argument string that we can modify  */
 		hoststr = (char *) malloc(strlen(argv[i]) + 1);
 		if (hoststr == NULL) {
@@ -80,22 +214,20 @@ int main(int argc, char* argv[]) {
 			exit(1);
 		}
 		strcpy(hoststr, argv[i]);
-		port = atoi(strchr(hoststr, ':') + 1);
-		if (port <= 0) {
-			fprintf(stderr, "Bad destination port: %d\n", 
-				atoi(strchr(hoststr, ':') + 1));
-			exit(1);
+		/* Addresses of several paths to the peer are separated by commas */
+		for (path = strtok_r(hoststr, ",", &save); path != NULL; 
+		     path = strtok_r(NULL, ",", &save)) {
+			if (npaths[npeers] == MAXPATHS) {
+				fprintf(stderr, "vs_send: too many paths to a peer\n");
+				exit(1);
+			}
+			if (parseaddr(path, &paths[npeers][npaths[npeers]]) < 0)
+				return(0);
+			npaths[npeers]++;
 		}
-		*strchr(hoststr, ':') = '\0';
-		if ((hp = gethostbyname(hoststr)) == NULL || 
-		    (addr = (struct in_addr *)hp->h_addr) == NULL) {
-			fprintf(stderr,"Can't locate host \"%s\"\n", hoststr); 
-			return(0);
-		}
-		memset((char *)&peers[npeers], 0, sizeof(struct sockaddr_in));
-		peers[npeers].sin_family = AF_INET;
-		peers[npeers].sin_port = htons(port);
-		memcpy(&peers[npeers].sin_addr, addr, sizeof(struct in_addr));
+		if (npaths[npeers] == 0)
+			usage();
+		peers[npeers] = paths[npeers][0];
 		npeers++;
 		free(hoststr);
 	}
@@ -107,12 +239,54 @@ int main(int argc, char* argv[]) {
 		usage();
 	}
 
-	/* Launch senders for each file */
-	while (i < argc) { 
+	/* Launch senders for each file, or one for all */
+	if (bulk) {
+		send_bulk(&argv[i], argc - i);
+	}
+	else while (i < argc) { 
 		send_file(argv[i++]);
 	}
 
-	eventloop(0);
+	if (eventloop(0) < 0)
+		__atomic_store_n(&failed, 1, __ATOMIC_RELAXED);
+	for (sp = stripes; sp != NULL; sp = sp->next)
+		pthread_join(sp->tid, NULL);
+	/* Done only when every transfer sent END and its socket closed */
+	if (failed || nended < nxfers || nclosed < nxfers) {
+		fprintf(stderr, "vs_send: incomplete, %d transfers started, %d ended, %d closed\n",
+			nxfers, nended, nclosed);
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * parseaddr: parse host:port into addr. Returns -1 on failure.
+ */
+
+int parseaddr(char *str, struct sockaddr_in *addr) {
+	struct hostent* hp;
+	struct in_addr *in;
+	int port;
+
+	if (strchr(str, ':') == NULL)
+		usage();
+	port = atoi(strchr(str, ':') + 1);
+	if (port <= 0) {
+		fprintf(stderr, "Bad destination port: %d\n", 
+			atoi(strchr(str, ':') + 1));
+		exit(1);
+	}
+	*strchr(str, ':') = '\0';
+	if ((hp = gethostbyname(str)) == NULL || 
+	    (in = (struct in_addr *)hp->h_addr) == NULL) {
+		fprintf(stderr,"Can't locate host \"%s\"\n", str); 
+		return -1;
+	}
+	memset((char *)addr, 0, sizeof(struct sockaddr_in));
+	addr->sin_family = AF_INET;
+	addr->sin_port = htons(port);
+	memcpy(&addr->sin_addr, in, sizeof(struct in_addr));
 	return 0;
 }
 
@@ -138,6 +312,10 @@ int eventhandler(rudp_socket_t rsocket, rudp_event_t event, struct sockaddr_in *
 		if (debug) {
 			fprintf(stderr, "rudp_sender: socket closed\n");
 		}
+		if (statsecs) {
+			printstats(0, rsocket);
+		}
+		__atomic_add_fetch(&nclosed, 1, __ATOMIC_RELAXED);
 		break;
 	}
 	return 0;
@@ -145,112 +323,639 @@ int eventhandler(rudp_socket_t rsocket, rudp_event_t event, struct sockaddr_in *
 
 /*
  * send_file: initiate sending of a file. 
- * Create a RUDP socket for sending. Send the file name to the VS receiver.
- * Register a handler for input event, which will take care of sending
- * file data
+ * Create a RUDP socket for sending. Send the file name, size and identity
+ * to the VS receiver. Register a handler for its answers, which will
+ * start the sending of the file data where the receivers need it.
  */
 
 void send_file(char *filename) {
-	struct vsftp vs;
-	int vslen;
-	char *filename1;
-	int namelen;
+	u_int8_t msg[sizeof(u_int32_t) + VS_FILENAMELENGTH + 1 + VS_RESUMEINFO];
 	int file = 0;
-	int p;
-	rudp_socket_t rsock;
+	struct stat st;
 
-	if ((file = open(filename, O_RDONLY)) < 0) {
+	if ((file = open(filename, O_RDONLY)) < 0 || fstat(file, &st) < 0) {
 		perror("vs_sender: open");
 		exit(-1);
 	}
-	rsock = rudp_socket(0);
-	if (rsock == NULL) {
-		fprintf(stderr, "vs_send: rudp_socket() failed\n");
-		exit(1);
+	if (nconns > 1 && st.st_size >= 2 * VS_MINSTRIPE) {
+		close(file);
+		send_striped(filename, st.st_size);
+		return;
 	}
-	rudp_event_handler(rsock, eventhandler);
+	xfer_start(filename, file, msg, vs_header(msg, VS_TYPE_BEGIN, filename, &st), 
+		   peers, -1);
+}
+
+/*
+ * vs_header: BEGIN or STRIPE message up to the size and identity of a
+ * file. Returns its length.
+ */
+
+int vs_header(u_int8_t *msg, int type, char *filename, struct stat *st) {
+	u_int32_t vs_type = htonl(type);
+	char *filename1;
+	int namelen;
+	int vslen;
 
-	vs.vs_type = htonl(VS_TYPE_BEGIN);
+	memcpy(msg, &vs_type, sizeof(vs_type));
 
 	/* strip of any leading path name */
-	filename1 = filename;
-	if (strrchr(filename1, '/'))
-		filename1 = strrchr(filename1, '/') + 1;
+	filename1 = basename1(filename);
 	
-	/* Copy file name into VS data */
+	/* Copy file name, size and identity into VS data */
 	namelen = strlen(filename1) < VS_FILENAMELENGTH  ? strlen(filename1) : VS_FILENAMELENGTH;
-	strncpy(vs.vs_info.vs_filename, filename1, namelen);
+	memcpy(msg + sizeof(vs_type), filename1, namelen);
+	vslen = sizeof(vs_type) + namelen;
+	msg[vslen++] = '\0';
+	vs_put64(msg + vslen, st->st_size);
+	vs_put64(msg + vslen + VS_RESUMEINFO / 2, fileid(st));
+	return vslen + VS_RESUMEINFO;
+}
+
+/*
+ * xfer_start: create a RUDP socket in the current context for sending a
+ * file, up to byte end or to EOF if end is -1, and send its BEGIN or
+ * STRIPE message msg to the peers at to. The RESUME answers start the
+ * sending of the data.
+ */
+
+void xfer_start(char *filename, int file, u_int8_t *msg, int vslen, 
+		struct sockaddr_in *to, long end) {
+	rudp_socket_t rsock;
+	struct xfer *x;
+	int p;
+
+	rsock = rudp_socket(0);
+	if (rsock == NULL) {
+		fprintf(stderr, "vs_send: rudp_socket() failed\n");
+		exit(1);
+	}
+	__atomic_add_fetch(&nxfers, 1, __ATOMIC_RELAXED);
+	rudp_event_handler(rsock, eventhandler);
+	if (rudp_setsockopt(rsock, RUDP_OPT_FEC, fec) < 0) {
+		fprintf(stderr, "vs_send: bad FEC setting %d\n", fec);
+		exit(1);
+	}
+	/* The first messages go right behind the SYN */
+	rudp_setsockopt(rsock, RUDP_OPT_FASTOPEN, FASTOPEN);
+	rudp_recvfrom_handler(rsock, resumehandler);
+	/* The connections RESUME came over stay idle while the data goes out */
+	rudp_setsockopt(rsock, RUDP_OPT_IDLE, 0);
+	if ((x = calloc(1, sizeof(struct xfer))) == NULL) {
+		fprintf(stderr, "vs_send: malloc failed\n");
+		exit(1);
+	}
+	x->rsock = rsock;
+	x->filename = filename;
+	x->file = file;
+	x->end = end;
+	memcpy(x->to, to, npeers * sizeof(struct sockaddr_in));
+	x->next = xfers;
+	xfers = x;
 
-	vslen = sizeof(vs.vs_type) + namelen;
 	for (p = 0; p < npeers; p++) {
 		if (debug) {
-			fprintf(stderr, "vs_send: send BEGIN \"%s\" (%d bytes) to %s:%d\n",
-				filename, vslen, 
-				inet_ntoa(peers[p].sin_addr), ntohs(peers[p].sin_port));
+			fprintf(stderr, "vs_send: send %s \"%s\" (%d bytes) to %s:%d\n",
+				end < 0 ? "BEGIN" : "STRIPE", filename, vslen, 
+				inet_ntoa(to[p].sin_addr), ntohs(to[p].sin_port));
 		}
-		if (rudp_sendto(rsock, (char *) &vs, vslen, &peers[p]) < 0) {
+		if (rudp_sendto(rsock, msg, vslen, &to[p]) < 0) {
 			fprintf(stderr,"rudp_sender: send failure\n");
 			rudp_close(rsock);		
 			return;
 		}
 	}
-	event_fd(file, filesender, rsock, "filesender");
+}
+
+/*
+ * send_striped: send a large file over nconns connections, one range of
+ * it on each. Every stripe runs in a thread with a RUDP context of its
+ * own, so that they are not limited to one core, and goes to its own
+ * path of each peer if the peer has several.
+ */
+
+void send_striped(char *filename, long size) {
+	struct stripe *sp;
+	int n = nconns, i;
+
+	if (n > size / VS_MINSTRIPE)
+		n = size / VS_MINSTRIPE;
+	for (i = 0; i < n; i++) {
+		if ((sp = calloc(1, sizeof(struct stripe))) == NULL) {
+			fprintf(stderr, "vs_send: malloc failed\n");
+			exit(1);
+		}
+		sp->filename = filename;
+		sp->index = i;
+		sp->count = n;
+		sp->start = size / n * i;
+		sp->end = i == n - 1 ? size : size / n * (i + 1);
+		if (pthread_create(&sp->tid, NULL, stripe_main, sp) != 0) {
+			fprintf(stderr, "vs_send: pthread_create failed\n");
+			exit(1);
+		}
+		sp->next = stripes;
+		stripes = sp;
+	}
+}
+
+/*
+ * stripe_main: thread sending one stripe of a file, with its own RUDP
+ * context and event loop
+ */
+
+void *stripe_main(void *arg) {
+	struct stripe *sp = (struct stripe *) arg;
+	u_int8_t msg[sizeof(u_int32_t) + VS_FILENAMELENGTH + 1 + VS_RESUMEINFO + VS_STRIPEINFO];
+	struct sockaddr_in to[MAXPEERS];
+	u_int32_t w[2];
+	struct stat st;
+	rudp_ctx_t ctx;
+	int file, vslen, p;
+
+	if ((ctx = rudp_ctx_new()) == NULL) {
+		fprintf(stderr, "vs_send: rudp_ctx_new() failed\n");
+		exit(1);
+	}
+	rudp_ctx_use(ctx);
+	if (uring) {
+		event_backend(EVENT_BACKEND_URING);
+	}
+	if ((file = open(sp->filename, O_RDONLY)) < 0 || fstat(file, &st) < 0) {
+		perror("vs_sender: open");
+		exit(-1);
+	}
+	vslen = vs_header(msg, VS_TYPE_STRIPE, sp->filename, &st);
+	vs_put64(msg + vslen, sp->start);
+	vs_put64(msg + vslen + VS_OFFSETLEN, sp->end);
+	w[0] = htonl(sp->index);
+	w[1] = htonl(sp->count);
+	memcpy(msg + vslen + 2 * VS_OFFSETLEN, w, sizeof(w));
+	vslen += VS_STRIPEINFO;
+	for (p = 0; p < npeers; p++)
+		to[p] = paths[p][sp->index % npaths[p]];
+	xfer_start(sp->filename, file, msg, vslen, to, sp->end);
+
+	if (eventloop(0) < 0)
+		__atomic_store_n(&failed, 1, __ATOMIC_RELAXED);
+	rudp_ctx_use(NULL);
+	rudp_ctx_free(ctx);
+	return NULL;
+}
+
+/*
+ * fileid: identity of a file, which changes when the file is replaced
+ * or modified (FNV-1a over device, inode, size and modification time)
+ */
+
+u_int64_t fileid(struct stat *st) {
+	u_int64_t v[5] = {st->st_dev, st->st_ino, st->st_size, 
+			  st->st_mtim.tv_sec, st->st_mtim.tv_nsec};
+	u_int64_t h = 14695981039346656037ULL;
+	unsigned int i;
+
+	for (i = 0; i < sizeof(v); i++) {
+		h ^= ((u_int8_t *) v)[i];
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
+/*
+ * resumehandler: callback function for the RESUME answers to BEGIN or
+ * STRIPE. Once all peers have answered, tell them where the data
+ * continues and start sending it from there.
+ */
+
+int resumehandler(rudp_socket_t rsock, struct sockaddr_in *remote, char *buf, int len) {
+	u_int8_t msg[sizeof(u_int32_t) + VS_OFFSETLEN];
+	u_int32_t vs_type;
+	u_int64_t offset;
+	struct xfer *x, **xp;
+	long size;
+	int p;
+
+	if (len < (int) sizeof(vs_type) + VS_OFFSETLEN)
+		return 0;
+	memcpy(&vs_type, buf, sizeof(vs_type));
+	if (ntohl(vs_type) != VS_TYPE_RESUME)
+		return 0;
+	for (xp = &xfers; *xp != NULL && (*xp)->rsock != rsock; xp = &(*xp)->next)
+		;
+	if ((x = *xp) == NULL)
+		return 0;	/* Sending already */
+	for (p = 0; p < npeers; p++) {
+		if (x->to[p].sin_addr.s_addr == remote->sin_addr.s_addr &&
+		    x->to[p].sin_port == remote->sin_port)
+			break;
+	}
+	if (p == npeers && npeers == 1)
+		p = 0;		/* Answering from another address */
+	if (p == npeers || x->answered[p])
+		return 0;
+	x->answered[p] = 1;
+	offset = vs_get64((u_int8_t *) buf + sizeof(vs_type));
+	if (x->nanswers++ == 0 || offset < x->offset)
+		x->offset = offset;
+	if (x->nanswers < npeers)
+		return 0;
+
+	*xp = x->next;
+	if (x->end >= 0 && x->offset > (u_int64_t) x->end)
+		x->offset = x->end;
+	if (lseek(x->file, x->offset, SEEK_SET) < 0) {
+		perror("vs_send: lseek");
+		close(x->file);
+		free(x);
+		rudp_close(rsock);
+		return 0;
+	}
+	if (x->offset > 0 && x->end < 0)
+		printf("vs_send: resuming \"%s\" at byte %llu\n", x->filename,
+		       (unsigned long long) x->offset);
+	vs_type = htonl(VS_TYPE_OFFSET);
+	memcpy(msg, &vs_type, sizeof(vs_type));
+	vs_put64(msg + sizeof(vs_type), x->offset);
+	for (p = 0; p < npeers; p++) {
+		if (debug) {
+			fprintf(stderr, "vs_send: send OFFSET %llu to %s:%d\n",
+				(unsigned long long) x->offset,
+				inet_ntoa(x->to[p].sin_addr), ntohs(x->to[p].sin_port));
+		}
+		if (rudp_sendto(rsock, msg, sizeof(msg), &x->to[p]) < 0) {
+			fprintf(stderr,"rudp_sender: send failure\n");
+			close(x->file);
+			free(x);
+			rudp_close(rsock);
+			return 0;
+		}
+	}
+	size = x->end < 0 ? -1 : x->end - (long) x->offset;
+	rudp_setsockopt(rsock, RUDP_OPT_UNORDERED, 1);
+	reader_start(rsock, x->to, &x->filename, &x->file, &size, 1, VS_TYPE_DATA);
+	free(x);
+	return 0;
+}
+
+/*
+ * basename1: file name without any leading path name
+ */
+
+char *basename1(char *filename) {
+	return strrchr(filename, '/') ? strrchr(filename, '/') + 1 : filename;
+}
+
+/*
+ * send_bulk: initiate a bulk transfer of files.
+ * Create a RUDP socket for sending. Send the manifest with the names and
+ * sizes of the files, then let a reader stream their contents. The reader
+ * opens each file when it gets to it, so that only one is open at a time.
+ */
+
+void send_bulk(char **filenames, int nfiles) {
+	u_int8_t msg[sizeof(u_int32_t) + VS_MAXBULK];
+	u_int32_t vs_type = htonl(VS_TYPE_MANIFEST), size;
+	int *files;
+	long *sizes;
+	struct stat st;
+	char *name;
+	int msglen, namelen = 0;
+	int f, p;
+	rudp_socket_t rsock;
+
+	if ((files = malloc(nfiles * sizeof(int))) == NULL ||
+	    (sizes = malloc(nfiles * sizeof(long))) == NULL) {
+		fprintf(stderr, "vs_send: malloc failed\n");
+		exit(1);
+	}
+	rsock = rudp_socket(0);
+	if (rsock == NULL) {
+		fprintf(stderr, "vs_send: rudp_socket() failed\n");
+		exit(1);
+	}
+	__atomic_add_fetch(&nxfers, 1, __ATOMIC_RELAXED);
+	rudp_event_handler(rsock, eventhandler);
+	if (rudp_setsockopt(rsock, RUDP_OPT_FEC, fec) < 0) {
+		fprintf(stderr, "vs_send: bad FEC setting %d\n", fec);
+		exit(1);
+	}
+	/* The first messages go right behind the SYN */
+	rudp_setsockopt(rsock, RUDP_OPT_FASTOPEN, FASTOPEN);
+
+	memcpy(msg, &vs_type, sizeof(vs_type));
+	msglen = sizeof(vs_type);
+	for (f = 0; f <= nfiles; f++) {
+		if (f < nfiles) {
+			if (stat(filenames[f], &st) < 0) {
+				perror("vs_sender: stat");
+				exit(-1);
+			}
+			files[f] = -1;
+			if (!S_ISREG(st.st_mode) || st.st_size > 0xFFFFFFFFL) {
+				fprintf(stderr, "vs_send: \"%s\" is not a regular file under 4 GB\n",
+					filenames[f]);
+				exit(1);
+			}
+			sizes[f] = st.st_size;
+			name = basename1(filenames[f]);
+			namelen = strlen(name) < VS_FILENAMELENGTH ? strlen(name) : VS_FILENAMELENGTH;
+		}
+		/* Send the manifest message when full, and the last one */
+		if (f == nfiles || msglen + VS_ENTRYHDR + namelen > (int) sizeof(msg)) {
+			for (p = 0; p < npeers; p++) {
+				if (debug) {
+					fprintf(stderr, "vs_send: send MANIFEST (%d bytes) to %s:%d\n",
+						msglen, inet_ntoa(peers[p].sin_addr), 
+						ntohs(peers[p].sin_port));
+				}
+				if (rudp_sendto(rsock, msg, msglen, &peers[p]) < 0) {
+					fprintf(stderr,"rudp_sender: send failure\n");
+					rudp_close(rsock);		
+					return;
+				}
+			}
+			msglen = sizeof(vs_type);
+		}
+		if (f < nfiles) {
+			size = htonl(sizes[f]);
+			memcpy(msg + msglen, &size, sizeof(size));
+			msg[msglen + sizeof(size)] = namelen;
+			memcpy(msg + msglen + VS_ENTRYHDR, name, namelen);
+			msglen += VS_ENTRYHDR + namelen;
+		}
+	}
+	reader_start(rsock, peers, filenames, files, sizes, nfiles, VS_TYPE_BULK);
+	free(files);
+	free(sizes);
+}
+
+/*
+ * reader_start: start the reader of a transfer and send what it reads.
+ * The reader takes over the files.
+ */
+
+void reader_start(rudp_socket_t rsock, struct sockaddr_in *to, char **names, int *files, 
+		  long *sizes, int nfiles, int type) {
+	struct reader *rd;
+	int f;
+
+	if ((rd = calloc(1, sizeof(struct reader))) == NULL ||
+	    (rd->chunks = malloc(readahead * sizeof(struct chunk))) == NULL ||
+	    (rd->names = malloc(nfiles * sizeof(char *))) == NULL ||
+	    (rd->files = malloc(nfiles * sizeof(int))) == NULL ||
+	    (rd->sizes = malloc(nfiles * sizeof(long))) == NULL) {
+		fprintf(stderr, "vs_send: malloc failed\n");
+		exit(1);
+	}
+	for (f = 0; f < nfiles; f++) {
+		rd->names[f] = names[f];
+		rd->files[f] = files[f];
+		rd->sizes[f] = sizes[f];
+	}
+	rd->nfiles = nfiles;
+	rd->type = type;
+	rd->chunksize = type == VS_TYPE_BULK ? VS_MAXBULK : VS_MAXDATA;
+	rd->rsock = rsock;
+	memcpy(rd->to, to, npeers * sizeof(struct sockaddr_in));
+	rd->nchunks = readahead;
+	if (pipe(rd->notify) < 0 || sem_init(&rd->free, 0, readahead) < 0) {
+		perror("vs_send: pipe");
+		exit(1);
+	}
+	if (pthread_create(&rd->tid, NULL, reader_main, rd) != 0) {
+		fprintf(stderr, "vs_send: pthread_create failed\n");
+		exit(1);
+	}
+	event_fd(rd->notify[0], filesender, rd, "filesender");
+	if (statsecs) {
+		event_periodic(statsecs, printstats, rsock, "printstats");
+	}
+}
+
+/*
+ * printstats: periodic callback printing RUDP statistics of a socket
+ */
+
+int printstats(int fd, void *arg) {
+	rudp_socket_t rsock = (rudp_socket_t) arg;
+	struct rudp_stats st;
+	struct rudp_peer_stats ps[MAXSTATPEERS];
+	struct rudp_pool_stats pools[MAXSTATPOOLS];
+	int n, np, i;
+
+	if ((n = rudp_getstats(rsock, &st, ps, MAXSTATPEERS)) < 0)
+		return 0;
+	fprintf(stderr, "%s: stats: peers %d sent %lu/%luB rcvd %lu/%luB "
+		"retrans %lu acked %lu timeouts %lu dupacks %lu\n", PROGNAME,
+		st.npeers, st.c.pkts_sent, st.c.bytes_sent, st.c.pkts_rcvd, 
+		st.c.bytes_rcvd, st.c.pkts_retrans, st.c.pkts_acked, 
+		st.c.timeouts, st.c.dup_acks);
+	for (i = 0; i < n && i < MAXSTATPEERS; i++) {
+		fprintf(stderr, "%s: stats:   %s:%d %s sent %lu/%luB rcvd %lu/%luB "
+			"retrans %lu acked %lu timeouts %lu dupacks %lu "
+			"win %d inflight %d queued %d srtt %ldus rto %ldus\n", PROGNAME,
+			inet_ntoa(ps[i].peer.sin_addr), ntohs(ps[i].peer.sin_port),
+			ps[i].outgoing ? "out" : "in",
+			ps[i].c.pkts_sent, ps[i].c.bytes_sent, ps[i].c.pkts_rcvd,
+			ps[i].c.bytes_rcvd, ps[i].c.pkts_retrans, ps[i].c.pkts_acked,
+			ps[i].c.timeouts, ps[i].c.dup_acks, ps[i].window, 
+			ps[i].inflight, ps[i].queued, ps[i].srtt_us, ps[i].rto_us);
+	}
+	np = rudp_poolstats(pools, MAXSTATPOOLS);
+	for (i = 0; i < np && i < MAXSTATPOOLS; i++)
+		fprintf(stderr, "%s: stats: pool %s in use %lu peak %lu capacity %lu "
+			"objsize %lu slabs %lu huge %lu\n", PROGNAME, pools[i].name,
+			pools[i].in_use, pools[i].high_water, pools[i].capacity,
+			pools[i].objsize, pools[i].slabs, pools[i].huge_slabs);
+	return 0;
+}
+
+/*
+ * reader_main: reader thread of a transfer. Fills the free chunks in
+ * order, and asks the kernel to fetch the data of the next ring's worth
+ * ahead. Stops after the end of the last file or an error, which it
+ * passes on as a chunk of its own. A file that ends before its size is
+ * an error.
+ */
+
+void *reader_main(void *arg) {
+	struct reader *rd = (struct reader *) arg;
+	struct chunk *ck;
+	off_t pos = 0, hinted = 0, ahead = (off_t) rd->nchunks * rd->chunksize;
+	long want;
+	int cur = 0, n, fresh = 1;
+	int tail = 0;
+	char c = 0;
+
+	for (;;) {
+		while (sem_wait(&rd->free) < 0 && errno == EINTR)
+			;
+		if (rd->stop)
+			break;
+		ck = &rd->chunks[tail];
+		ck->len = 0;
+		ck->err = 0;
+		ck->off = pos;
+		while (ck->len < rd->chunksize && cur < rd->nfiles) {
+			if (fresh) {
+				/* Starting a file, where a resumed one was seeked to */
+				if (rd->files[cur] < 0 &&
+				    (rd->files[cur] = open(rd->names[cur], O_RDONLY)) < 0) {
+					ck->err = errno;
+					ck->len = -1;
+					break;
+				}
+				if ((pos = lseek(rd->files[cur], 0, SEEK_CUR)) < 0)
+					pos = 0;
+				posix_fadvise(rd->files[cur], 0, 0, POSIX_FADV_SEQUENTIAL);
+				hinted = pos;
+				fresh = 0;
+				if (ck->len == 0)
+					ck->off = pos;
+			}
+			if (pos >= hinted) {
+				posix_fadvise(rd->files[cur], pos, ahead, POSIX_FADV_WILLNEED);
+				hinted = pos + ahead;
+			}
+			want = rd->chunksize - ck->len;
+			if (rd->sizes[cur] >= 0 && want > rd->sizes[cur])
+				want = rd->sizes[cur];
+			n = want > 0 ? read(rd->files[cur], ck->data + ck->len, want) : 0;
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n < 0 || (n == 0 && rd->sizes[cur] > 0)) {
+				ck->err = n < 0 ? errno : EIO;
+				ck->len = -1;
+				break;
+			}
+			ck->len += n;
+			pos += n;
+			if (rd->sizes[cur] >= 0)
+				rd->sizes[cur] -= n;
+			if (n == 0 || rd->sizes[cur] == 0) {
+				/* On to the next file */
+				close(rd->files[cur]);
+				rd->files[cur++] = -1;
+				fresh = 1;
+			}
+			if (rd->type != VS_TYPE_BULK && ck->len > 0)
+				break;		/* One read per chunk */
+		}
+		tail = (tail + 1) % rd->nchunks;
+		if (write(rd->notify[1], &c, 1) != 1)
+			break;
+		if (ck->len <= 0)
+			break;
+	}
+	return NULL;
+}
+
+/*
+ * reader_stop: stop the reader thread of a file and free it
+ */
+
+void reader_stop(struct reader *rd) {
+	int f;
+
+	event_fd_delete(filesender, rd);
+	rd->stop = 1;
+	sem_post(&rd->free);
+	pthread_join(rd->tid, NULL);
+	close(rd->notify[0]);
+	close(rd->notify[1]);
+	for (f = 0; f < rd->nfiles; f++)
+		if (rd->files[f] >= 0)
+			close(rd->files[f]);
+	sem_destroy(&rd->free);
+	free(rd->names);
+	free(rd->files);
+	free(rd->sizes);
+	free(rd->chunks);
+	free(rd);
 }
 
 /*
  * filesender: callback function for handling sending of the file.
- * Will be called when data is available on the file (which is always
- * true, until the file is closed...). 
+ * Will be called when the reader thread has filled chunks of the file,
+ * or of the files of a bulk transfer.
  * Send file data. Detect end of file and tell VS peers that transfer is
  * complete
  */
 
-int filesender(int file, void *arg) {
-    rudp_socket_t rsock = 	(rudp_socket_t) arg;
-    int bytes;
-    struct vsftp vs;
+int filesender(int fd, void *arg) {
+    struct reader *rd = (struct reader *) arg;
+    rudp_socket_t rsock = rd->rsock;
+    struct chunk *ck;
+    char ready[64];
+    int n, k;
+    u_int32_t vs_type;
+    u_int8_t hdr[VS_DATAHDR];
+    struct iovec iov[2];
     int vslen;
     int p;
 
-    bytes = read(file, &vs.vs_info.vs_data,VS_MAXDATA);
-    if (bytes < 0) {
-	perror("filesender: read");
-	event_fd_delete(filesender, rsock);
-	rudp_close(rsock);		
-    }
-    else if (bytes == 0) {
-	vs.vs_type = htonl(VS_TYPE_END);
-	vslen = sizeof(vs.vs_type);
-	for (p = 0; p < npeers; p++) {
-	    if (debug) {
-		fprintf(stderr, "vs_send: send END (%d bytes) to %s:%d\n", 
-			vslen, inet_ntoa(peers[p].sin_addr), htons(peers[p].sin_port));
-	    }
-	    if (rudp_sendto(rsock, (char *) &vs, vslen, &peers[p]) < 0) {
-		fprintf(stderr,"rudp_sender: send failure\n");
-		break;
+    if ((n = read(fd, ready, sizeof(ready))) <= 0)
+	return 0;
+    for (k = 0; k < n; k++) {
+	/* The type header and the file data go out from separate buffers */
+	iov[0].iov_base = &vs_type;
+	iov[0].iov_len = sizeof(vs_type);
+	ck = &rd->chunks[rd->head];
+	rd->head = (rd->head + 1) % rd->nchunks;
+	if (ck->len < 0) {
+	    errno = ck->err;
+	    perror("filesender: read");
+	    reader_stop(rd);
+	    rudp_close(rsock);		
+	    return 0;
+	}
+	else if (ck->len == 0) {
+	    vs_type = htonl(VS_TYPE_END);
+	    vslen = sizeof(vs_type);
+	    /* After all DATA */
+	    rudp_setsockopt(rsock, RUDP_OPT_UNORDERED, 0);
+	    for (p = 0; p < npeers; p++) {
+		if (debug) {
+		    fprintf(stderr, "vs_send: send END (%d bytes) to %s:%d\n", 
+			    vslen, inet_ntoa(rd->to[p].sin_addr), htons(rd->to[p].sin_port));
+		}
+		if (rudp_sendv(rsock, iov, 1, &rd->to[p]) < 0) {
+		    fprintf(stderr,"rudp_sender: send failure\n");
+		    break;
+		}
 	    }
+	    if (p == npeers)
+		__atomic_add_fetch(&nended, 1, __ATOMIC_RELAXED);
+	    reader_stop(rd);
+	    rudp_close(rsock);		
+	    return 0;
 	}
-	event_fd_delete(filesender, rsock);
-	rudp_close(rsock);		
-    }
-    else {
-	vs.vs_type = htonl(VS_TYPE_DATA);
-	vslen = sizeof(vs.vs_type) + bytes;
+	vs_type = htonl(rd->type);
+	iov[1].iov_base = ck->data;
+	iov[1].iov_len = ck->len;
+	if (rd->type == VS_TYPE_DATA) {
+	    /* DATA goes out tagged with its offset, see vsftp.h */
+	    memcpy(hdr, &vs_type, sizeof(vs_type));
+	    vs_put64(hdr + sizeof(vs_type), ck->off);
+	    iov[0].iov_base = hdr;
+	    iov[0].iov_len = VS_DATAHDR;
+	}
+	vslen = iov[0].iov_len + ck->len;
 	for (p = 0; p < npeers; p++) {
 	    if (debug) {
-		fprintf(stderr, "vs_send: send DATA (%d bytes) to %s:%d\n", 
-			vslen, inet_ntoa(peers[p].sin_addr), htons(peers[p].sin_port));				
+		fprintf(stderr, "vs_send: send %s (%d bytes) to %s:%d\n", 
+			rd->type == VS_TYPE_BULK ? "BULK" : "DATA",
+			vslen, inet_ntoa(rd->to[p].sin_addr), htons(rd->to[p].sin_port));				
 	    }
-	    if (rudp_sendto(rsock, (char *) &vs, vslen, &peers[p]) < 0) {
+	    if (rudp_sendv(rsock, iov, 2, &rd->to[p]) < 0) {
 		fprintf(stderr,"rudp_sender: send failure\n");
-		event_fd_delete(filesender, rsock);
+		reader_stop(rd);
 		rudp_close(rsock);		
-		break;
+		return 0;
 	    }
 	}
+	/* The data has been copied into packets: the chunk is free */
+	sem_post(&rd->free);
     }
     return 0;
 }
-
-
@@ -1,10 +1,73 @@
 #define VS_MINLEN	4
 #define VS_FILENAMELENGTH 128
 #define VS_MAXDATA	128
+#define VS_MAXBULK	996		/* Bulk stream bytes per message, with the
+					 * type a full RUDP packet */
 
 #define VS_TYPE_BEGIN	1
 #define VS_TYPE_DATA	2
 #define VS_TYPE_END 	3
+#define VS_TYPE_MANIFEST 4		/* Files of a bulk transfer, see below */
+#define VS_TYPE_BULK	5		/* Next bytes of the bulk stream */
+#define VS_TYPE_RESUME	6		/* Receiver -> sender: bytes it has of the file */
+#define VS_TYPE_OFFSET	7		/* DATA continues at this offset */
+#define VS_TYPE_STRIPE	8		/* BEGIN of a range of a file, see below */
+
+/*
+ * DATA carries the offset of its bytes in the file, in VS_OFFSETLEN
+ * bytes after the type. The receiver writes each where it belongs, so
+ * DATA is sent unordered (RUDP_OPT_UNORDERED) and one lost packet does
+ * not hold back the ones behind it. The other messages stay in order;
+ * END arrives after all DATA.
+ */
+
+#define VS_DATAHDR	12		/* Type and offset */
+
+/*
+ * Bulk transfer: one connection carries any number of files. MANIFEST
+ * messages list them, each entry a 32-bit size in network byte order,
+ * the name length in one byte and the name. BULK messages then carry the
+ * contents of the files back to back in manifest order, and END closes
+ * the transfer.
+ */
+
+#define VS_ENTRYHDR	5
+
+/*
+ * Resumable transfer: BEGIN carries, after the file name and a '\0', the
+ * size of the file and an identity that changes when the file does. The
+ * receiver answers with RESUME and the number of bytes of that file it
+ * already has, as recorded in its checkpoint. The sender then sends
+ * OFFSET with where DATA continues, the smallest offset of its peers.
+ * 64-bit values are sent as two 32-bit words in network byte order, the
+ * high one first.
+ */
+
+#define VS_RESUMEINFO	16		/* Size and identity after the name */
+#define VS_OFFSETLEN	8
+
+/*
+ * Striped transfer: a large file is split into ranges, each sent over a
+ * connection of its own. STRIPE is BEGIN followed by the range, start
+ * and end offsets, and the stripe's index and the number of stripes,
+ * 32 bits each. RESUME, OFFSET, DATA and END follow as for a file, with
+ * offsets in the file. Stripes are not kept across transfers.
+ */
+
+#define VS_STRIPEINFO	24		/* Range, index and count after VS_RESUMEINFO */
+
+static inline void vs_put64(u_int8_t *p, u_int64_t v) {
+	u_int32_t w[2] = {htonl(v >> 32), htonl(v & 0xFFFFFFFF)};
+
+	memcpy(p, w, sizeof(w));
+}
+
+static inline u_int64_t vs_get64(const u_int8_t *p) {
+	u_int32_t w[2];
+
+	memcpy(w, p, sizeof(w));
+	return ((u_int64_t) ntohl(w[0]) << 32) | ntohl(w[1]);
+}
 
 struct vsftp {
 	u_int32_t vs_type;